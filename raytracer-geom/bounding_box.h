@@ -0,0 +1,91 @@
+#pragma once
+
+#include <vector.h>
+#include <triangle.h>
+#include <polygon.h>
+#include <sphere.h>
+#include <ray.h>
+
+#include <algorithm>
+#include <limits>
+
+struct BoundingBox {
+    Vector min = Vector(std::numeric_limits<double>::infinity(),
+                        std::numeric_limits<double>::infinity(),
+                        std::numeric_limits<double>::infinity());
+    Vector max = Vector(-std::numeric_limits<double>::infinity(),
+                        -std::numeric_limits<double>::infinity(),
+                        -std::numeric_limits<double>::infinity());
+
+    bool IsEmpty() const {
+        return min[0] > max[0] || min[1] > max[1] || min[2] > max[2];
+    }
+
+    void Extend(const Vector& point) {
+        for (size_t i = 0; i < 3; ++i) {
+            min[i] = std::min(min[i], point[i]);
+            max[i] = std::max(max[i], point[i]);
+        }
+    }
+
+    void Extend(const BoundingBox& other) {
+        if (other.IsEmpty()) {
+            return;
+        }
+        Extend(other.min);
+        Extend(other.max);
+    }
+
+    Vector Center() const {
+        return (min + max) * 0.5;
+    }
+};
+
+BoundingBox GetBoundingBox(const Triangle& triangle) {
+    BoundingBox box;
+    box.Extend(triangle[0]);
+    box.Extend(triangle[1]);
+    box.Extend(triangle[2]);
+    return box;
+}
+
+BoundingBox GetBoundingBox(const Polygon& polygon) {
+    BoundingBox box;
+    for (size_t i = 0; i < polygon.Size(); ++i) {
+        box.Extend(polygon[i]);
+    }
+    return box;
+}
+
+BoundingBox GetBoundingBox(const Sphere& sphere) {
+    Vector radius(sphere.GetRadius(), sphere.GetRadius(), sphere.GetRadius());
+    return BoundingBox{sphere.GetCenter() - radius, sphere.GetCenter() + radius};
+}
+
+// slab test on a slightly padded box, a hit farther than max_distance is treated as a miss
+bool IntersectsBox(const Ray& ray, const BoundingBox& box,
+                   double max_distance = std::numeric_limits<double>::infinity()) {
+    const double epsilon = 0.000001;
+    double t_near = -std::numeric_limits<double>::infinity();
+    double t_far = std::numeric_limits<double>::infinity();
+
+    for (size_t i = 0; i < 3; ++i) {
+        double origin = ray.GetOrigin()[i];
+        double direction = ray.GetDirection()[i];
+        if (direction == 0.0) {
+            if (origin < box.min[i] - epsilon || origin > box.max[i] + epsilon) {
+                return false;
+            }
+            continue;
+        }
+        double t1 = (box.min[i] - epsilon - origin) / direction;
+        double t2 = (box.max[i] + epsilon - origin) / direction;
+        if (t1 > t2) {
+            std::swap(t1, t2);
+        }
+        t_near = std::max(t_near, t1);
+        t_far = std::min(t_far, t2);
+    }
+
+    return t_near <= t_far && t_far >= 0 && t_near <= max_distance;
+}
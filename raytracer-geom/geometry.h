@@ -4,46 +4,56 @@
 #include <sphere.h>
 #include <intersection.h>
 #include <triangle.h>
+#include <polygon.h>
 #include <ray.h>
+#include <hit_record.h>
 
+#include <algorithm>
+#include <limits>
 #include <optional>
+#include <span>
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere) {
+bool UpdateClosestHit(const Ray& ray, const Sphere& sphere, size_t primitive, HitRecord* hit) {
+    ++hit->tests;
     const double epsilon = 0.000000000001;
     Vector co = ray.GetOrigin() - sphere.GetCenter();
 
     double d_prod_co = 2 * DotProduct(ray.GetDirection(), co);
-    double co_squared_minus_r_squared = std::pow(Length(co), 2) - std::pow(sphere.GetRadius(), 2);
+    double co_squared_minus_r_squared = DotProduct(co, co) - sphere.GetRadius() * sphere.GetRadius();
 
-    double determinant_squared = std::pow(d_prod_co, 2) - 4 * co_squared_minus_r_squared;
+    double determinant_squared = d_prod_co * d_prod_co - 4 * co_squared_minus_r_squared;
 
+    double t;
+    bool inside = false;
     if (determinant_squared >= epsilon) {
         double determinant = std::sqrt(determinant_squared);
         double t1 = (-d_prod_co + determinant) / 2;
         double t2 = (-d_prod_co - determinant) / 2;
         if (t2 <= -epsilon && t1 > epsilon) {
-            Vector point = ray.GetOrigin() + ray.GetDirection() * t1;
-            Vector normal = -(point - sphere.GetCenter());
-            return std::make_optional<Intersection>(point, normal, t1);
+            t = t1;
+            inside = true;
         } else if (t2 > epsilon && t1 > epsilon) {
-            Vector point = ray.GetOrigin() + ray.GetDirection() * t2;
-            Vector normal = point - sphere.GetCenter();
-            return std::make_optional<Intersection>(point, normal, t2);
+            t = t2;
         } else {
             // discussible
-            return std::nullopt;
+            return false;
         }
     } else if (determinant_squared > -epsilon && determinant_squared < epsilon) {
-        double t = -d_prod_co / 2;
-        Vector point = ray.GetOrigin() + ray.GetDirection() * t;
-        Vector normal = point - sphere.GetCenter();
-        return std::make_optional<Intersection>(point, normal, t);
+        t = -d_prod_co / 2;
     } else {
-        return std::nullopt;
+        return false;
+    }
+
+    if (t >= hit->distance) {
+        return false;
     }
+    *hit = HitRecord{t, 0, 0, primitive, PrimitiveKind::kSphere, inside, hit->tests};
+    return true;
 }
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& triangle) {
+// Moller-Trumbore, u and v are kept in the hit record for normal interpolation
+bool UpdateClosestHit(const Ray& ray, const Triangle& triangle, size_t primitive, HitRecord* hit) {
+    ++hit->tests;
     const double epsilon = 0.000000000001;
     Vector edge_ab = triangle[1] - triangle[0];
     Vector edge_ac = triangle[2] - triangle[0];
@@ -51,33 +61,150 @@ std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& tria
     double a = DotProduct(edge_ab, h);
 
     if (a > -epsilon && a < epsilon) {
-        return std::nullopt;
+        return false;
     }
 
     Vector s = ray.GetOrigin() - triangle[0];
     double u = DotProduct(s, h) / a;
     if (u < -epsilon || u > 1.0 + epsilon) {
-        return std::nullopt;
+        return false;
     }
 
     Vector q = CrossProduct(s, edge_ab);
     double v = DotProduct(ray.GetDirection(), q) / a;
     if (v < -epsilon || u + v > 1.0 + epsilon) {
-        return std::nullopt;
+        return false;
     }
 
     double t = DotProduct(edge_ac, q) / a;
 
-    if (t > epsilon) {
-        Vector point = ray.GetOrigin() + ray.GetDirection() * t;
-        Vector normal = CrossProduct(triangle[1] - triangle[0], triangle[2] - triangle[0]);
-        if (DotProduct(normal, ray.GetDirection()) > 0) {
-            -normal;
+    if (t <= epsilon || t >= hit->distance) {
+        return false;
+    }
+    *hit = HitRecord{t, u, v, primitive, PrimitiveKind::kTriangle, false, hit->tests};
+    return true;
+}
+
+// the plane of the polygon is hit on the inner side of every edge, with the tolerance of
+// the triangle test on the edge coordinate relative to the whole polygon
+bool UpdateClosestHit(const Ray& ray, const Polygon& polygon, size_t primitive, HitRecord* hit) {
+    ++hit->tests;
+    const double epsilon = 0.000000000001;
+    const Vector& normal = polygon.GetNormal();
+    double cosine = DotProduct(normal, ray.GetDirection());
+    if (cosine > -epsilon && cosine < epsilon) {
+        return false;
+    }
+    double t = DotProduct(normal, polygon[0] - ray.GetOrigin()) / cosine;
+    if (t <= epsilon || t >= hit->distance) {
+        return false;
+    }
+    Vector point = ray.GetOrigin() + ray.GetDirection() * t;
+    const size_t size = polygon.Size();
+    const double tolerance = -epsilon * 2 * polygon.Area();
+    for (size_t i = 0; i < size; ++i) {
+        const Vector& a = polygon[i];
+        const Vector& b = polygon[i + 1 == size ? 0 : i + 1];
+        if (DotProduct(CrossProduct(b - a, point - a), normal) < tolerance) {
+            return false;
         }
-        return std::make_optional<Intersection>(point, normal, t);
-    } else {
+    }
+    *hit = HitRecord{t, 0, 0, primitive, PrimitiveKind::kPolygon, false, hit->tests};
+    return true;
+}
+
+Intersection GetIntersection(const Ray& ray, const HitRecord& hit, const Sphere& sphere) {
+    Vector point = ray.GetOrigin() + ray.GetDirection() * hit.distance;
+    Vector normal = point - sphere.GetCenter();
+    if (hit.inside) {
+        -normal;
+    }
+    return Intersection(point, normal, hit.distance);
+}
+
+Intersection GetIntersection(const Ray& ray, const HitRecord& hit, const Triangle& triangle) {
+    Vector point = ray.GetOrigin() + ray.GetDirection() * hit.distance;
+    Vector normal = CrossProduct(triangle[1] - triangle[0], triangle[2] - triangle[0]);
+    if (DotProduct(normal, ray.GetDirection()) > 0) {
+        -normal;
+    }
+    return Intersection(point, normal, hit.distance);
+}
+
+// shading normal interpolated from per-vertex normals
+Intersection GetInterpolatedIntersection(const Ray& ray, const HitRecord& hit,
+                                         const Triangle& normals) {
+    Vector point = ray.GetOrigin() + ray.GetDirection() * hit.distance;
+    Vector normal = normals[0] * (1 - hit.u - hit.v) + normals[1] * hit.u + normals[2] * hit.v;
+    if (DotProduct(normal, ray.GetDirection()) > 0) {
+        -normal;
+    }
+    return Intersection(point, normal, hit.distance);
+}
+
+Intersection GetIntersection(const Ray& ray, const HitRecord& hit, const Polygon& polygon) {
+    Vector point = ray.GetOrigin() + ray.GetDirection() * hit.distance;
+    Vector normal = polygon.GetNormal();
+    if (DotProduct(normal, ray.GetDirection()) > 0) {
+        -normal;
+    }
+    return Intersection(point, normal, hit.distance);
+}
+
+// Interpolated inside the fan triangle (0, i, i + 1) that holds the hit, so the shading
+// is the same as that of the triangulated face.
+Intersection GetInterpolatedIntersection(const Ray& ray, const HitRecord& hit,
+                                         const Polygon& polygon,
+                                         std::span<const Vector> normals) {
+    Vector point = ray.GetOrigin() + ray.GetDirection() * hit.distance;
+    const Vector& plane_normal = polygon.GetNormal();
+    Vector best = Vector(1, 0, 0);
+    size_t best_fan = 1;
+    double best_margin = -std::numeric_limits<double>::infinity();
+    for (size_t i = 1; i + 1 < polygon.Size(); ++i) {
+        Vector edge_ab = polygon[i] - polygon[0];
+        Vector edge_ac = polygon[i + 1] - polygon[0];
+        Vector to_point = point - polygon[0];
+        double area = DotProduct(CrossProduct(edge_ab, edge_ac), plane_normal);
+        double u = DotProduct(CrossProduct(to_point, edge_ac), plane_normal) / area;
+        double v = DotProduct(CrossProduct(edge_ab, to_point), plane_normal) / area;
+        double margin = std::min({u, v, 1 - u - v});
+        if (margin > best_margin) {
+            best_margin = margin;
+            best = Vector(1 - u - v, u, v);
+            best_fan = i;
+        }
+    }
+    Vector normal = normals[0] * best[0] + normals[best_fan] * best[1] +
+                    normals[best_fan + 1] * best[2];
+    if (DotProduct(normal, ray.GetDirection()) > 0) {
+        -normal;
+    }
+    return Intersection(point, normal, hit.distance);
+}
+
+std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere) {
+    HitRecord hit;
+    if (!UpdateClosestHit(ray, sphere, 0, &hit)) {
+        return std::nullopt;
+    }
+    return GetIntersection(ray, hit, sphere);
+}
+
+std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& triangle) {
+    HitRecord hit;
+    if (!UpdateClosestHit(ray, triangle, 0, &hit)) {
         return std::nullopt;
     }
+    return GetIntersection(ray, hit, triangle);
+}
+
+std::optional<Intersection> GetIntersection(const Ray& ray, const Polygon& polygon) {
+    HitRecord hit;
+    if (!UpdateClosestHit(ray, polygon, 0, &hit)) {
+        return std::nullopt;
+    }
+    return GetIntersection(ray, hit, polygon);
 }
 
 Vector Reflect(const Vector& ray, const Vector& normal) {
@@ -99,8 +226,12 @@ std::optional<Vector> Refract(const Vector& ray, const Vector& normal, double et
     return std::make_optional<Vector>(to_add_now - normal * cos_theta_2);
 }
 
+// a degenerate triangle has no area to divide by, all the weight goes to its first vertex
 Vector GetBarycentricCoords(const Triangle& triangle, const Vector& point) {
     double area = triangle.Area();
+    if (area == 0) {
+        return Vector(1, 0, 0);
+    }
     Vector p = point - triangle[0];
     double v = Length(CrossProduct(triangle[1] - triangle[0], p)) / area / 2;
     double u = Length(CrossProduct(triangle[2] - triangle[0], p)) / area / 2;
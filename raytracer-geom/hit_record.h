@@ -0,0 +1,26 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+enum class PrimitiveKind { kNone, kTriangle, kSphere, kPolygon };
+
+// Closest hit found so far. Intersection kernels only fill these fields,
+// the position and the shading normal are resolved once for the final hit.
+struct HitRecord {
+    double distance = std::numeric_limits<double>::infinity();
+    // barycentric weights of the second and the third triangle vertices
+    double u = 0;
+    double v = 0;
+    size_t primitive = 0;
+    PrimitiveKind kind = PrimitiveKind::kNone;
+    // the ray started inside the sphere
+    bool inside = false;
+    // primitives tested against the ray while this record was updated
+    uint32_t tests = 0;
+
+    bool IsHit() const {
+        return kind != PrimitiveKind::kNone;
+    }
+};
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <vector.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <span>
+#include <stdexcept>
+#include <string>
+
+// Planar convex polygon, the vertices go around it in order. A quad is one primitive
+// instead of the two triangles of its fan.
+class Polygon {
+public:
+    static constexpr size_t kMaxVertices = 6;
+
+    explicit Polygon(std::span<const Vector> vertices)
+        : data_(Copy(vertices)),
+          size_(vertices.size()),
+          normal_(GetNewellNormal(vertices)),
+          area_(GetFanArea(vertices)) {
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    const Vector& operator[](size_t ind) const {
+        return data_.at(ind);
+    }
+
+    // unit normal, the fan triangles (0, i, i + 1) of the vertices face the same way
+    const Vector& GetNormal() const {
+        return normal_;
+    }
+
+    double Area() const {
+        return area_;
+    }
+
+    // Newell's method, the length is twice the area of the polygon
+    static Vector GetNewellNormal(std::span<const Vector> vertices) {
+        Vector normal;
+        for (size_t i = 0; i < vertices.size(); ++i) {
+            const Vector& a = vertices[i];
+            const Vector& b = vertices[(i + 1) % vertices.size()];
+            normal = normal + CrossProduct(a, b);
+        }
+        if (Length(normal) > 0) {
+            normal.Normalize();
+        }
+        return normal;
+    }
+
+private:
+    static std::array<Vector, kMaxVertices> Copy(std::span<const Vector> vertices) {
+        if (vertices.size() < 3 || vertices.size() > kMaxVertices) {
+            throw std::invalid_argument("A polygon needs 3 to " + std::to_string(kMaxVertices) +
+                                        " vertices");
+        }
+        std::array<Vector, kMaxVertices> data;
+        std::copy(vertices.begin(), vertices.end(), data.begin());
+        return data;
+    }
+
+    static double GetFanArea(std::span<const Vector> vertices) {
+        double area = 0;
+        for (size_t i = 1; i + 1 < vertices.size(); ++i) {
+            const Vector& origin = vertices[0];
+            area += Length(CrossProduct(vertices[i] - origin, vertices[i + 1] - origin)) / 2;
+        }
+        return area;
+    }
+
+    const std::array<Vector, kMaxVertices> data_;
+    const size_t size_;
+    const Vector normal_;
+    const double area_;
+};
+
+// Whether the vertices can make a Polygon: every corner turns the same way, and no
+// vertex is farther from the plane than tolerance times the size of the polygon.
+// Collinear neighbours are rejected, every fan triangle then has a nonzero area.
+bool IsConvexPlanar(std::span<const Vector> vertices, double tolerance = 1e-9) {
+    const size_t size = vertices.size();
+    if (size < 3 || size > Polygon::kMaxVertices) {
+        return false;
+    }
+    Vector normal = Polygon::GetNewellNormal(vertices);
+    if (Length(normal) == 0) {
+        return false;
+    }
+    double extent = 0;
+    for (const Vector& vertex : vertices) {
+        extent = std::max(extent, Length(vertex - vertices[0]));
+    }
+    const double offset = DotProduct(normal, vertices[0]);
+    for (size_t i = 0; i < size; ++i) {
+        const Vector& a = vertices[i];
+        const Vector& b = vertices[(i + 1) % size];
+        const Vector& c = vertices[(i + 2) % size];
+        if (std::abs(DotProduct(normal, a) - offset) > tolerance * extent ||
+            DotProduct(CrossProduct(b - a, c - b), normal) <= tolerance * extent * extent) {
+            return false;
+        }
+    }
+    return true;
+}
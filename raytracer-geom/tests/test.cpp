@@ -1,4 +1,5 @@
 #include <geometry.h>
+#include <transform.h>
 #include <util.h>
 
 #include <cmath>
@@ -282,3 +283,124 @@ TEST_CASE("Barycentric coords") {
         CheckCoords(t, {10, 7, 6}, {3. / 6, 2. / 6, 1. / 6});
     }
 }
+
+TEST_CASE("Hit record") {
+    Triangle triangle{{0, 0, 0}, {4, 0, 0}, {0, 4, 0}};
+    Ray ray{{1, 2, 1}, {0, 0, -1}};
+
+    HitRecord hit;
+    CHECK_FALSE(hit.IsHit());
+    REQUIRE(UpdateClosestHit(ray, triangle, 7, &hit));
+    CHECK(hit.kind == PrimitiveKind::kTriangle);
+    CHECK(hit.primitive == 7);
+    CHECK_THAT(hit.distance, WithinAbs(1.));
+    auto coords = GetBarycentricCoords(triangle, {1, 2, 0});
+    CHECK_THAT(hit.u, WithinAbs(coords[1]));
+    CHECK_THAT(hit.v, WithinAbs(coords[2]));
+
+    Triangle normals{{0, 0, 1}, {1, 0, 0}, {0, 1, 0}};
+    auto intersection = GetInterpolatedIntersection(ray, hit, normals);
+    Vector expected{1, 2, 1};
+    expected.Normalize();
+    CheckWithinAbs(intersection.GetNormal(), expected);
+    CheckWithinAbs(intersection.GetPosition(), {1, 2, 0});
+
+    // a farther primitive doesn't replace the closest one
+    CHECK_FALSE(UpdateClosestHit(ray, Sphere{{1, 2, -5}, 1}, 3, &hit));
+    CHECK(hit.primitive == 7);
+
+    REQUIRE(UpdateClosestHit(ray, Sphere{{1, 2, 0}, .5}, 3, &hit));
+    CHECK(hit.kind == PrimitiveKind::kSphere);
+    CHECK(hit.primitive == 3);
+    CHECK_FALSE(hit.inside);
+    CHECK_THAT(hit.distance, WithinAbs(.5));
+
+    HitRecord inside;
+    REQUIRE(UpdateClosestHit(Ray{{0, 0, 0}, {1, 0, 0}}, Sphere{{0, 0, 0}, 2}, 0, &inside));
+    CHECK(inside.inside);
+    CheckWithinAbs(GetIntersection(Ray{{0, 0, 0}, {1, 0, 0}}, inside, Sphere{{0, 0, 0}, 2})
+                       .GetNormal(),
+                   {-1, 0, 0});
+}
+
+TEST_CASE("Transform") {
+    auto rotation = Rotation({0, 0, 1}, std::numbers::pi / 2);
+    CheckWithinAbs(rotation.ApplyToPoint({1, 0, 0}), {0, 1, 0});
+    auto moved = Compose(Translation({1, 2, 3}), rotation);
+    CheckWithinAbs(moved.ApplyToPoint({1, 0, 0}), {1, 3, 3});
+    CheckWithinAbs(moved.ApplyToNormal({0, 1, 0}), {-1, 0, 0});
+
+    Transform stretch;
+    stretch.linear[0] = {2, 0, 0};
+    Triangle plane = Apply(stretch, Triangle{{0, 0, 0}, {1, 0, 1}, {0, 1, 0}});
+    Vector normal = stretch.ApplyToNormal(Vector{1, 0, -1} * (1 / std::sqrt(2.)));
+    CHECK_THAT(DotProduct(normal, plane[1] - plane[0]), WithinAbs(0.));
+    CHECK_THAT(DotProduct(normal, plane[2] - plane[0]), WithinAbs(0.));
+
+    Sphere sphere = Apply(Compose(Translation({0, 1, 0}), Scaling(3)), Sphere{{1, 0, 0}, 2});
+    CheckWithinAbs(sphere.GetCenter(), {3, 1, 0});
+    CHECK_THAT(sphere.GetRadius(), WithinAbs(6.));
+}
+
+TEST_CASE("Polygon") {
+    std::array<Vector, 5> pentagon = {
+        Vector{0, 0, 0}, Vector{4, 0, 0}, Vector{5, 3, 0}, Vector{2, 5, 0}, Vector{-1, 3, 0}};
+    REQUIRE(IsConvexPlanar(pentagon));
+    Polygon polygon(pentagon);
+    CHECK(polygon.Size() == 5);
+    CheckWithinAbs(polygon.GetNormal(), {0, 0, 1});
+    CHECK_THAT(polygon.Area(), WithinAbs(21.));
+
+    std::array<Vector, 4> concave = {Vector{0, 0, 0}, Vector{4, 0, 0}, Vector{1, 1, 0},
+                                     Vector{0, 4, 0}};
+    CHECK_FALSE(IsConvexPlanar(concave));
+    std::array<Vector, 4> bent = {Vector{0, 0, 0}, Vector{4, 0, 0}, Vector{4, 4, 1},
+                                  Vector{0, 4, 0}};
+    CHECK_FALSE(IsConvexPlanar(bent));
+    std::array<Vector, 4> collinear = {Vector{0, 0, 0}, Vector{2, 0, 0}, Vector{4, 0, 0},
+                                       Vector{0, 4, 0}};
+    CHECK_FALSE(IsConvexPlanar(collinear));
+
+    // the same hits and shading normals as the fan of triangles
+    std::array<Vector, 5> normals = {Vector{0, 0, 1}, Vector{1, 0, 1}, Vector{1, 1, 1},
+                                     Vector{0, 1, 1}, Vector{-1, 0, 1}};
+    for (double x = -1.37; x <= 5.5; x += .25) {
+        for (double y = -.43; y <= 5.5; y += .25) {
+            Ray ray{{x, y, 2}, {0, 0, -1}};
+            HitRecord polygon_hit;
+            bool hit = UpdateClosestHit(ray, polygon, 3, &polygon_hit);
+            HitRecord fan_hit;
+            std::optional<Intersection> fan_normal;
+            for (size_t i = 1; i + 1 < pentagon.size(); ++i) {
+                if (UpdateClosestHit(ray, Triangle(pentagon[0], pentagon[i], pentagon[i + 1]),
+                                     i, &fan_hit)) {
+                    fan_normal = GetInterpolatedIntersection(
+                        ray, fan_hit, Triangle(normals[0], normals[i], normals[i + 1]));
+                }
+            }
+            REQUIRE(hit == fan_hit.IsHit());
+            if (hit) {
+                CHECK(polygon_hit.kind == PrimitiveKind::kPolygon);
+                CHECK_THAT(polygon_hit.distance, WithinAbs(fan_hit.distance));
+                CheckWithinAbs(
+                    GetInterpolatedIntersection(ray, polygon_hit, polygon, normals).GetNormal(),
+                    fan_normal->GetNormal());
+            }
+        }
+    }
+    CheckWithinAbs(GetIntersection(Ray{{1, 1, -1}, {0, 0, 1}}, polygon)->GetNormal(), {0, 0, -1});
+
+    // rays grazing an edge from outside are hit within the same tolerance as a triangle
+    std::array<Vector, 3> corners = {Vector{0, 0, 0}, Vector{4, 0, 0}, Vector{0, 4, 0}};
+    const Polygon three(corners);
+    const Triangle triangle(corners[0], corners[1], corners[2]);
+    for (double offset : {0., 1e-14, 1e-13, 1e-9}) {
+        for (Ray ray : {Ray{{2, -offset, 2}, {0, 0, -1}}, Ray{{2 + offset, 2, 2}, {0, 0, -1}}}) {
+            HitRecord polygon_hit;
+            HitRecord triangle_hit;
+            CHECK(UpdateClosestHit(ray, three, 0, &polygon_hit) ==
+                  UpdateClosestHit(ray, triangle, 0, &triangle_hit));
+            CHECK(polygon_hit.IsHit() == (offset < 1e-12));
+        }
+    }
+}
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <vector.h>
+#include <triangle.h>
+#include <sphere.h>
+
+#include <array>
+#include <cmath>
+
+// Affine map x -> linear * x + translation, the linear part is stored by rows.
+struct Transform {
+    std::array<Vector, 3> linear = {Vector(1, 0, 0), Vector(0, 1, 0), Vector(0, 0, 1)};
+    Vector translation;
+
+    Vector ApplyToVector(const Vector& vector) const {
+        return Vector(DotProduct(linear[0], vector), DotProduct(linear[1], vector),
+                      DotProduct(linear[2], vector));
+    }
+
+    Vector ApplyToPoint(const Vector& point) const {
+        return ApplyToVector(point) + translation;
+    }
+
+    // normals go through the cofactor matrix, the inverse transpose up to a positive factor
+    Vector ApplyToNormal(const Vector& normal) const {
+        std::array<Vector, 3> cofactor = {CrossProduct(linear[1], linear[2]),
+                                          CrossProduct(linear[2], linear[0]),
+                                          CrossProduct(linear[0], linear[1])};
+        Vector result(DotProduct(cofactor[0], normal), DotProduct(cofactor[1], normal),
+                      DotProduct(cofactor[2], normal));
+        if (Determinant() < 0) {
+            -result;
+        }
+        result.Normalize();
+        return result;
+    }
+
+    double Determinant() const {
+        return DotProduct(linear[0], CrossProduct(linear[1], linear[2]));
+    }
+};
+
+Transform Translation(const Vector& offset) {
+    Transform transform;
+    transform.translation = offset;
+    return transform;
+}
+
+Transform Scaling(double factor) {
+    Transform transform;
+    for (size_t i = 0; i < 3; ++i) {
+        transform.linear[i][i] = factor;
+    }
+    return transform;
+}
+
+// rotation by angle radians around the axis through the origin, counter-clockwise when
+// looking against the axis
+Transform Rotation(Vector axis, double angle) {
+    axis.Normalize();
+    double c = std::cos(angle);
+    double s = std::sin(angle);
+    double t = 1 - c;
+    const double x = axis[0];
+    const double y = axis[1];
+    const double z = axis[2];
+    Transform transform;
+    transform.linear = {Vector(t * x * x + c, t * x * y - s * z, t * x * z + s * y),
+                        Vector(t * x * y + s * z, t * y * y + c, t * y * z - s * x),
+                        Vector(t * x * z - s * y, t * y * z + s * x, t * z * z + c)};
+    return transform;
+}
+
+// applies second after first
+Transform Compose(const Transform& second, const Transform& first) {
+    Transform transform;
+    for (size_t i = 0; i < 3; ++i) {
+        for (size_t j = 0; j < 3; ++j) {
+            Vector column(first.linear[0][j], first.linear[1][j], first.linear[2][j]);
+            transform.linear[i][j] = DotProduct(second.linear[i], column);
+        }
+    }
+    transform.translation = second.ApplyToPoint(first.translation);
+    return transform;
+}
+
+Triangle Apply(const Transform& transform, const Triangle& triangle) {
+    return Triangle(transform.ApplyToPoint(triangle[0]), transform.ApplyToPoint(triangle[1]),
+                    transform.ApplyToPoint(triangle[2]));
+}
+
+// exact for similarity transforms, otherwise the radius follows the mean volume scale
+Sphere Apply(const Transform& transform, const Sphere& sphere) {
+    return Sphere(transform.ApplyToPoint(sphere.GetCenter()),
+                  sphere.GetRadius() * std::cbrt(std::abs(transform.Determinant())));
+}
@@ -0,0 +1,600 @@
+#pragma once
+
+#include <scene.h>
+#include <mapped_file.h>
+#include <bounding_box.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+// Out-of-core scene: faces are streamed from the .obj into spatial clusters on disk
+// and the resulting file is memory-mapped, so only the touched clusters are paged in.
+
+struct PackedTriangle {
+    std::array<Vector, 3> vertices;
+    std::array<Vector, 3> normals;
+    uint32_t material;
+    uint32_t has_normals;
+};
+
+struct Cluster {
+    BoundingBox box;
+    uint64_t first;
+    uint64_t count;
+};
+
+static_assert(std::is_trivially_copyable_v<PackedTriangle>);
+static_assert(std::is_trivially_copyable_v<Cluster>);
+
+struct ClusterOptions {
+    size_t triangles_per_cluster = 256;
+    // triangles buffered in memory per cluster before they are spilled to disk
+    size_t bucket_capacity = 32;
+    size_t max_grid_resolution = 16;
+
+    bool operator==(const ClusterOptions&) const = default;
+};
+
+// a file the cluster file was built from and its last write time when the build started
+struct ClusterSource {
+    std::filesystem::path path;
+    int64_t write_time;
+};
+
+const char kClusterFileMagic[8] = {'R', 'T', 'C', 'L', 'U', 'S', 'T', '2'};
+const uint32_t kNoMaterial = UINT32_MAX;
+const int64_t kMissingFile = INT64_MIN;
+
+struct ClusterFileHeader {
+    char magic[8];
+    uint64_t triangles_per_cluster;
+    uint64_t bucket_capacity;
+    uint64_t max_grid_resolution;
+    uint64_t cluster_count;
+    uint64_t triangle_count;
+    uint64_t clusters_offset;
+    uint64_t triangles_offset;
+    uint64_t meta_offset;
+    uint64_t meta_size;
+};
+
+namespace clustered_scene_detail {
+
+template <class T>
+void WriteValue(std::ostream& out, const T& value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <class T>
+T ReadValue(const std::byte*& data, const std::byte* end) {
+    if (static_cast<size_t>(end - data) < sizeof(T)) {
+        throw std::runtime_error("Cluster file is truncated");
+    }
+    T value;
+    std::memcpy(&value, data, sizeof(T));
+    data += sizeof(T);
+    return value;
+}
+
+void WriteString(std::ostream& out, const std::string& value) {
+    WriteValue(out, static_cast<uint64_t>(value.size()));
+    out.write(value.data(), static_cast<std::streamsize>(value.size()));
+}
+
+std::string ReadString(const std::byte*& data, const std::byte* end) {
+    uint64_t size = ReadValue<uint64_t>(data, end);
+    if (static_cast<uint64_t>(end - data) < size) {
+        throw std::runtime_error("Cluster file is truncated");
+    }
+    std::string value(reinterpret_cast<const char*>(data), size);
+    data += size;
+    return value;
+}
+
+int64_t GetWriteTime(const std::filesystem::path& path) {
+    std::error_code error;
+    auto time = std::filesystem::last_write_time(path, error);
+    return error ? kMissingFile : static_cast<int64_t>(time.time_since_epoch().count());
+}
+
+void WriteMaterial(std::ostream& out, const Material& material) {
+    WriteString(out, material.name);
+    WriteValue(out, material.ambient_color);
+    WriteValue(out, material.diffuse_color);
+    WriteValue(out, material.specular_color);
+    WriteValue(out, material.intensity);
+    WriteValue(out, material.specular_exponent);
+    WriteValue(out, material.refraction_index);
+    WriteValue(out, material.albedo);
+}
+
+Material ReadMaterial(const std::byte*& data, const std::byte* end) {
+    Material material;
+    material.name = ReadString(data, end);
+    material.ambient_color = ReadValue<Vector>(data, end);
+    material.diffuse_color = ReadValue<Vector>(data, end);
+    material.specular_color = ReadValue<Vector>(data, end);
+    material.intensity = ReadValue<Vector>(data, end);
+    material.specular_exponent = ReadValue<double>(data, end);
+    material.refraction_index = ReadValue<double>(data, end);
+    material.albedo = ReadValue<Vector>(data, end);
+    return material;
+}
+
+using scene_detail::ParseFaceToken;
+using scene_detail::ResolveIndex;
+
+const Vector& MappedVector(const MappedFile& file, size_t index) {
+    return reinterpret_cast<const Vector*>(file.Data())[index];
+}
+
+std::vector<std::string> Tokenize(const std::string& line) {
+    std::istringstream iss(line);
+    return std::vector<std::string>(std::istream_iterator<std::string>{iss},
+                                     std::istream_iterator<std::string>());
+}
+
+struct Chunk {
+    uint32_t cell;
+    uint64_t offset;
+    uint64_t count;
+};
+
+// a name next to path that no other build, in this process or another one, uses
+std::filesystem::path GetTempPath(const std::filesystem::path& path) {
+    static std::atomic<uint64_t> counter = 0;
+    return path.string() + ".tmp" + std::to_string(::getpid()) + "." +
+           std::to_string(counter++);
+}
+
+// removes the files when it goes out of scope, also when a build throws halfway
+class TempFiles {
+public:
+    explicit TempFiles(std::vector<std::filesystem::path> paths) : paths_(std::move(paths)) {
+    }
+
+    TempFiles(const TempFiles&) = delete;
+    TempFiles& operator=(const TempFiles&) = delete;
+
+    ~TempFiles() {
+        for (const std::filesystem::path& path : paths_) {
+            std::error_code error;
+            std::filesystem::remove(path, error);
+        }
+    }
+
+private:
+    std::vector<std::filesystem::path> paths_;
+};
+
+}  // namespace clustered_scene_detail
+
+// Three streaming passes with memory bounded by the grid buffers, not by the mesh size:
+// vertices and normals go to scratch files, faces are binned into grid cells and spilled
+// in chunks, then the chunks are gathered cell by cell into the final file. Every build
+// writes files of its own and renames the finished one over cluster_path, so neither an
+// interrupted build nor two concurrent ones leave a broken cluster file behind.
+void BuildClusteredScene(const std::filesystem::path& obj_path,
+                         const std::filesystem::path& cluster_path,
+                         const ClusterOptions& options = {}) {
+    using namespace clustered_scene_detail;
+    TraceSpan span("build clusters", "scene");
+
+    const std::filesystem::path temp_path = GetTempPath(cluster_path);
+    const std::filesystem::path vertices_path = temp_path.string() + ".vertices";
+    const std::filesystem::path normals_path = temp_path.string() + ".normals";
+    const std::filesystem::path spill_path = temp_path.string() + ".spill";
+    TempFiles temp_files({temp_path, vertices_path, normals_path, spill_path});
+
+    std::vector<Material> materials;
+    std::unordered_map<std::string, uint32_t> material_indices;
+    std::vector<std::pair<Sphere, uint32_t>> spheres;
+    std::vector<Light> lights;
+    std::vector<ClusterSource> sources = {{obj_path, GetWriteTime(obj_path)}};
+    BoundingBox scene_box;
+    uint64_t triangle_count = 0;
+
+    {
+        std::ifstream obj_file(obj_path.string());
+        if (!obj_file) {
+            throw std::runtime_error("Can't open " + obj_path.string());
+        }
+        std::ofstream vertices_file(vertices_path, std::ios::binary);
+        std::ofstream normals_file(normals_path, std::ios::binary);
+        uint32_t cur_material = kNoMaterial;
+
+        std::string line;
+        while (std::getline(obj_file, line)) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            std::vector<std::string> tokens = Tokenize(line);
+            if (tokens.empty()) {
+                continue;
+            }
+
+            if (tokens[0] == "v" && tokens.size() >= 4) {
+                Vector vertex(std::stod(tokens[1]), std::stod(tokens[2]), std::stod(tokens[3]));
+                scene_box.Extend(vertex);
+                WriteValue(vertices_file, vertex);
+            } else if (tokens[0] == "vn" && tokens.size() >= 4) {
+                WriteValue(normals_file, Vector(std::stod(tokens[1]), std::stod(tokens[2]),
+                                                std::stod(tokens[3])));
+            } else if (tokens[0] == "f" && tokens.size() >= 4) {
+                triangle_count += tokens.size() - 3;
+            } else if (tokens[0] == "P" && tokens.size() >= 7) {
+                lights.push_back(
+                    Light{Vector(std::stod(tokens[1]), std::stod(tokens[2]), std::stod(tokens[3])),
+                          Vector(std::stod(tokens[4]), std::stod(tokens[5]), std::stod(tokens[6]))});
+            } else if (tokens[0] == "S" && tokens.size() >= 5) {
+                spheres.emplace_back(
+                    Sphere(Vector(std::stod(tokens[1]), std::stod(tokens[2]), std::stod(tokens[3])),
+                           std::stod(tokens[4])),
+                    cur_material);
+            } else if (tokens[0] == "mtllib" && tokens.size() >= 2) {
+                const std::filesystem::path mtl_path = obj_path.parent_path() / tokens[1];
+                sources.push_back({mtl_path, GetWriteTime(mtl_path)});
+                for (auto& [name, material] : ReadMaterials(mtl_path)) {
+                    if (material_indices.emplace(name, materials.size()).second) {
+                        materials.push_back(material);
+                    }
+                }
+            } else if (tokens[0] == "usemtl" && tokens.size() >= 2) {
+                cur_material = material_indices.at(tokens[1]);
+            }
+        }
+    }
+
+    size_t target_clusters =
+        std::max<size_t>(1, triangle_count / std::max<size_t>(1, options.triangles_per_cluster));
+    size_t resolution = std::clamp<size_t>(
+        static_cast<size_t>(std::ceil(std::cbrt(static_cast<double>(target_clusters)))), 1,
+        std::max<size_t>(1, options.max_grid_resolution));
+    size_t cell_count = resolution * resolution * resolution;
+
+    auto get_cell = [&](const Vector& point) {
+        size_t cell = 0;
+        for (size_t axis = 0; axis < 3; ++axis) {
+            double extent = scene_box.max[axis] - scene_box.min[axis];
+            size_t index = 0;
+            if (extent > 0) {
+                index = std::min(resolution - 1, static_cast<size_t>((point[axis] - scene_box.min[axis]) /
+                                                                     extent * resolution));
+            }
+            cell = cell * resolution + index;
+        }
+        return static_cast<uint32_t>(cell);
+    };
+
+    std::vector<Chunk> chunks;
+    {
+        MappedFile vertices(vertices_path);
+        MappedFile normals(normals_path);
+        std::ifstream obj_file(obj_path.string());
+        std::ofstream spill_file(spill_path, std::ios::binary);
+        std::vector<std::vector<PackedTriangle>> buckets(cell_count);
+        uint64_t spilled = 0;
+
+        auto flush = [&](uint32_t cell) {
+            std::vector<PackedTriangle>& bucket = buckets[cell];
+            if (bucket.empty()) {
+                return;
+            }
+            spill_file.write(reinterpret_cast<const char*>(bucket.data()),
+                             static_cast<std::streamsize>(bucket.size() * sizeof(PackedTriangle)));
+            chunks.push_back(Chunk{cell, spilled, bucket.size()});
+            spilled += bucket.size();
+            bucket.clear();
+        };
+
+        size_t vertex_count = 0;
+        size_t normal_count = 0;
+        uint32_t cur_material = kNoMaterial;
+        std::vector<Vector> vertices_temp;
+        std::vector<Vector> normals_temp;
+
+        std::string line;
+        while (std::getline(obj_file, line)) {
+            if (line.empty() || line[0] == '#') {
+                continue;
+            }
+            std::vector<std::string> tokens = Tokenize(line);
+            if (tokens.empty()) {
+                continue;
+            }
+
+            if (tokens[0] == "v" && tokens.size() >= 4) {
+                ++vertex_count;
+            } else if (tokens[0] == "vn" && tokens.size() >= 4) {
+                ++normal_count;
+            } else if (tokens[0] == "usemtl" && tokens.size() >= 2) {
+                cur_material = material_indices.at(tokens[1]);
+            } else if (tokens[0] == "f" && tokens.size() >= 4) {
+                vertices_temp.clear();
+                normals_temp.clear();
+                bool has_normals = true;
+                bool valid = true;
+                for (size_t i = 1; i < tokens.size(); ++i) {
+                    int vertex_index = 0;
+                    std::optional<int> normal_index;
+                    if (!ParseFaceToken(tokens[i], &vertex_index, &normal_index)) {
+                        valid = false;
+                        break;
+                    }
+                    vertices_temp.push_back(
+                        MappedVector(vertices, ResolveIndex(vertex_index, vertex_count)));
+                    if (normal_index.has_value() && has_normals) {
+                        normals_temp.push_back(
+                            MappedVector(normals, ResolveIndex(*normal_index, normal_count)));
+                    } else {
+                        has_normals = false;
+                    }
+                }
+                if (!valid) {
+                    continue;
+                }
+
+                for (size_t i = 0; i < tokens.size() - 3; ++i) {
+                    PackedTriangle triangle{
+                        {vertices_temp[0], vertices_temp[i + 1], vertices_temp[i + 2]},
+                        {},
+                        cur_material,
+                        has_normals};
+                    if (has_normals) {
+                        triangle.normals = {normals_temp[0], normals_temp[i + 1],
+                                            normals_temp[i + 2]};
+                    }
+                    Vector centroid =
+                        (triangle.vertices[0] + triangle.vertices[1] + triangle.vertices[2]) *
+                        (1.0 / 3);
+                    uint32_t cell = get_cell(centroid);
+                    if (buckets[cell].capacity() == 0) {
+                        buckets[cell].reserve(options.bucket_capacity);
+                    }
+                    buckets[cell].push_back(triangle);
+                    if (buckets[cell].size() >= options.bucket_capacity) {
+                        flush(cell);
+                    }
+                }
+            }
+        }
+
+        for (uint32_t cell = 0; cell < cell_count; ++cell) {
+            flush(cell);
+        }
+    }
+    std::filesystem::remove(vertices_path);
+    std::filesystem::remove(normals_path);
+
+    std::stable_sort(chunks.begin(), chunks.end(),
+                     [](const Chunk& lhs, const Chunk& rhs) { return lhs.cell < rhs.cell; });
+
+    std::vector<Cluster> clusters;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        if (i == 0 || chunks[i - 1].cell != chunks[i].cell) {
+            uint64_t first = clusters.empty() ? 0 : clusters.back().first + clusters.back().count;
+            clusters.push_back(Cluster{BoundingBox(), first, 0});
+        }
+        clusters.back().count += chunks[i].count;
+    }
+
+    ClusterFileHeader header;
+    std::memcpy(header.magic, kClusterFileMagic, sizeof(header.magic));
+    header.triangles_per_cluster = options.triangles_per_cluster;
+    header.bucket_capacity = options.bucket_capacity;
+    header.max_grid_resolution = options.max_grid_resolution;
+    header.cluster_count = clusters.size();
+    header.triangle_count = clusters.empty() ? 0 : clusters.back().first + clusters.back().count;
+    header.clusters_offset = sizeof(ClusterFileHeader);
+    header.triangles_offset = header.clusters_offset + clusters.size() * sizeof(Cluster);
+    header.meta_offset = header.triangles_offset + header.triangle_count * sizeof(PackedTriangle);
+
+    std::ofstream out(temp_path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Can't write " + temp_path.string());
+    }
+    out.seekp(static_cast<std::streamoff>(header.triangles_offset));
+    {
+        MappedFile spill(spill_path);
+        const PackedTriangle* spilled = reinterpret_cast<const PackedTriangle*>(spill.Data());
+        size_t cluster = 0;
+        uint64_t written = 0;
+        for (const Chunk& chunk : chunks) {
+            while (written >= clusters[cluster].first + clusters[cluster].count) {
+                ++cluster;
+            }
+            for (uint64_t i = chunk.offset; i < chunk.offset + chunk.count; ++i) {
+                for (const Vector& vertex : spilled[i].vertices) {
+                    clusters[cluster].box.Extend(vertex);
+                }
+            }
+            out.write(reinterpret_cast<const char*>(spilled + chunk.offset),
+                      static_cast<std::streamsize>(chunk.count * sizeof(PackedTriangle)));
+            written += chunk.count;
+        }
+    }
+    std::filesystem::remove(spill_path);
+
+    WriteValue(out, static_cast<uint64_t>(materials.size()));
+    for (const Material& material : materials) {
+        WriteMaterial(out, material);
+    }
+    WriteValue(out, static_cast<uint64_t>(spheres.size()));
+    for (const auto& [sphere, material] : spheres) {
+        WriteValue(out, sphere.GetCenter());
+        WriteValue(out, sphere.GetRadius());
+        WriteValue(out, material);
+    }
+    WriteValue(out, static_cast<uint64_t>(lights.size()));
+    for (const Light& light : lights) {
+        WriteValue(out, light);
+    }
+    WriteValue(out, static_cast<uint64_t>(sources.size()));
+    for (const ClusterSource& source : sources) {
+        WriteString(out, source.path.string());
+        WriteValue(out, source.write_time);
+    }
+    header.meta_size = static_cast<uint64_t>(out.tellp()) - header.meta_offset;
+
+    out.seekp(0);
+    WriteValue(out, header);
+    out.write(reinterpret_cast<const char*>(clusters.data()),
+              static_cast<std::streamsize>(clusters.size() * sizeof(Cluster)));
+    out.close();
+    if (!out) {
+        throw std::runtime_error("Can't write " + temp_path.string());
+    }
+    std::filesystem::rename(temp_path, cluster_path);
+}
+
+class ClusteredScene {
+public:
+    explicit ClusteredScene(const std::filesystem::path& cluster_path) : file_(cluster_path) {
+        using namespace clustered_scene_detail;
+        TraceSpan span("prepare scene", "scene");
+
+        const std::byte* data = file_.Data();
+        const std::byte* end = file_.Data() + file_.Size();
+        ClusterFileHeader header = ReadValue<ClusterFileHeader>(data, end);
+        auto fits = [&](uint64_t offset, uint64_t count, size_t size) {
+            return offset <= file_.Size() && count <= (file_.Size() - offset) / size;
+        };
+        if (std::memcmp(header.magic, kClusterFileMagic, sizeof(header.magic)) != 0 ||
+            !fits(header.clusters_offset, header.cluster_count, sizeof(Cluster)) ||
+            !fits(header.triangles_offset, header.triangle_count, sizeof(PackedTriangle)) ||
+            !fits(header.meta_offset, header.meta_size, 1)) {
+            throw std::runtime_error("Bad cluster file " + cluster_path.string());
+        }
+
+        clusters_ = std::span<const Cluster>(
+            reinterpret_cast<const Cluster*>(file_.Data() + header.clusters_offset),
+            header.cluster_count);
+        triangles_ = std::span<const PackedTriangle>(
+            reinterpret_cast<const PackedTriangle*>(file_.Data() + header.triangles_offset),
+            header.triangle_count);
+
+        data = file_.Data() + header.meta_offset;
+        materials_.resize(ReadValue<uint64_t>(data, end));
+        for (Material& material : materials_) {
+            material = ReadMaterial(data, end);
+        }
+        uint64_t sphere_count = ReadValue<uint64_t>(data, end);
+        for (uint64_t i = 0; i < sphere_count; ++i) {
+            Vector center = ReadValue<Vector>(data, end);
+            double radius = ReadValue<double>(data, end);
+            uint32_t material = ReadValue<uint32_t>(data, end);
+            sphere_objects_.push_back(SphereObject{GetMaterial(material), Sphere(center, radius)});
+        }
+        lights_.resize(ReadValue<uint64_t>(data, end));
+        for (Light& light : lights_) {
+            light = ReadValue<Light>(data, end);
+        }
+        sources_.resize(ReadValue<uint64_t>(data, end));
+        for (ClusterSource& source : sources_) {
+            source.path = ReadString(data, end);
+            source.write_time = ReadValue<int64_t>(data, end);
+        }
+        options_ = {.triangles_per_cluster = header.triangles_per_cluster,
+                    .bucket_capacity = header.bucket_capacity,
+                    .max_grid_resolution = header.max_grid_resolution};
+    }
+
+    ClusteredScene(const ClusteredScene&) = delete;
+    ClusteredScene& operator=(const ClusteredScene&) = delete;
+    ClusteredScene(ClusteredScene&&) = default;
+    ClusteredScene& operator=(ClusteredScene&&) = default;
+
+    std::span<const Cluster> GetClusters() const {
+        return clusters_;
+    }
+
+    std::span<const PackedTriangle> GetTriangles(const Cluster& cluster) const {
+        return triangles_.subspan(cluster.first, cluster.count);
+    }
+
+    const PackedTriangle& GetTriangle(uint64_t index) const {
+        return triangles_[index];
+    }
+
+    const std::vector<SphereObject>& GetSphereObjects() const {
+        return sphere_objects_;
+    }
+
+    const std::vector<Light>& GetLights() const {
+        return lights_;
+    }
+
+    const std::vector<Material>& GetMaterials() const {
+        return materials_;
+    }
+
+    MaterialHandle GetMaterial(uint32_t index) const {
+        return index == kNoMaterial ? MaterialHandle() : MaterialHandle(&materials_.at(index), index);
+    }
+
+    // true if the file was built from obj_path with these options and neither the .obj
+    // nor any of its .mtl files changed since
+    bool IsBuiltFrom(const std::filesystem::path& obj_path, const ClusterOptions& options) const {
+        if (options_ != options || sources_.empty() || sources_[0].path != obj_path) {
+            return false;
+        }
+        return std::all_of(sources_.begin(), sources_.end(), [](const ClusterSource& source) {
+            return clustered_scene_detail::GetWriteTime(source.path) == source.write_time;
+        });
+    }
+
+    Object GetObject(const PackedTriangle& triangle) const {
+        return Object{GetMaterial(triangle.material),
+                      Triangle(triangle.vertices[0], triangle.vertices[1], triangle.vertices[2]),
+                      triangle.has_normals
+                          ? std::make_optional<Triangle>(triangle.normals[0], triangle.normals[1],
+                                                         triangle.normals[2])
+                          : std::nullopt};
+    }
+
+private:
+    MappedFile file_;
+    std::span<const Cluster> clusters_;
+    std::span<const PackedTriangle> triangles_;
+    std::vector<Material> materials_;
+    std::vector<SphereObject> sphere_objects_;
+    std::vector<Light> lights_;
+    std::vector<ClusterSource> sources_;
+    ClusterOptions options_;
+};
+
+// reuses an existing cluster file unless it can't be read or is stale: built with other
+// options or before the .obj or one of its .mtl files was written
+ClusteredScene ReadClusteredScene(const std::filesystem::path& obj_path,
+                                  const std::filesystem::path& cluster_path,
+                                  const ClusterOptions& options = {}) {
+    if (std::filesystem::exists(cluster_path)) {
+        try {
+            ClusteredScene scene(cluster_path);
+            if (scene.IsBuiltFrom(obj_path, options)) {
+                return scene;
+            }
+        } catch (const std::runtime_error&) {
+            // a bad or truncated file is built again
+        }
+    }
+    BuildClusteredScene(obj_path, cluster_path, options);
+    return ClusteredScene(cluster_path);
+}
@@ -0,0 +1,457 @@
+#pragma once
+
+#include <scene.h>
+#include <bounding_box.h>
+#include <hit_record.h>
+#include <transform.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Editable scene over a bounding volume hierarchy. Edits keep the hierarchy valid in place:
+// the leaf of a touched primitive is recomputed and the boxes above it are refitted, a
+// primitive that leaves its leaf is reinserted, overfull leaves are split locally and an
+// emptied leaf is replaced by its sibling. An edit costs O(leaf size + tree depth) whatever
+// the size of the scene. Refitting still loosens the boxes, so the hierarchy is rebuilt once
+// the summed area of its boxes doubled since the last build.
+
+using SceneItemId = uint32_t;
+
+struct PrimitiveRef {
+    PrimitiveKind kind;
+    uint32_t slot;
+};
+
+struct BvhNode {
+    static constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+    BoundingBox box;
+    uint32_t parent = kNone;
+    uint32_t left = kNone;
+    uint32_t right = kNone;
+    std::vector<PrimitiveRef> primitives;
+
+    bool IsLeaf() const {
+        return left == kNone;
+    }
+};
+
+class DynamicScene {
+public:
+    // keeps a copy of the scene so the material handles of its objects stay valid
+    explicit DynamicScene(const Scene& scene, size_t leaf_size = 4)
+        : base_(scene), leaf_size_(std::max<size_t>(1, leaf_size)) {
+        TraceSpan span("prepare scene", "scene");
+        for (const Object& object : scene.GetObjects()) {
+            objects_.emplace_back(object);
+            object_leaves_.push_back(BvhNode::kNone);
+        }
+        // polygons are edited and traced as their triangles
+        for (const PolygonObject& polygon : scene.GetPolygonObjects()) {
+            for (const Object& object : Triangulate(polygon)) {
+                objects_.emplace_back(object);
+                object_leaves_.push_back(BvhNode::kNone);
+            }
+        }
+        for (const SphereObject& sphere : scene.GetSphereObjects()) {
+            spheres_.emplace_back(sphere);
+            sphere_leaves_.push_back(BvhNode::kNone);
+        }
+        for (const Light& light : scene.GetLights()) {
+            AddLight(light);
+        }
+        Rebuild();
+    }
+
+    SceneItemId AddObject(const Object& object) {
+        SceneItemId id = Allocate(&objects_, &object_leaves_, &free_objects_);
+        objects_[id].emplace(object);
+        Insert({PrimitiveKind::kTriangle, id});
+        RebuildIfDegraded();
+        return id;
+    }
+
+    void RemoveObject(SceneItemId id) {
+        CheckId(objects_, id);
+        Erase({PrimitiveKind::kTriangle, id});
+        objects_[id].reset();
+        free_objects_.push_back(id);
+        RebuildIfDegraded();
+    }
+
+    void TransformObject(SceneItemId id, const Transform& transform) {
+        const Object& object = GetObject(id);
+        std::optional<Triangle> normals;
+        if (object.normals.has_value()) {
+            normals.emplace(transform.ApplyToNormal(object.normals.value()[0]),
+                            transform.ApplyToNormal(object.normals.value()[1]),
+                            transform.ApplyToNormal(object.normals.value()[2]));
+        }
+        objects_[id].emplace(Object{object.material, Apply(transform, object.polygon), normals});
+        Update({PrimitiveKind::kTriangle, id});
+        RebuildIfDegraded();
+    }
+
+    SceneItemId AddSphere(const SphereObject& sphere) {
+        SceneItemId id = Allocate(&spheres_, &sphere_leaves_, &free_spheres_);
+        spheres_[id].emplace(sphere);
+        Insert({PrimitiveKind::kSphere, id});
+        RebuildIfDegraded();
+        return id;
+    }
+
+    void RemoveSphere(SceneItemId id) {
+        CheckId(spheres_, id);
+        Erase({PrimitiveKind::kSphere, id});
+        spheres_[id].reset();
+        free_spheres_.push_back(id);
+        RebuildIfDegraded();
+    }
+
+    void TransformSphere(SceneItemId id, const Transform& transform) {
+        const SphereObject& sphere = GetSphere(id);
+        spheres_[id].emplace(SphereObject{sphere.material, Apply(transform, sphere.sphere)});
+        Update({PrimitiveKind::kSphere, id});
+        RebuildIfDegraded();
+    }
+
+    // lights are kept dense for shading, ids map to their current position
+    SceneItemId AddLight(const Light& light) {
+        SceneItemId id;
+        if (free_lights_.empty()) {
+            id = static_cast<SceneItemId>(light_positions_.size());
+            light_positions_.push_back(0);
+        } else {
+            id = free_lights_.back();
+            free_lights_.pop_back();
+        }
+        light_positions_[id] = static_cast<uint32_t>(lights_.size());
+        lights_.push_back(light);
+        light_ids_.push_back(id);
+        return id;
+    }
+
+    void RemoveLight(SceneItemId id) {
+        uint32_t position = GetLightPosition(id);
+        lights_[position] = lights_.back();
+        light_ids_[position] = light_ids_.back();
+        light_positions_[light_ids_[position]] = position;
+        lights_.pop_back();
+        light_ids_.pop_back();
+        light_positions_[id] = BvhNode::kNone;
+        free_lights_.push_back(id);
+    }
+
+    void TransformLight(SceneItemId id, const Transform& transform) {
+        Light& light = lights_[GetLightPosition(id)];
+        light.position = transform.ApplyToPoint(light.position);
+    }
+
+    const Object& GetObject(SceneItemId id) const {
+        CheckId(objects_, id);
+        return objects_[id].value();
+    }
+
+    const SphereObject& GetSphere(SceneItemId id) const {
+        CheckId(spheres_, id);
+        return spheres_[id].value();
+    }
+
+    const Light& GetLight(SceneItemId id) const {
+        return lights_[GetLightPosition(id)];
+    }
+
+    std::span<const Light> GetLights() const {
+        return lights_;
+    }
+
+    std::span<const BvhNode> GetNodes() const {
+        return nodes_;
+    }
+
+    uint32_t GetRoot() const {
+        return root_;
+    }
+
+    // number of node boxes recomputed since construction, shows what edits cost
+    uint64_t GetRefitCount() const {
+        return refit_count_;
+    }
+
+    // rebuilds the whole hierarchy, worth it after edits that moved most of the scene
+    void Rebuild() {
+        nodes_.clear();
+        free_nodes_.clear();
+        area_ = 0;
+        std::vector<PrimitiveRef> primitives;
+        for (uint32_t i = 0; i < objects_.size(); ++i) {
+            if (objects_[i].has_value()) {
+                primitives.push_back({PrimitiveKind::kTriangle, i});
+            }
+        }
+        for (uint32_t i = 0; i < spheres_.size(); ++i) {
+            if (spheres_[i].has_value()) {
+                primitives.push_back({PrimitiveKind::kSphere, i});
+            }
+        }
+        root_ = Build(std::move(primitives), BvhNode::kNone);
+        built_area_ = area_;
+    }
+
+private:
+    template <class T>
+    static void CheckId(const std::vector<std::optional<T>>& slots, SceneItemId id) {
+        if (id >= slots.size() || !slots[id].has_value()) {
+            throw std::out_of_range("Unknown scene item id " + std::to_string(id));
+        }
+    }
+
+    template <class T>
+    static SceneItemId Allocate(std::vector<std::optional<T>>* slots, std::vector<uint32_t>* leaves,
+                                std::vector<SceneItemId>* free_slots) {
+        if (!free_slots->empty()) {
+            SceneItemId id = free_slots->back();
+            free_slots->pop_back();
+            return id;
+        }
+        slots->emplace_back();
+        leaves->push_back(BvhNode::kNone);
+        return static_cast<SceneItemId>(slots->size() - 1);
+    }
+
+    uint32_t GetLightPosition(SceneItemId id) const {
+        if (id >= light_positions_.size() || light_positions_[id] == BvhNode::kNone) {
+            throw std::out_of_range("Unknown light id " + std::to_string(id));
+        }
+        return light_positions_[id];
+    }
+
+    BoundingBox GetBox(PrimitiveRef ref) const {
+        if (ref.kind == PrimitiveKind::kSphere) {
+            return GetBoundingBox(spheres_[ref.slot]->sphere);
+        }
+        return GetBoundingBox(objects_[ref.slot]->polygon);
+    }
+
+    uint32_t& LeafOf(PrimitiveRef ref) {
+        return ref.kind == PrimitiveKind::kSphere ? sphere_leaves_[ref.slot]
+                                                  : object_leaves_[ref.slot];
+    }
+
+    static double HalfArea(const BoundingBox& box) {
+        if (box.IsEmpty()) {
+            return 0;
+        }
+        Vector size = box.max - box.min;
+        return size[0] * size[1] + size[1] * size[2] + size[2] * size[0];
+    }
+
+    static bool IsSame(PrimitiveRef lhs, PrimitiveRef rhs) {
+        return lhs.kind == rhs.kind && lhs.slot == rhs.slot;
+    }
+
+    // keeps the summed area of the boxes up to date
+    void SetBox(uint32_t index, const BoundingBox& box) {
+        area_ += HalfArea(box) - HalfArea(nodes_[index].box);
+        nodes_[index].box = box;
+    }
+
+    void RebuildIfDegraded() {
+        if (area_ > 2 * built_area_) {
+            Rebuild();
+        }
+    }
+
+    uint32_t Build(std::vector<PrimitiveRef> primitives, uint32_t parent) {
+        uint32_t index;
+        if (free_nodes_.empty()) {
+            index = static_cast<uint32_t>(nodes_.size());
+            nodes_.emplace_back();
+        } else {
+            index = free_nodes_.back();
+            free_nodes_.pop_back();
+        }
+        nodes_[index].parent = parent;
+        Fill(index, std::move(primitives));
+        return index;
+    }
+
+    // makes the node a leaf or splits the primitives at the median center on the widest axis
+    void Fill(uint32_t index, std::vector<PrimitiveRef> primitives) {
+        BoundingBox box;
+        BoundingBox centers;
+        for (PrimitiveRef ref : primitives) {
+            box.Extend(GetBox(ref));
+            centers.Extend(GetBox(ref).Center());
+        }
+        SetBox(index, box);
+        ++refit_count_;
+        if (primitives.size() <= leaf_size_) {
+            for (PrimitiveRef ref : primitives) {
+                LeafOf(ref) = index;
+            }
+            nodes_[index].primitives = std::move(primitives);
+            return;
+        }
+
+        Vector extent = centers.max - centers.min;
+        size_t axis = 0;
+        for (size_t i = 1; i < 3; ++i) {
+            if (extent[i] > extent[axis]) {
+                axis = i;
+            }
+        }
+        auto middle = primitives.begin() + primitives.size() / 2;
+        std::nth_element(primitives.begin(), middle, primitives.end(),
+                         [&](PrimitiveRef lhs, PrimitiveRef rhs) {
+                             return GetBox(lhs).Center()[axis] < GetBox(rhs).Center()[axis];
+                         });
+        std::vector<PrimitiveRef> right(middle, primitives.end());
+        primitives.erase(middle, primitives.end());
+
+        uint32_t left_child = Build(std::move(primitives), index);
+        uint32_t right_child = Build(std::move(right), index);
+        nodes_[index].left = left_child;
+        nodes_[index].right = right_child;
+    }
+
+    void RecomputeBox(uint32_t index) {
+        const BvhNode& node = nodes_[index];
+        BoundingBox box;
+        if (node.IsLeaf()) {
+            for (PrimitiveRef ref : node.primitives) {
+                box.Extend(GetBox(ref));
+            }
+        } else {
+            box.Extend(nodes_[node.left].box);
+            box.Extend(nodes_[node.right].box);
+        }
+        SetBox(index, box);
+        ++refit_count_;
+    }
+
+    void RefitFrom(uint32_t index) {
+        for (; index != BvhNode::kNone; index = nodes_[index].parent) {
+            RecomputeBox(index);
+        }
+    }
+
+    // descends to the leaf whose box grows the least, then splits it if it got too big
+    void Insert(PrimitiveRef ref) {
+        BoundingBox box = GetBox(ref);
+        uint32_t index = root_;
+        while (!nodes_[index].IsLeaf()) {
+            auto growth = [&](uint32_t child) {
+                BoundingBox extended = nodes_[child].box;
+                extended.Extend(box);
+                return HalfArea(extended) - HalfArea(nodes_[child].box);
+            };
+            index = growth(nodes_[index].left) <= growth(nodes_[index].right) ? nodes_[index].left
+                                                                              : nodes_[index].right;
+        }
+        nodes_[index].primitives.push_back(ref);
+        LeafOf(ref) = index;
+        if (nodes_[index].primitives.size() > 2 * leaf_size_) {
+            std::vector<PrimitiveRef> primitives = std::move(nodes_[index].primitives);
+            nodes_[index].primitives.clear();
+            Fill(index, std::move(primitives));
+        }
+        RefitFrom(index);
+    }
+
+    void FreeNode(uint32_t index) {
+        SetBox(index, BoundingBox());
+        nodes_[index] = BvhNode();
+        free_nodes_.push_back(index);
+    }
+
+    // the sibling of an empty leaf moves into their parent, returns the parent
+    uint32_t Collapse(uint32_t leaf) {
+        uint32_t parent = nodes_[leaf].parent;
+        uint32_t sibling =
+            nodes_[parent].left == leaf ? nodes_[parent].right : nodes_[parent].left;
+        SetBox(parent, nodes_[sibling].box);
+        nodes_[parent].left = nodes_[sibling].left;
+        nodes_[parent].right = nodes_[sibling].right;
+        nodes_[parent].primitives = std::move(nodes_[sibling].primitives);
+        if (nodes_[parent].IsLeaf()) {
+            for (PrimitiveRef ref : nodes_[parent].primitives) {
+                LeafOf(ref) = parent;
+            }
+        } else {
+            nodes_[nodes_[parent].left].parent = parent;
+            nodes_[nodes_[parent].right].parent = parent;
+        }
+        FreeNode(leaf);
+        FreeNode(sibling);
+        return parent;
+    }
+
+    void Erase(PrimitiveRef ref) {
+        uint32_t leaf = LeafOf(ref);
+        std::vector<PrimitiveRef>& primitives = nodes_[leaf].primitives;
+        auto it = std::find_if(primitives.begin(), primitives.end(),
+                               [&](PrimitiveRef other) { return IsSame(other, ref); });
+        *it = primitives.back();
+        primitives.pop_back();
+        LeafOf(ref) = BvhNode::kNone;
+        if (primitives.empty() && leaf != root_) {
+            leaf = Collapse(leaf);
+        }
+        RefitFrom(leaf);
+    }
+
+    // small moves only refit, a primitive whose center left the box of the rest of its leaf
+    // is reinserted, a primitive alone in its leaf once its center left its old box
+    void Update(PrimitiveRef ref) {
+        uint32_t leaf = LeafOf(ref);
+        BoundingBox box;
+        if (nodes_[leaf].primitives.size() == 1) {
+            box = nodes_[leaf].box;
+        } else {
+            for (PrimitiveRef other : nodes_[leaf].primitives) {
+                if (!IsSame(other, ref)) {
+                    box.Extend(GetBox(other));
+                }
+            }
+        }
+        Vector center = GetBox(ref).Center();
+        bool inside = true;
+        for (size_t i = 0; i < 3; ++i) {
+            inside = inside && center[i] >= box.min[i] && center[i] <= box.max[i];
+        }
+        if (inside) {
+            RefitFrom(leaf);
+            return;
+        }
+        Erase(ref);
+        Insert(ref);
+    }
+
+    Scene base_;
+    size_t leaf_size_;
+    std::vector<std::optional<Object>> objects_;
+    std::vector<std::optional<SphereObject>> spheres_;
+    std::vector<uint32_t> object_leaves_;
+    std::vector<uint32_t> sphere_leaves_;
+    std::vector<SceneItemId> free_objects_;
+    std::vector<SceneItemId> free_spheres_;
+    std::vector<Light> lights_;
+    std::vector<SceneItemId> light_ids_;
+    std::vector<uint32_t> light_positions_;
+    std::vector<SceneItemId> free_lights_;
+    std::vector<BvhNode> nodes_;
+    std::vector<uint32_t> free_nodes_;
+    uint32_t root_ = BvhNode::kNone;
+    // summed half areas of the node boxes, now and right after the last build
+    double area_ = 0;
+    double built_area_ = 0;
+    uint64_t refit_count_ = 0;
+};
@@ -0,0 +1,614 @@
+#pragma once
+
+#include <scene.h>
+#include <bounding_box.h>
+#include <trace.h>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <numeric>
+#include <optional>
+#include <queue>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+// Levels of detail built once after loading. Every connected mesh is simplified by edge
+// collapse with quadric error metrics, each level keeping about half of the triangles of
+// the previous one, and surviving vertices keep their vn normals. A view picks for every
+// mesh the coarsest level whose error, projected from the mesh distance, stays within
+// the tolerance in pixels. All rays of one view agree on the level of a mesh, so shadow
+// rays meet exactly the surface the camera rays hit.
+
+struct LodOptions {
+    // smaller meshes are kept at full detail only
+    size_t min_triangles = 64;
+    size_t max_levels = 8;
+    // triangles under one bounding box inside a level
+    size_t chunk_size = 32;
+};
+
+struct LodView {
+    Vector eye;
+    // angle covered by one pixel, 2 tan(fov / 2) / height
+    double pixel_angle = 0;
+    // error allowed at a mesh, in pixels at its distance from the eye
+    double tolerance = 1.0;
+    bool full_detail = false;
+};
+
+struct LodChunk {
+    BoundingBox box;
+    uint32_t first = 0;
+    uint32_t count = 0;
+};
+
+struct LodLevel {
+    // bound on the distance of the simplified surface from the original one
+    double error = 0;
+    uint32_t first_chunk = 0;
+    uint32_t chunk_count = 0;
+    size_t triangles = 0;
+};
+
+struct LodMesh {
+    BoundingBox box;
+    // level 0 is the mesh as loaded, errors grow with the index
+    std::vector<LodLevel> levels;
+};
+
+namespace lod_detail {
+
+// a collapse that slides a boundary vertex away from its edge costs this much more than
+// the same move across the surface
+constexpr double kBoundaryWeight = 100;
+// simplification stops before a level would drop below this many triangles
+constexpr size_t kMinLevelTriangles = 8;
+
+// Sum of squared distances to a set of planes, the symmetric 4x4 matrix stored as
+// its upper triangle.
+struct Quadric {
+    std::array<double, 10> a{};
+
+    static Quadric FromPlane(const Vector& normal, double offset, double weight = 1) {
+        double x = normal[0];
+        double y = normal[1];
+        double z = normal[2];
+        Quadric q;
+        q.a = {x * x, x * y, x * z, x * offset, y * y, y * z, y * offset, z * z, z * offset,
+               offset * offset};
+        for (double& value : q.a) {
+            value *= weight;
+        }
+        return q;
+    }
+
+    Quadric& operator+=(const Quadric& other) {
+        for (size_t i = 0; i < a.size(); ++i) {
+            a[i] += other.a[i];
+        }
+        return *this;
+    }
+
+    double Evaluate(const Vector& p) const {
+        double x = p[0];
+        double y = p[1];
+        double z = p[2];
+        return x * x * a[0] + 2 * x * y * a[1] + 2 * x * z * a[2] + 2 * x * a[3] +
+               y * y * a[4] + 2 * y * z * a[5] + 2 * y * a[6] + z * z * a[7] + 2 * z * a[8] +
+               a[9];
+    }
+};
+
+// corners are welded when position and material match bit for bit
+struct VertexKey {
+    std::array<double, 3> values;
+    uint32_t material;
+
+    bool operator==(const VertexKey&) const = default;
+};
+
+struct VertexKeyHash {
+    size_t operator()(const VertexKey& key) const {
+        uint64_t hash = key.material;
+        for (double value : key.values) {
+            hash = (hash ^ std::bit_cast<uint64_t>(value + 0.0)) * 0x100000001b3ULL;
+        }
+        return static_cast<size_t>(hash ^ (hash >> 29));
+    }
+};
+
+struct WeldedMesh {
+    std::vector<Vector> positions;
+    std::vector<Vector> normals;
+    std::vector<bool> has_normal;
+    std::vector<std::array<uint32_t, 3>> faces;
+    std::vector<MaterialHandle> materials;
+};
+
+// The normal of a welded vertex is the mean of the vn of its corners, so flat shaded
+// input becomes smooth in the simplified levels. Level 0 keeps the original faces.
+WeldedMesh Weld(std::span<const Object> objects) {
+    WeldedMesh mesh;
+    std::unordered_map<VertexKey, uint32_t, VertexKeyHash> ids;
+    ids.reserve(objects.size() * 3);
+    for (const Object& object : objects) {
+        std::array<uint32_t, 3> face;
+        for (size_t corner = 0; corner < 3; ++corner) {
+            const Vector& position = object.polygon[corner];
+            VertexKey key{{position[0], position[1], position[2]}, object.material.Index()};
+            auto [it, inserted] = ids.emplace(key, static_cast<uint32_t>(mesh.positions.size()));
+            if (inserted) {
+                mesh.positions.push_back(position);
+                mesh.normals.emplace_back();
+                mesh.has_normal.push_back(false);
+            }
+            face[corner] = it->second;
+            if (object.normals.has_value()) {
+                mesh.normals[it->second] = mesh.normals[it->second] + object.normals.value()[corner];
+                mesh.has_normal[it->second] = true;
+            }
+        }
+        mesh.faces.push_back(face);
+        mesh.materials.push_back(object.material);
+    }
+    for (size_t i = 0; i < mesh.normals.size(); ++i) {
+        if (mesh.has_normal[i] && Length(mesh.normals[i]) > 0) {
+            mesh.normals[i].Normalize();
+        } else {
+            mesh.has_normal[i] = false;
+        }
+    }
+    return mesh;
+}
+
+// groups of faces connected through shared welded vertices
+std::vector<std::vector<uint32_t>> GetComponents(const WeldedMesh& mesh) {
+    std::vector<uint32_t> parent(mesh.positions.size());
+    std::iota(parent.begin(), parent.end(), 0);
+    auto find = [&](uint32_t v) {
+        while (parent[v] != v) {
+            parent[v] = parent[parent[v]];
+            v = parent[v];
+        }
+        return v;
+    };
+    for (const auto& face : mesh.faces) {
+        parent[find(face[1])] = find(face[0]);
+        parent[find(face[2])] = find(face[0]);
+    }
+    std::unordered_map<uint32_t, size_t> component_of_root;
+    std::vector<std::vector<uint32_t>> components;
+    for (uint32_t i = 0; i < mesh.faces.size(); ++i) {
+        auto [it, inserted] = component_of_root.emplace(find(mesh.faces[i][0]), components.size());
+        if (inserted) {
+            components.emplace_back();
+        }
+        components[it->second].push_back(i);
+    }
+    return components;
+}
+
+Vector FaceNormal(const Vector& a, const Vector& b, const Vector& c) {
+    return CrossProduct(b - a, c - a);
+}
+
+// Garland-Heckbert simplification of one component. Every collapse keeps the cheapest of
+// the two endpoints and their midpoint; collapses that would flip a face are skipped.
+// Calls on_level with the surviving faces each time their count halves.
+class Simplifier {
+public:
+    Simplifier(const WeldedMesh& mesh, std::span<const uint32_t> faces) {
+        std::unordered_map<uint32_t, uint32_t> local;
+        auto local_id = [&](uint32_t global) {
+            auto [it, inserted] = local.emplace(global, static_cast<uint32_t>(positions_.size()));
+            if (inserted) {
+                positions_.push_back(mesh.positions[global]);
+                normals_.push_back(mesh.normals[global]);
+                has_normal_.push_back(mesh.has_normal[global]);
+            }
+            return it->second;
+        };
+        for (uint32_t face : faces) {
+            faces_.push_back({local_id(mesh.faces[face][0]), local_id(mesh.faces[face][1]),
+                              local_id(mesh.faces[face][2])});
+            materials_.push_back(mesh.materials[face]);
+        }
+        quadrics_.resize(positions_.size());
+        vertex_faces_.resize(positions_.size());
+        versions_.assign(positions_.size(), 0);
+        removed_.assign(positions_.size(), false);
+        alive_.assign(faces_.size(), true);
+        alive_count_ = faces_.size();
+
+        std::unordered_map<uint64_t, int> edge_faces;
+        auto edge_key = [](uint32_t a, uint32_t b) {
+            return (static_cast<uint64_t>(std::min(a, b)) << 32) | std::max(a, b);
+        };
+        for (uint32_t f = 0; f < faces_.size(); ++f) {
+            const auto& face = faces_[f];
+            Vector normal = FaceNormal(positions_[face[0]], positions_[face[1]],
+                                       positions_[face[2]]);
+            double length = Length(normal);
+            for (uint32_t v : face) {
+                vertex_faces_[v].push_back(f);
+            }
+            for (size_t k = 0; k < 3; ++k) {
+                ++edge_faces[edge_key(face[k], face[(k + 1) % 3])];
+            }
+            if (length == 0) {
+                continue;
+            }
+            normal = normal * (1 / length);
+            Quadric plane = Quadric::FromPlane(normal, -DotProduct(normal, positions_[face[0]]));
+            for (uint32_t v : face) {
+                quadrics_[v] += plane;
+            }
+        }
+        // planes through open edges, perpendicular to their face, hold the outline in place
+        for (const auto& face : faces_) {
+            Vector normal = FaceNormal(positions_[face[0]], positions_[face[1]],
+                                       positions_[face[2]]);
+            for (size_t k = 0; k < 3; ++k) {
+                uint32_t a = face[k];
+                uint32_t b = face[(k + 1) % 3];
+                if (edge_faces[edge_key(a, b)] != 1) {
+                    continue;
+                }
+                Vector side = CrossProduct(positions_[b] - positions_[a], normal);
+                double length = Length(side);
+                if (length == 0) {
+                    continue;
+                }
+                side = side * (1 / length);
+                Quadric plane = Quadric::FromPlane(side, -DotProduct(side, positions_[a]),
+                                                   kBoundaryWeight);
+                quadrics_[a] += plane;
+                quadrics_[b] += plane;
+            }
+        }
+        for (const auto& [key, count] : edge_faces) {
+            Push(static_cast<uint32_t>(key >> 32), static_cast<uint32_t>(key));
+        }
+    }
+
+    template <class Callback>
+    void Run(size_t max_levels, Callback on_level) {
+        size_t levels = 1;
+        size_t target = alive_count_ / 2;
+        double max_cost = 0;
+        while (levels < max_levels && target >= kMinLevelTriangles && !queue_.empty()) {
+            Candidate candidate = queue_.top();
+            queue_.pop();
+            if (removed_[candidate.a] || removed_[candidate.b] ||
+                versions_[candidate.a] != candidate.version_a ||
+                versions_[candidate.b] != candidate.version_b || Flips(candidate)) {
+                continue;
+            }
+            Collapse(candidate);
+            max_cost = std::max(max_cost, candidate.cost);
+            if (alive_count_ <= target) {
+                on_level(std::sqrt(max_cost), GetObjects());
+                ++levels;
+                target = alive_count_ / 2;
+            }
+        }
+    }
+
+    std::vector<Object> GetObjects() const {
+        std::vector<Object> objects;
+        objects.reserve(alive_count_);
+        for (uint32_t f = 0; f < faces_.size(); ++f) {
+            if (!alive_[f]) {
+                continue;
+            }
+            const auto& face = faces_[f];
+            std::optional<Triangle> normals;
+            if (has_normal_[face[0]] && has_normal_[face[1]] && has_normal_[face[2]]) {
+                normals.emplace(normals_[face[0]], normals_[face[1]], normals_[face[2]]);
+            }
+            objects.push_back(Object{
+                materials_[f],
+                Triangle(positions_[face[0]], positions_[face[1]], positions_[face[2]]),
+                normals});
+        }
+        return objects;
+    }
+
+private:
+    struct Candidate {
+        double cost;
+        uint32_t a;
+        uint32_t b;
+        uint32_t version_a;
+        uint32_t version_b;
+        Vector target;
+        // weight of b in the normal of the merged vertex
+        double t;
+
+        bool operator>(const Candidate& other) const {
+            return cost > other.cost;
+        }
+    };
+
+    void Push(uint32_t a, uint32_t b) {
+        Quadric q = quadrics_[a];
+        q += quadrics_[b];
+        Candidate best{std::numeric_limits<double>::infinity(), a, b, versions_[a], versions_[b],
+                       Vector(), 0};
+        for (double t : {0.0, 1.0, 0.5}) {
+            Vector target = positions_[a] * (1 - t) + positions_[b] * t;
+            double cost = std::max(0.0, q.Evaluate(target));
+            if (cost < best.cost) {
+                best.cost = cost;
+                best.target = target;
+                best.t = t;
+            }
+        }
+        queue_.push(best);
+    }
+
+    bool Flips(const Candidate& candidate) const {
+        for (uint32_t v : {candidate.a, candidate.b}) {
+            for (uint32_t f : vertex_faces_[v]) {
+                const auto& face = faces_[f];
+                bool has_a = std::find(face.begin(), face.end(), candidate.a) != face.end();
+                bool has_b = std::find(face.begin(), face.end(), candidate.b) != face.end();
+                // faces on the collapsed edge disappear
+                if (!alive_[f] || (has_a && has_b)) {
+                    continue;
+                }
+                std::array<Vector, 3> moved;
+                for (size_t k = 0; k < 3; ++k) {
+                    moved[k] = face[k] == v ? candidate.target : positions_[face[k]];
+                }
+                Vector before = FaceNormal(positions_[face[0]], positions_[face[1]],
+                                           positions_[face[2]]);
+                Vector after = FaceNormal(moved[0], moved[1], moved[2]);
+                if (Length(before) > 0 && DotProduct(before, after) <= 0) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void Collapse(const Candidate& candidate) {
+        const uint32_t a = candidate.a;
+        const uint32_t b = candidate.b;
+        positions_[a] = candidate.target;
+        if (has_normal_[a]) {
+            Vector normal = normals_[a] * (1 - candidate.t) + normals_[b] * candidate.t;
+            if (Length(normal) > 0) {
+                normal.Normalize();
+                normals_[a] = normal;
+            }
+        }
+        quadrics_[a] += quadrics_[b];
+        removed_[b] = true;
+        ++versions_[a];
+        ++versions_[b];
+
+        for (uint32_t f : vertex_faces_[b]) {
+            if (!alive_[f]) {
+                continue;
+            }
+            auto& face = faces_[f];
+            if (std::find(face.begin(), face.end(), a) != face.end()) {
+                alive_[f] = false;
+                --alive_count_;
+                continue;
+            }
+            std::replace(face.begin(), face.end(), b, a);
+            vertex_faces_[a].push_back(f);
+        }
+        vertex_faces_[b].clear();
+        std::erase_if(vertex_faces_[a], [&](uint32_t f) { return !alive_[f]; });
+        std::sort(vertex_faces_[a].begin(), vertex_faces_[a].end());
+        vertex_faces_[a].erase(std::unique(vertex_faces_[a].begin(), vertex_faces_[a].end()),
+                               vertex_faces_[a].end());
+
+        std::vector<uint32_t> neighbours;
+        for (uint32_t f : vertex_faces_[a]) {
+            for (uint32_t v : faces_[f]) {
+                if (v != a) {
+                    neighbours.push_back(v);
+                }
+            }
+        }
+        std::sort(neighbours.begin(), neighbours.end());
+        neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+        for (uint32_t v : neighbours) {
+            Push(a, v);
+        }
+    }
+
+    std::vector<Vector> positions_;
+    std::vector<Vector> normals_;
+    std::vector<bool> has_normal_;
+    std::vector<Quadric> quadrics_;
+    std::vector<std::vector<uint32_t>> vertex_faces_;
+    std::vector<uint32_t> versions_;
+    std::vector<bool> removed_;
+    std::vector<std::array<uint32_t, 3>> faces_;
+    std::vector<MaterialHandle> materials_;
+    std::vector<bool> alive_;
+    size_t alive_count_ = 0;
+    std::priority_queue<Candidate, std::vector<Candidate>, std::greater<>> queue_;
+};
+
+// median splits along the longest axis of the centroids until ranges fit a chunk
+void SplitIntoChunks(std::span<const Object> objects, std::vector<uint32_t>* order,
+                     size_t begin, size_t end, size_t chunk_size,
+                     std::vector<std::pair<size_t, size_t>>* ranges) {
+    if (end - begin <= chunk_size) {
+        ranges->emplace_back(begin, end);
+        return;
+    }
+    auto centroid = [&](uint32_t i) {
+        const Triangle& triangle = objects[i].polygon;
+        return (triangle[0] + triangle[1] + triangle[2]) * (1.0 / 3);
+    };
+    BoundingBox box;
+    for (size_t i = begin; i < end; ++i) {
+        box.Extend(centroid((*order)[i]));
+    }
+    Vector extent = box.max - box.min;
+    size_t axis = extent[0] >= extent[1] && extent[0] >= extent[2] ? 0
+                  : extent[1] >= extent[2]                          ? 1
+                                                                    : 2;
+    size_t middle = begin + (end - begin) / 2;
+    std::nth_element(order->begin() + begin, order->begin() + middle, order->begin() + end,
+                     [&](uint32_t lhs, uint32_t rhs) {
+                         return centroid(lhs)[axis] < centroid(rhs)[axis];
+                     });
+    SplitIntoChunks(objects, order, begin, middle, chunk_size, ranges);
+    SplitIntoChunks(objects, order, middle, end, chunk_size, ranges);
+}
+
+double DistanceToBox(const Vector& point, const BoundingBox& box) {
+    Vector outside;
+    for (size_t i = 0; i < 3; ++i) {
+        outside[i] = std::max({box.min[i] - point[i], 0.0, point[i] - box.max[i]});
+    }
+    return Length(outside);
+}
+
+}  // namespace lod_detail
+
+class LodScene {
+public:
+    // keeps a copy of the scene so the material handles of its objects stay valid
+    explicit LodScene(const Scene& scene, const LodOptions& options = {}) : base_(scene) {
+        using namespace lod_detail;
+        TraceSpan span("prepare scene", "scene");
+
+        // polygons are simplified as their triangles
+        std::vector<Object> triangulated;
+        std::span<const Object> objects = scene.GetObjects();
+        if (!scene.GetPolygonObjects().empty()) {
+            for (const Object& object : objects) {
+                triangulated.push_back(object);
+            }
+            for (const PolygonObject& polygon : scene.GetPolygonObjects()) {
+                for (const Object& object : Triangulate(polygon)) {
+                    triangulated.push_back(object);
+                }
+            }
+            objects = triangulated;
+        }
+        WeldedMesh welded = Weld(objects);
+        // components below the size limit share one mesh with a single level
+        std::vector<Object> small;
+        for (const auto& component : GetComponents(welded)) {
+            if (component.size() < options.min_triangles) {
+                for (uint32_t face : component) {
+                    small.push_back(objects[face]);
+                }
+                continue;
+            }
+            LodMesh& mesh = meshes_.emplace_back();
+            std::vector<Object> original;
+            for (uint32_t face : component) {
+                original.push_back(objects[face]);
+            }
+            AddLevel(&mesh, 0, original, options.chunk_size);
+            Simplifier simplifier(welded, component);
+            simplifier.Run(options.max_levels, [&](double error, std::vector<Object> level) {
+                AddLevel(&mesh, error, level, options.chunk_size);
+            });
+        }
+        if (!small.empty()) {
+            AddLevel(&meshes_.emplace_back(), 0, small, options.chunk_size);
+        }
+        selected_.assign(meshes_.size(), 0);
+        span.AddArg("meshes", static_cast<int64_t>(meshes_.size()));
+    }
+
+    // Picks the level of every mesh for the rays that follow, not safe during a render.
+    void SetView(const LodView& view) {
+        for (size_t i = 0; i < meshes_.size(); ++i) {
+            const LodMesh& mesh = meshes_[i];
+            double allowed = view.tolerance * view.pixel_angle *
+                             lod_detail::DistanceToBox(view.eye, mesh.box);
+            uint32_t level = 0;
+            while (!view.full_detail && level + 1 < mesh.levels.size() &&
+                   mesh.levels[level + 1].error <= allowed) {
+                ++level;
+            }
+            selected_[i] = level;
+        }
+    }
+
+    std::span<const LodMesh> GetMeshes() const {
+        return meshes_;
+    }
+
+    const LodLevel& GetSelectedLevel(size_t mesh) const {
+        return meshes_[mesh].levels[selected_[mesh]];
+    }
+
+    // triangles the current view traces
+    size_t GetSelectedTriangles() const {
+        size_t triangles = 0;
+        for (size_t i = 0; i < meshes_.size(); ++i) {
+            triangles += GetSelectedLevel(i).triangles;
+        }
+        return triangles;
+    }
+
+    std::span<const LodChunk> GetChunks() const {
+        return chunks_;
+    }
+
+    // triangles of every level, indexed by the chunks
+    std::span<const Object> GetObjects() const {
+        return objects_;
+    }
+
+    std::span<const SphereObject> GetSphereObjects() const {
+        return base_.GetSphereObjects();
+    }
+
+    std::span<const Light> GetLights() const {
+        return base_.GetLights();
+    }
+
+private:
+    void AddLevel(LodMesh* mesh, double error, const std::vector<Object>& level,
+                  size_t chunk_size) {
+        std::vector<uint32_t> order(level.size());
+        std::iota(order.begin(), order.end(), 0);
+        std::vector<std::pair<size_t, size_t>> ranges;
+        lod_detail::SplitIntoChunks(level, &order, 0, level.size(),
+                                    std::max<size_t>(1, chunk_size), &ranges);
+
+        LodLevel& added = mesh->levels.emplace_back();
+        added.error = error;
+        added.first_chunk = static_cast<uint32_t>(chunks_.size());
+        added.chunk_count = static_cast<uint32_t>(ranges.size());
+        added.triangles = level.size();
+        for (auto [begin, end] : ranges) {
+            LodChunk& chunk = chunks_.emplace_back();
+            chunk.first = static_cast<uint32_t>(objects_.size());
+            chunk.count = static_cast<uint32_t>(end - begin);
+            for (size_t i = begin; i < end; ++i) {
+                const Object& object = level[order[i]];
+                objects_.push_back(object);
+                chunk.box.Extend(GetBoundingBox(object.polygon));
+            }
+            mesh->box.Extend(chunk.box);
+        }
+    }
+
+    Scene base_;
+    std::vector<Object> objects_;
+    std::vector<LodChunk> chunks_;
+    std::vector<LodMesh> meshes_;
+    std::vector<uint32_t> selected_;
+};
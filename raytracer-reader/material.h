@@ -1,6 +1,9 @@
 #pragma once
 
 #include <vector.h>
+
+#include <cstddef>
+#include <cstdint>
 #include <string>
 
 struct Material {
@@ -13,3 +16,42 @@ struct Material {
     double refraction_index = 1.0;
     Vector albedo = Vector(1, 0, 0);
 };
+
+// Reference to a material in a scene's material table. Tables are never reallocated
+// or copied after loading, so handles stay valid across moves and copies of the scene.
+class MaterialHandle {
+public:
+    MaterialHandle() = default;
+
+    MaterialHandle(const Material* material, uint32_t index) : material_(material), index_(index) {
+    }
+
+    const Material* Get() const {
+        return material_;
+    }
+
+    const Material* operator->() const {
+        return material_;
+    }
+
+    const Material& operator*() const {
+        return *material_;
+    }
+
+    // position in the table the material came from
+    uint32_t Index() const {
+        return index_;
+    }
+
+    explicit operator bool() const {
+        return material_ != nullptr;
+    }
+
+    bool operator==(std::nullptr_t) const {
+        return material_ == nullptr;
+    }
+
+private:
+    const Material* material_ = nullptr;
+    uint32_t index_ = 0;
+};
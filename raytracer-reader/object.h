@@ -2,12 +2,16 @@
 
 #include <triangle.h>
 #include <material.h>
+#include <polygon.h>
 #include <sphere.h>
 #include <vector.h>
+#include <array>
 #include <optional>
+#include <span>
+#include <vector>
 
 struct Object {
-    const Material* material = nullptr;
+    MaterialHandle material;
     Triangle polygon;
     std::optional<Triangle> normals;
 
@@ -20,6 +24,35 @@ struct Object {
 };
 
 struct SphereObject {
-    const Material* material = nullptr;
+    MaterialHandle material;
     Sphere sphere;
 };
+
+struct PolygonObject {
+    MaterialHandle material;
+    Polygon polygon;
+    std::optional<std::array<Vector, Polygon::kMaxVertices>> normals;
+
+    // one per vertex, empty when the face has no vn
+    std::span<const Vector> GetNormals() const {
+        if (!normals.has_value()) {
+            return {};
+        }
+        return std::span<const Vector>(normals->data(), polygon.Size());
+    }
+};
+
+// the fan of triangles the face would be read as
+std::vector<Object> Triangulate(const PolygonObject& object) {
+    std::vector<Object> triangles;
+    for (size_t i = 1; i + 1 < object.polygon.Size(); ++i) {
+        std::optional<Triangle> normals;
+        if (object.normals.has_value()) {
+            normals.emplace((*object.normals)[0], (*object.normals)[i], (*object.normals)[i + 1]);
+        }
+        triangles.push_back(Object{
+            object.material,
+            Triangle(object.polygon[0], object.polygon[i], object.polygon[i + 1]), normals});
+    }
+    return triangles;
+}
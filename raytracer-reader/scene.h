@@ -4,50 +4,141 @@
 #include <vector.h>
 #include <object.h>
 #include <light.h>
+#include <trace.h>
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
 #include <optional>
-#include <iterator>
-#include <regex>
 #include <fstream>
+#include <memory>
+#include <memory_resource>
+#include <span>
+#include <sstream>
+#include <stdexcept>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+#include <set>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
 #include <filesystem>
 
+// Everything a loaded scene owns. Geometry is placed in one monotonic arena sized from
+// a counting pass, so a load makes a few large allocations and frees them all at once.
+// The material table is never modified after loading, handles point straight into it.
+struct SceneStorage {
+    explicit SceneStorage(size_t arena_size)
+        : arena(std::max<size_t>(arena_size, 1)),
+          objects(&arena),
+          sphere_objects(&arena),
+          polygon_objects(&arena),
+          lights(&arena) {
+    }
+
+    std::pmr::monotonic_buffer_resource arena;
+    std::pmr::vector<Object> objects;
+    std::pmr::vector<SphereObject> sphere_objects;
+    std::pmr::vector<PolygonObject> polygon_objects;
+    std::pmr::vector<Light> lights;
+    std::unordered_map<std::string, Material> materials;
+    std::vector<const Material*> material_table;
+    // the mtllib files the materials were read from
+    std::vector<std::filesystem::path> material_files;
+};
+
+// Copies share the immutable storage, so copying is cheap and material handles taken
+// from any copy stay valid as long as one of them is alive.
 class Scene {
 public:
-    Scene(std::vector<Object>& objects, std::vector<SphereObject>& sphere_objects,
-          std::vector<Light>& lights, std::unordered_map<std::string, Material>& materials)
-        : objects_(std::move(objects)),
-          sphere_objects_(std::move(sphere_objects)),
-          lights_(std::move(lights)),
-          materials_(std::move(materials)) {
+    explicit Scene(std::shared_ptr<const SceneStorage> storage) : storage_(std::move(storage)) {
+    }
+
+    std::span<const Object> GetObjects() const {
+        return storage_->objects;
     }
 
-    const std::vector<Object>& GetObjects() const {
-        return objects_;
+    std::span<const SphereObject> GetSphereObjects() const {
+        return storage_->sphere_objects;
     }
 
-    const std::vector<SphereObject>& GetSphereObjects() const {
-        return sphere_objects_;
+    // faces read as a single polygon, empty unless SceneReadOptions::polygons is set
+    std::span<const PolygonObject> GetPolygonObjects() const {
+        return storage_->polygon_objects;
     }
 
-    const std::vector<Light>& GetLights() const {
-        return lights_;
+    std::span<const Light> GetLights() const {
+        return storage_->lights;
     }
 
     const std::unordered_map<std::string, Material>& GetMaterials() const {
-        return materials_;
+        return storage_->materials;
+    }
+
+    MaterialHandle GetMaterial(uint32_t index) const {
+        return MaterialHandle(storage_->material_table.at(index), index);
+    }
+
+    const std::vector<std::filesystem::path>& GetMaterialFiles() const {
+        return storage_->material_files;
     }
 
 private:
-    std::vector<Object> objects_;
-    std::vector<SphereObject> sphere_objects_;
-    std::vector<Light> lights_;
-    std::unordered_map<std::string, Material> materials_;
+    std::shared_ptr<const SceneStorage> storage_;
+};
+
+// Optional pass of ReadScene over the faces as they are emitted.
+struct SceneCleanupOptions {
+    // vertices within this distance on every axis are merged into the first of them,
+    // 0 merges only identical positions
+    double weld_tolerance = 1e-9;
+    // triangles with a smaller area are dropped, as are those with a repeated vertex
+    double min_area = 1e-12;
+    // a triangle over the same welded vertices as an earlier one is dropped in either winding;
+    // a reversed copy could round to a slightly smaller t, so the hit may move by that much
+    bool drop_duplicates = true;
+    // vn normals are made unit length once instead of interpolated as given
+    bool normalize_normals = true;
+};
+
+struct SceneCleanupReport {
+    // vertices that were merged into an earlier one
+    size_t welded_vertices = 0;
+    size_t degenerate_triangles = 0;
+    size_t duplicate_triangles = 0;
+    size_t duplicate_polygons = 0;
+    // vn normals that were not unit length
+    size_t normalized_normals = 0;
+
+    size_t RemovedTriangles() const {
+        return degenerate_triangles + duplicate_triangles;
+    }
+};
+
+struct SceneReadOptions {
+    // bytes the load may take, 0 means no limit
+    size_t memory_budget = 0;
+    std::optional<SceneCleanupOptions> cleanup = std::nullopt;
+    // planar convex faces of 4 to Polygon::kMaxVertices vertices become one PolygonObject
+    // instead of a fan of triangles, the others are triangulated as usual
+    bool polygons = false;
+    // threads of the pipelined load, 0 uses every core; with cleanup the file is parsed
+    // as a single chunk since vertices are welded in file order
+    int threads = 1;
 };
 
 std::unordered_map<std::string, Material> ReadMaterials(const std::filesystem::path& path) {
+    TraceSpan span("load materials", "scene");
     std::unordered_map<std::string, Material> materials;
 
     std::ifstream mtl_file(path.string());
@@ -98,111 +189,736 @@ std::unordered_map<std::string, Material> ReadMaterials(const std::filesystem::p
     return materials;
 }
 
-Scene ReadScene(const std::filesystem::path& path) {
-    std::ifstream obj_file(path.string());
+namespace scene_detail {
 
-    std::vector<Vector> vertices;
-    std::vector<Vector> normals;
+// splits on whitespace into views of the line, reusing the output storage
+void SplitTokens(std::string_view line, std::vector<std::string_view>* tokens) {
+    tokens->clear();
+    size_t pos = 0;
+    while (true) {
+        pos = line.find_first_not_of(" \t\r", pos);
+        if (pos == std::string_view::npos) {
+            return;
+        }
+        size_t end = std::min(line.find_first_of(" \t\r", pos), line.size());
+        tokens->push_back(line.substr(pos, end - pos));
+        pos = end;
+    }
+}
 
-    std::vector<Object> objects;
-    std::vector<SphereObject> sphere_objects;
-    std::vector<Light> lights;
-    std::unordered_map<std::string, Material> materials;
+double ParseDouble(std::string_view token) {
+    if (!token.empty() && token[0] == '+') {
+        token.remove_prefix(1);
+    }
+    double value = 0;
+    auto [ptr, error] = std::from_chars(token.data(), token.data() + token.size(), value);
+    if (error != std::errc()) {
+        throw std::invalid_argument("Bad number: " + std::string(token));
+    }
+    return value;
+}
+
+Vector ParseVector(const std::vector<std::string_view>& tokens, size_t first) {
+    return Vector(ParseDouble(tokens[first]), ParseDouble(tokens[first + 1]),
+                  ParseDouble(tokens[first + 2]));
+}
+
+// parses "v", "v/t", "v//n" and "v/t/n" face tokens
+bool ParseFaceToken(std::string_view token, int* vertex, std::optional<int>* normal) {
+    const char* begin = token.data();
+    const char* end = token.data() + token.size();
+    auto [ptr, error] = std::from_chars(begin, end, *vertex);
+    if (error != std::errc() || *vertex == 0) {
+        return false;
+    }
+    *normal = std::nullopt;
+    size_t first_slash = token.find('/');
+    size_t second_slash =
+        first_slash == std::string_view::npos ? first_slash : token.find('/', first_slash + 1);
+    if (second_slash != std::string_view::npos && second_slash + 1 < token.size()) {
+        int value = 0;
+        auto result = std::from_chars(begin + second_slash + 1, end, value);
+        if (result.ec == std::errc() && value != 0) {
+            *normal = value;
+        }
+    }
+    return true;
+}
+
+size_t ResolveIndex(int index, size_t count) {
+    int64_t resolved = index > 0 ? index - 1 : static_cast<int64_t>(count) + index;
+    if (resolved < 0 || static_cast<size_t>(resolved) >= count) {
+        throw std::out_of_range("Face refers to a missing vertex");
+    }
+    return static_cast<size_t>(resolved);
+}
+
+// Fills a buffer of the file size block by block on its own thread, so the part that is
+// already in memory can be worked on while the rest is read. The buffer never moves.
+class BackgroundFileReader {
+public:
+    static constexpr size_t kBlockSize = 1 << 20;
+
+    explicit BackgroundFileReader(const std::filesystem::path& path)
+        : file_(path, std::ios::binary) {
+        if (!file_) {
+            throw std::runtime_error("Can't open " + path.string());
+        }
+        text_.resize(std::filesystem::file_size(path));
+        thread_ = std::jthread([this](std::stop_token stop_token) { Read(stop_token); });
+    }
+
+    // waits until the first size bytes are read or the file ended, returns how many of
+    // them are there
+    size_t WaitFor(size_t size) {
+        std::unique_lock lock(mutex_);
+        cv_.wait(lock, [&] { return read_ >= size || done_; });
+        return std::min(read_, size);
+    }
+
+    // offset of the first line starting at pos or later, waits for the bytes it scans
+    size_t FindLineStart(size_t pos) {
+        if (pos == 0) {
+            return 0;
+        }
+        for (size_t from = pos - 1;;) {
+            const size_t available = WaitFor(from + kBlockSize);
+            const size_t found = std::string_view(text_.data(), available).find('\n', from);
+            if (found != std::string_view::npos) {
+                return found + 1;
+            }
+            if (available < from + kBlockSize) {
+                return available;
+            }
+            from = available;
+        }
+    }
+
+    size_t Size() const {
+        return text_.size();
+    }
+
+    // bytes in [begin, end) that WaitFor or FindLineStart already waited for
+    std::string_view GetRange(size_t begin, size_t end) const {
+        return std::string_view(text_.data() + begin, end - begin);
+    }
 
-    Material* cur_material = nullptr;
+    // the whole file, shorter than its size if it shrank meanwhile
+    std::string_view GetText() {
+        return std::string_view(text_.data(), WaitFor(text_.size()));
+    }
+
+private:
+    void Read(std::stop_token stop_token) {
+        size_t pos = 0;
+        while (pos < text_.size() && !stop_token.stop_requested()) {
+            const size_t size = std::min(kBlockSize, text_.size() - pos);
+            file_.read(text_.data() + pos, static_cast<std::streamsize>(size));
+            const size_t count = static_cast<size_t>(file_.gcount());
+            pos += count;
+            if (count < size) {
+                break;
+            }
+            std::lock_guard lock(mutex_);
+            read_ = pos;
+            cv_.notify_all();
+        }
+        std::lock_guard lock(mutex_);
+        read_ = pos;
+        done_ = true;
+        cv_.notify_all();
+    }
 
-    while (!obj_file.eof()) {
-        std::string line;
-        std::getline(obj_file, line);
+    std::ifstream file_;
+    std::string text_;
+    size_t read_ = 0;
+    bool done_ = false;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    std::jthread thread_;
+};
 
+// With first set only the lines starting with it are split and passed on.
+template <class Callback>
+void ForEachLine(std::string_view text, std::vector<std::string_view>* tokens, Callback callback,
+                 char first = '\0') {
+    while (!text.empty()) {
+        size_t end = std::min(text.find('\n'), text.size());
+        std::string_view line = text.substr(0, end);
+        text.remove_prefix(std::min(end + 1, text.size()));
         if (line.empty() || line[0] == '#') {
             continue;
         }
+        if (first != '\0') {
+            size_t pos = line.find_first_not_of(" \t\r");
+            if (pos == std::string_view::npos || line[pos] != first) {
+                continue;
+            }
+        }
+        SplitTokens(line, tokens);
+        if (!tokens->empty()) {
+            callback(*tokens);
+        }
+    }
+}
 
-        std::istringstream iss(line);
-        std::vector<std::string> tokens(std::istream_iterator<std::string>{iss},
-                                        std::istream_iterator<std::string>());
-
-        if (tokens[0] == "v" && tokens.size() >= 4) {
-            Vector vertex;
-            vertex[0] = std::stod(tokens[1]);
-            vertex[1] = std::stod(tokens[2]);
-            vertex[2] = std::stod(tokens[3]);
-            vertices.push_back(vertex);
-        } else if (tokens[0] == "vn" && tokens.size() >= 4) {
-            Vector normal;
-            normal[0] = std::stod(tokens[1]);
-            normal[1] = std::stod(tokens[2]);
-            normal[2] = std::stod(tokens[3]);
-            normals.push_back(normal);
-        } else if (tokens[0] == "f" && tokens.size() >= 4) {
-            std::regex pattern("(-?\\d+)(/)?(-?\\d+)?(/)?(-?\\d+)?");
-            std::smatch match;
-            if (std::regex_match(tokens[1], match, pattern)) {
-                if (match[5].matched) {
-                    std::vector<Vector> vertices_temp;
-                    std::vector<Vector> normals_temp;
-
-                    for (size_t i = 1; i < tokens.size(); ++i) {
-                        std::regex pattern("(-?\\d+)(/)?(-?\\d+)?(/)?(-?\\d+)?");
-                        std::smatch match;
-                        std::regex_match(tokens[i], match, pattern);
-                        int num1 = std::stoi(match[1]);
-                        int num3 = std::stoi(match[5]);
-                        vertices_temp.push_back(num1 > 0 ? *(vertices.begin() + num1 - 1)
-                                                         : *(vertices.end() + num1));
-                        normals_temp.push_back(num3 > 0 ? *(normals.begin() + num3 - 1)
-                                                        : *(normals.end() + num3));
+struct SceneCounts {
+    size_t vertices = 0;
+    size_t normals = 0;
+    size_t triangles = 0;
+    // faces that may be read as polygons
+    size_t polygons = 0;
+    size_t spheres = 0;
+    size_t lights = 0;
+
+    SceneCounts& operator+=(const SceneCounts& other) {
+        vertices += other.vertices;
+        normals += other.normals;
+        triangles += other.triangles;
+        polygons += other.polygons;
+        spheres += other.spheres;
+        lights += other.lights;
+        return *this;
+    }
+};
+
+template <class T>
+size_t ArenaBytes(size_t count) {
+    return count * sizeof(T) + alignof(T);
+}
+
+size_t GetArenaSize(const SceneCounts& counts) {
+    return ArenaBytes<Object>(counts.triangles) + ArenaBytes<SphereObject>(counts.spheres) +
+           ArenaBytes<PolygonObject>(counts.polygons) + ArenaBytes<Light>(counts.lights);
+}
+
+// A run of whole lines of the file, the pipelined load counts and parses each one on
+// its own thread.
+struct SceneChunk {
+    size_t begin = 0;
+    size_t end = 0;
+    SceneCounts counts;
+    // indices of the first vertex and normal of the chunk in the whole file
+    size_t first_vertex = 0;
+    size_t first_normal = 0;
+    // mtllib files of the chunk, read while the rest of the file is counted
+    std::vector<std::future<std::unordered_map<std::string, Material>>> materials;
+    std::vector<std::filesystem::path> material_files;
+    // the last usemtl name, empty if there is none
+    std::string_view last_material;
+};
+
+// Runs task for every chunk, on a thread each unless there is only one, and rethrows
+// the first exception after all of them returned.
+void ForEachChunk(size_t count, const std::function<void(size_t)>& task) {
+    if (count == 1) {
+        task(0);
+        return;
+    }
+    std::exception_ptr error;
+    std::mutex mutex;
+    {
+        std::vector<std::jthread> workers;
+        for (size_t chunk = 0; chunk < count; ++chunk) {
+            workers.emplace_back([&, chunk] {
+                try {
+                    task(chunk);
+                } catch (...) {
+                    std::lock_guard lock(mutex);
+                    if (!error) {
+                        error = std::current_exception();
                     }
+                }
+            });
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// Welds vertices through a hash grid of tolerance-sized cells and remembers the kept
+// triangles by their sorted welded vertex indices.
+class GeometryCleaner {
+public:
+    GeometryCleaner(const SceneCleanupOptions& options, SceneCleanupReport* report)
+        : options_(options), report_(report) {
+    }
+
+    // index of the vertex the next one of the file is merged into, its own if none
+    size_t AddVertex(std::span<const Vector> vertices, const Vector& position) {
+        const size_t index = welded_.size();
+        const Cell cell = GetCell(position);
+        const int reach = options_.weld_tolerance > 0 ? 1 : 0;
+        for (int dx = -reach; dx <= reach; ++dx) {
+            for (int dy = -reach; dy <= reach; ++dy) {
+                for (int dz = -reach; dz <= reach; ++dz) {
+                    auto it = cells_.find({cell[0] + dx, cell[1] + dy, cell[2] + dz});
+                    for (size_t other = it == cells_.end() ? kNone : it->second; other != kNone;
+                         other = next_[other]) {
+                        if (IsClose(vertices[other], position)) {
+                            ++report_->welded_vertices;
+                            welded_.push_back(other);
+                            next_.push_back(kNone);
+                            return other;
+                        }
+                    }
+                }
+            }
+        }
+        auto [it, inserted] = cells_.try_emplace(cell, index);
+        next_.push_back(inserted ? kNone : it->second);
+        it->second = index;
+        welded_.push_back(index);
+        return index;
+    }
+
+    size_t GetWelded(size_t vertex) const {
+        return welded_[vertex];
+    }
+
+    Vector AddNormal(Vector normal) {
+        double length = Length(normal);
+        if (!options_.normalize_normals || length == 0 || std::abs(length - 1) < 1e-12) {
+            return normal;
+        }
+        ++report_->normalized_normals;
+        return normal * (1 / length);
+    }
+
+    // indices are welded ones
+    bool KeepTriangle(std::array<size_t, 3> indices, const Triangle& triangle) {
+        if (indices[0] == indices[1] || indices[1] == indices[2] || indices[0] == indices[2] ||
+            triangle.Area() <= options_.min_area) {
+            ++report_->degenerate_triangles;
+            return false;
+        }
+        if (!options_.drop_duplicates) {
+            return true;
+        }
+        // sorted, so both windings of the same vertices count as one triangle
+        std::sort(indices.begin(), indices.end());
+        if (!triangles_.insert(indices).second) {
+            ++report_->duplicate_triangles;
+            return false;
+        }
+        return true;
+    }
+
+    // a polygon is convex and planar already, only duplicates are dropped
+    bool KeepPolygon(std::vector<size_t> indices) {
+        if (!options_.drop_duplicates) {
+            return true;
+        }
+        std::sort(indices.begin(), indices.end());
+        if (!polygons_.insert(std::move(indices)).second) {
+            ++report_->duplicate_polygons;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    static constexpr size_t kNone = static_cast<size_t>(-1);
+
+    using Cell = std::array<int64_t, 3>;
+
+    template <class Array>
+    struct ArrayHash {
+        size_t operator()(const Array& values) const {
+            size_t hash = 0;
+            for (auto value : values) {
+                hash = hash * 1000003 ^ std::hash<typename Array::value_type>()(value);
+            }
+            return hash;
+        }
+    };
+
+    Cell GetCell(const Vector& position) const {
+        Cell cell;
+        for (size_t i = 0; i < 3; ++i) {
+            cell[i] = options_.weld_tolerance > 0
+                          ? static_cast<int64_t>(std::floor(position[i] / options_.weld_tolerance))
+                          : std::bit_cast<int64_t>(position[i] + 0.0);
+        }
+        return cell;
+    }
+
+    bool IsClose(const Vector& a, const Vector& b) const {
+        for (size_t i = 0; i < 3; ++i) {
+            if (std::abs(a[i] - b[i]) > options_.weld_tolerance) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    SceneCleanupOptions options_;
+    SceneCleanupReport* report_;
+    std::vector<size_t> welded_;
+    // first vertex of every cell and the next one of the same cell, kNone ends a chain
+    std::unordered_map<Cell, size_t, ArrayHash<Cell>> cells_;
+    std::vector<size_t> next_;
+    std::unordered_set<std::array<size_t, 3>, ArrayHash<std::array<size_t, 3>>> triangles_;
+    std::set<std::vector<size_t>> polygons_;
+};
+
+// heap bytes of a string beyond the object itself, zero while it fits the inline buffer
+size_t StringHeapBytes(const std::string& text) {
+    return text.capacity() > std::string().capacity() ? text.capacity() + 1 : 0;
+}
+
+}  // namespace scene_detail
+
+class MemoryBudgetExceeded : public std::runtime_error {
+public:
+    MemoryBudgetExceeded(const std::string& what, size_t needed, size_t budget)
+        : std::runtime_error(what + " needs at least " + std::to_string(needed) +
+                             " bytes, the memory budget is " + std::to_string(budget) +
+                             " bytes"),
+          needed_(needed),
+          budget_(budget) {
+    }
+
+    size_t Needed() const {
+        return needed_;
+    }
+
+    size_t Budget() const {
+        return budget_;
+    }
+
+private:
+    size_t needed_;
+    size_t budget_;
+};
+
+// a zero budget means no limit
+void CheckMemoryBudget(const std::string& what, size_t needed, size_t budget) {
+    if (budget > 0 && needed > budget) {
+        throw MemoryBudgetExceeded(what, needed, budget);
+    }
+}
+
+// Bytes owned by a loaded scene. Normals are stored inline in every Object, so faces
+// without vn still pay for the empty slot.
+struct SceneFootprint {
+    size_t objects = 0;
+    size_t normals = 0;
+    size_t spheres = 0;
+    size_t polygons = 0;
+    size_t materials = 0;
+    size_t lights = 0;
+
+    size_t Total() const {
+        return objects + normals + spheres + polygons + materials + lights;
+    }
+};
+
+SceneFootprint GetFootprint(const Scene& scene) {
+    using scene_detail::StringHeapBytes;
 
-                    for (size_t i = 0; i < tokens.size() - 3; ++i) {
-                        objects.push_back(Object{
-                            cur_material,
-                            Triangle(vertices_temp[0], vertices_temp[i + 1], vertices_temp[i + 2]),
-                            std::make_optional<Triangle>(normals_temp[0], normals_temp[i + 1],
-                                                         normals_temp[i + 2])});
+    SceneFootprint footprint;
+    const size_t triangles = scene.GetObjects().size();
+    footprint.normals = triangles * sizeof(std::optional<Triangle>);
+    footprint.objects = triangles * sizeof(Object) - footprint.normals;
+    footprint.spheres = scene.GetSphereObjects().size() * sizeof(SphereObject);
+    footprint.polygons = scene.GetPolygonObjects().size() * sizeof(PolygonObject);
+    footprint.lights = scene.GetLights().size() * sizeof(Light);
+
+    const auto& materials = scene.GetMaterials();
+    // every map node carries its next pointer and cached hash next to the value
+    footprint.materials = materials.bucket_count() * sizeof(void*) +
+                          materials.size() * sizeof(const Material*);
+    for (const auto& [name, material] : materials) {
+        footprint.materials += sizeof(std::pair<const std::string, Material>) +
+                               2 * sizeof(void*) + StringHeapBytes(name) +
+                               StringHeapBytes(material.name);
+    }
+    return footprint;
+}
+
+// A pipelined load in two passes over the file kept in memory. The file is read on its
+// own thread while the line-aligned chunks that are already in memory are counted, so
+// every container is reserved exactly once, and mtllib files load as soon as they are
+// seen. Then the chunks parse their vertices and, once all vertices are known, their
+// faces in parallel without copies of the text; the result is the same for any number
+// of threads. With a nonzero memory_budget the load stops with MemoryBudgetExceeded as
+// soon as the file or the counted geometry is known not to fit, before the big
+// allocations. With cleanup the faces go through a GeometryCleaner and report gets what
+// it removed.
+Scene ReadScene(const std::filesystem::path& path, const SceneReadOptions& options,
+                SceneCleanupReport* report = nullptr) {
+    using namespace scene_detail;
+    constexpr size_t kMinChunkSize = 1 << 16;
+    const size_t memory_budget = options.memory_budget;
+    const std::optional<SceneCleanupOptions>& cleanup = options.cleanup;
+    TraceSpan span("parse scene", "scene");
+
+    std::error_code error;
+    if (size_t file_size = std::filesystem::file_size(path, error); !error) {
+        CheckMemoryBudget("Scene " + path.string(), file_size, memory_budget);
+    }
+    BackgroundFileReader reader(path);
+    const size_t file_size = reader.Size();
+    const size_t threads = options.threads > 0
+                               ? static_cast<size_t>(options.threads)
+                               : std::max<size_t>(1, std::thread::hardware_concurrency());
+    const size_t chunk_count =
+        cleanup.has_value() ? 1 : std::clamp<size_t>(file_size / kMinChunkSize, 1, threads);
+
+    std::vector<SceneChunk> chunks(chunk_count);
+    ForEachChunk(chunk_count, [&](size_t index) {
+        TraceSpan chunk_span("count scene chunk", "scene");
+        SceneChunk& chunk = chunks[index];
+        chunk.begin = reader.FindLineStart(file_size * index / chunk_count);
+        chunk.end = index + 1 == chunk_count
+                        ? reader.WaitFor(file_size)
+                        : reader.FindLineStart(file_size * (index + 1) / chunk_count);
+        chunk.end = std::max(chunk.begin, chunk.end);
+        std::vector<std::string_view> token_buffer;
+        SceneCounts& counts = chunk.counts;
+        auto count_line = [&](const std::vector<std::string_view>& tokens) {
+            if (tokens[0] == "v" && tokens.size() >= 4) {
+                ++counts.vertices;
+            } else if (tokens[0] == "vn" && tokens.size() >= 4) {
+                ++counts.normals;
+            } else if (tokens[0] == "f" && tokens.size() >= 4) {
+                counts.triangles += tokens.size() - 3;
+                counts.polygons +=
+                    tokens.size() >= 5 && tokens.size() <= Polygon::kMaxVertices + 1;
+            } else if (tokens[0] == "S" && tokens.size() >= 5) {
+                ++counts.spheres;
+            } else if (tokens[0] == "P" && tokens.size() >= 7) {
+                ++counts.lights;
+            } else if (tokens[0] == "mtllib" && tokens.size() >= 2) {
+                chunk.material_files.push_back(path.parent_path() / tokens[1]);
+                chunk.materials.push_back(std::async(std::launch::async, ReadMaterials,
+                                                     chunk.material_files.back()));
+            } else if (tokens[0] == "usemtl" && tokens.size() >= 2) {
+                chunk.last_material = tokens[1];
+            }
+        };
+        ForEachLine(reader.GetRange(chunk.begin, chunk.end), &token_buffer, count_line);
+        // with polygons both lists are reserved for the worst case, planarity is not known
+        if (!options.polygons) {
+            counts.polygons = 0;
+        }
+    });
+    const std::string_view text = reader.GetText();
+
+    SceneCounts counts;
+    for (SceneChunk& chunk : chunks) {
+        chunk.first_vertex = counts.vertices;
+        chunk.first_normal = counts.normals;
+        counts += chunk.counts;
+    }
+    const size_t arena_size = GetArenaSize(counts);
+    const size_t scratch_size =
+        ArenaBytes<Vector>(counts.vertices) + ArenaBytes<Vector>(counts.normals);
+    const size_t needed = text.size() + arena_size + scratch_size;
+    CheckMemoryBudget("Scene " + path.string(), needed, memory_budget);
+    // the faces of every chunk go into storage of their own that is copied over at the
+    // end, under a budget without room for that they are parsed one chunk after another
+    size_t chunk_arenas_size = 0;
+    for (const SceneChunk& chunk : chunks) {
+        chunk_arenas_size += GetArenaSize(chunk.counts);
+    }
+    const bool parallel_faces =
+        chunk_count > 1 && (memory_budget == 0 || needed + chunk_arenas_size <= memory_budget);
+
+    auto storage = std::make_shared<SceneStorage>(arena_size);
+    storage->objects.reserve(counts.triangles);
+    storage->sphere_objects.reserve(counts.spheres);
+    storage->polygon_objects.reserve(counts.polygons);
+    storage->lights.reserve(counts.lights);
+
+    std::unordered_map<std::string, uint32_t> material_indices;
+    for (SceneChunk& chunk : chunks) {
+        storage->material_files.insert(storage->material_files.end(),
+                                       chunk.material_files.begin(), chunk.material_files.end());
+        for (auto& materials : chunk.materials) {
+            for (auto& [name, material] : materials.get()) {
+                auto [it, inserted] = storage->materials.emplace(name, material);
+                if (inserted) {
+                    material_indices.emplace(name, storage->material_table.size());
+                    storage->material_table.push_back(&it->second);
+                }
+            }
+        }
+    }
+    auto get_material = [&](std::string_view name) {
+        uint32_t index = material_indices.at(std::string(name));
+        return MaterialHandle(storage->material_table[index], index);
+    };
+
+    // vertex data is only needed while parsing and is dropped in one go at the end
+    std::pmr::monotonic_buffer_resource scratch(scratch_size);
+    std::pmr::vector<Vector> vertices(counts.vertices, &scratch);
+    std::pmr::vector<Vector> normals(counts.normals, &scratch);
+
+    SceneCleanupReport unused_report;
+    std::optional<GeometryCleaner> cleaner;
+    if (cleanup.has_value()) {
+        cleaner.emplace(cleanup.value(), report != nullptr ? report : &unused_report);
+    }
+
+    auto chunk_text = [&](const SceneChunk& chunk) {
+        return text.substr(chunk.begin, chunk.end - chunk.begin);
+    };
+
+    ForEachChunk(chunk_count, [&](size_t index) {
+        TraceSpan chunk_span("parse scene vertices", "scene");
+        const SceneChunk& chunk = chunks[index];
+        size_t vertex = chunk.first_vertex;
+        size_t normal = chunk.first_normal;
+        std::vector<std::string_view> token_buffer;
+        ForEachLine(
+            chunk_text(chunk), &token_buffer,
+            [&](const std::vector<std::string_view>& tokens) {
+                if (tokens[0] == "v" && tokens.size() >= 4) {
+                    vertices[vertex++] = ParseVector(tokens, 1);
+                } else if (tokens[0] == "vn" && tokens.size() >= 4) {
+                    normals[normal++] = cleaner.has_value()
+                                            ? cleaner->AddNormal(ParseVector(tokens, 1))
+                                            : ParseVector(tokens, 1);
+                }
+            },
+            'v');
+    });
+    if (cleaner.has_value()) {
+        for (const Vector& vertex : vertices) {
+            cleaner->AddVertex(vertices, vertex);
+        }
+    }
+
+    auto parse_faces = [&](const SceneChunk& chunk, size_t index, SceneStorage* out) {
+        TraceSpan chunk_span("parse scene faces", "scene");
+        MaterialHandle cur_material;
+        for (size_t prev = index; prev-- > 0;) {
+            if (!chunks[prev].last_material.empty()) {
+                cur_material = get_material(chunks[prev].last_material);
+                break;
+            }
+        }
+        size_t vertex_count = chunk.first_vertex;
+        size_t normal_count = chunk.first_normal;
+        std::vector<std::string_view> token_buffer;
+        std::vector<Vector> vertices_temp;
+        std::vector<Vector> normals_temp;
+        std::vector<size_t> indices_temp;
+
+        auto parse_line = [&](const std::vector<std::string_view>& tokens) {
+            if (tokens[0] == "v" && tokens.size() >= 4) {
+                ++vertex_count;
+            } else if (tokens[0] == "vn" && tokens.size() >= 4) {
+                ++normal_count;
+            } else if (tokens[0] == "f" && tokens.size() >= 4) {
+                vertices_temp.clear();
+                normals_temp.clear();
+                indices_temp.clear();
+                bool has_normals = true;
+                for (size_t i = 1; i < tokens.size(); ++i) {
+                    int vertex_index = 0;
+                    std::optional<int> normal_index;
+                    if (!ParseFaceToken(tokens[i], &vertex_index, &normal_index)) {
+                        return;
                     }
-                } else {
-                    std::vector<Vector> vertices_temp;
-
-                    for (size_t i = 1; i < tokens.size(); ++i) {
-                        std::regex pattern("(-?\\d+)(/)?(-?\\d+)?(/)?(-?\\d+)?");
-                        std::smatch match;
-                        std::regex_match(tokens[i], match, pattern);
-                        int num1 = std::stoi(match[1]);
-                        vertices_temp.push_back(num1 > 0 ? *(vertices.begin() + num1 - 1)
-                                                         : *(vertices.end() + num1));
+                    size_t vertex = ResolveIndex(vertex_index, vertex_count);
+                    if (cleaner.has_value()) {
+                        vertex = cleaner->GetWelded(vertex);
+                        indices_temp.push_back(vertex);
                     }
+                    vertices_temp.push_back(vertices[vertex]);
+                    if (normal_index.has_value() && has_normals) {
+                        normals_temp.push_back(normals[ResolveIndex(*normal_index, normal_count)]);
+                    } else {
+                        has_normals = false;
+                    }
+                }
 
-                    for (size_t i = 0; i < tokens.size() - 3; ++i) {
-                        objects.push_back(Object{
-                            cur_material,
-                            Triangle(vertices_temp[0], vertices_temp[i + 1], vertices_temp[i + 2]),
-                            std::nullopt});
+                if (options.polygons && vertices_temp.size() > 3 &&
+                    IsConvexPlanar(vertices_temp)) {
+                    if (!cleaner.has_value() || cleaner->KeepPolygon(indices_temp)) {
+                        std::optional<std::array<Vector, Polygon::kMaxVertices>> polygon_normals;
+                        if (has_normals) {
+                            polygon_normals.emplace();
+                            std::copy(normals_temp.begin(), normals_temp.end(),
+                                      polygon_normals->begin());
+                        }
+                        out->polygon_objects.push_back(
+                            PolygonObject{cur_material, Polygon(vertices_temp), polygon_normals});
+                    }
+                    return;
+                }
+                for (size_t i = 0; i < tokens.size() - 3; ++i) {
+                    if (cleaner.has_value() &&
+                        !cleaner->KeepTriangle({indices_temp[0], indices_temp[i + 1],
+                                                indices_temp[i + 2]},
+                                               Triangle(vertices_temp[0], vertices_temp[i + 1],
+                                                        vertices_temp[i + 2]))) {
+                        continue;
+                    }
+                    std::optional<Triangle> face_normals;
+                    if (has_normals) {
+                        face_normals.emplace(normals_temp[0], normals_temp[i + 1],
+                                             normals_temp[i + 2]);
                     }
+                    out->objects.push_back(Object{
+                        cur_material,
+                        Triangle(vertices_temp[0], vertices_temp[i + 1], vertices_temp[i + 2]),
+                        face_normals});
                 }
+            } else if (tokens[0] == "P" && tokens.size() >= 7) {
+                out->lights.push_back(Light{ParseVector(tokens, 1), ParseVector(tokens, 4)});
+            } else if (tokens[0] == "S" && tokens.size() >= 5) {
+                out->sphere_objects.push_back(SphereObject{
+                    cur_material, Sphere(ParseVector(tokens, 1), ParseDouble(tokens[4]))});
+            } else if (tokens[0] == "usemtl" && tokens.size() >= 2) {
+                cur_material = get_material(tokens[1]);
             }
-        } else if (tokens[0] == "P" && tokens.size() >= 7) {
-            Vector position;
-            Vector intensity;
-            lights.push_back(
-                Light{Vector(std::stod(tokens[1]), std::stod(tokens[2]), std::stod(tokens[3])),
-                      Vector(std::stod(tokens[4]), std::stod(tokens[5]), std::stod(tokens[6]))});
-        } else if (tokens[0] == "S" && tokens.size() >= 5) {
-            sphere_objects.push_back(SphereObject{
-                cur_material,
-                Sphere(Vector(std::stod(tokens[1]), std::stod(tokens[2]), std::stod(tokens[3])),
-                       std::stod(tokens[4]))});
-        } else if (tokens[0] == "mtllib" && tokens.size() >= 2) {
-            std::string mtl_file_name = tokens[1];
-            std::filesystem::path mtl_path = path.parent_path() / mtl_file_name;
-            std::unordered_map<std::string, Material> cur_materials = ReadMaterials(mtl_path);
-            materials.insert(cur_materials.begin(), cur_materials.end());
-        } else if (tokens[0] == "usemtl" && tokens.size() >= 2) {
-            cur_material = &materials.at(tokens[1]);
-        }
-    }
-    obj_file.close();
-
-    return Scene(objects, sphere_objects, lights, materials);
-}
\ No newline at end of file
+        };
+        ForEachLine(chunk_text(chunk), &token_buffer, parse_line);
+    };
+
+    if (!parallel_faces) {
+        for (size_t index = 0; index < chunk_count; ++index) {
+            parse_faces(chunks[index], index, storage.get());
+        }
+        return Scene(std::move(storage));
+    }
+
+    std::vector<std::unique_ptr<SceneStorage>> chunk_storages(chunk_count);
+    ForEachChunk(chunk_count, [&](size_t index) {
+        const SceneCounts& chunk_counts = chunks[index].counts;
+        chunk_storages[index] = std::make_unique<SceneStorage>(GetArenaSize(chunk_counts));
+        SceneStorage& chunk_storage = *chunk_storages[index];
+        chunk_storage.objects.reserve(chunk_counts.triangles);
+        chunk_storage.sphere_objects.reserve(chunk_counts.spheres);
+        chunk_storage.polygon_objects.reserve(chunk_counts.polygons);
+        chunk_storage.lights.reserve(chunk_counts.lights);
+        parse_faces(chunks[index], index, &chunk_storage);
+    });
+    for (std::unique_ptr<SceneStorage>& chunk_storage : chunk_storages) {
+        for (const Object& object : chunk_storage->objects) {
+            storage->objects.push_back(object);
+        }
+        for (const SphereObject& sphere : chunk_storage->sphere_objects) {
+            storage->sphere_objects.push_back(sphere);
+        }
+        for (const PolygonObject& polygon : chunk_storage->polygon_objects) {
+            storage->polygon_objects.push_back(polygon);
+        }
+        for (const Light& light : chunk_storage->lights) {
+            storage->lights.push_back(light);
+        }
+        chunk_storage.reset();
+    }
+    return Scene(std::move(storage));
+}
+
+Scene ReadScene(const std::filesystem::path& path, size_t memory_budget = 0,
+                const std::optional<SceneCleanupOptions>& cleanup = std::nullopt,
+                SceneCleanupReport* report = nullptr) {
+    return ReadScene(path, {.memory_budget = memory_budget, .cleanup = cleanup}, report);
+}
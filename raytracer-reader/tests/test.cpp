@@ -1,6 +1,14 @@
 #include <scene.h>
+#include <clustered_scene.h>
+#include <lod_scene.h>
 #include <util.h>
 
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <numbers>
+#include <sstream>
+
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_floating_point.hpp>
 
@@ -136,3 +144,370 @@ TEST_CASE("Scene") {
     Check(back_wall.albedo, .5, 0., 0.);
     Check(back_wall.diffuse_color, .725, .91, .88);
 }
+
+TEST_CASE("Clustered scene") {
+    const auto current_dir = GetFileDir(__FILE__);
+    const auto cluster_path = std::filesystem::temp_directory_path() / "raytracer_reader_box.clusters";
+    BuildClusteredScene(current_dir / "box/cube.obj", cluster_path, {.triangles_per_cluster = 2});
+    const ClusteredScene scene(cluster_path);
+
+    REQUIRE(scene.GetMaterials().size() == 9);
+    REQUIRE(scene.GetSphereObjects().size() == 2);
+    CHECK(scene.GetSphereObjects()[1].material->name == "rightSphere");
+    REQUIRE(scene.GetLights().size() == 2);
+    Check(scene.GetLights()[1].position, 0., .7, 1.98);
+
+    REQUIRE(scene.GetClusters().size() > 1);
+    size_t triangles = 0;
+    for (const auto& cluster : scene.GetClusters()) {
+        for (const auto& triangle : scene.GetTriangles(cluster)) {
+            for (const auto& vertex : triangle.vertices) {
+                CHECK(vertex[0] >= cluster.box.min[0]);
+                CHECK(vertex[2] <= cluster.box.max[2]);
+            }
+            auto object = scene.GetObject(triangle);
+            REQUIRE(object.material != nullptr);
+            REQUIRE(object.normals.has_value());
+            if (object.material->name == "floor") {
+                Check(*object.GetNormal(0), 0., 1., 0.);
+            }
+            ++triangles;
+        }
+    }
+    CHECK(triangles == 10);
+    std::filesystem::remove(cluster_path);
+}
+
+TEST_CASE("Clustered scene rebuilds a broken file") {
+    const auto current_dir = GetFileDir(__FILE__);
+    const auto dir = std::filesystem::temp_directory_path() / "raytracer_reader_broken_clusters";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    const auto cluster_path = dir / "box.clusters";
+
+    // newer than the .obj but cut off, as an interrupted build of the old format would leave it
+    BuildClusteredScene(current_dir / "box/cube.obj", cluster_path);
+    std::filesystem::resize_file(cluster_path, std::filesystem::file_size(cluster_path) / 2);
+    CHECK_THROWS_AS(ClusteredScene(cluster_path), std::runtime_error);
+
+    const ClusteredScene scene = ReadClusteredScene(current_dir / "box/cube.obj", cluster_path);
+    CHECK(scene.GetSphereObjects().size() == 2);
+    CHECK(std::distance(std::filesystem::directory_iterator(dir),
+                        std::filesystem::directory_iterator()) == 1);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Clustered scene rebuilds a stale file") {
+    const auto current_dir = GetFileDir(__FILE__);
+    const auto dir = std::filesystem::temp_directory_path() / "raytracer_reader_stale_clusters";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    std::filesystem::copy(current_dir / "box", dir);
+    const auto obj_path = dir / "cube.obj";
+    const auto mtl_path = dir / "CornellBox-Sphere.mtl";
+    const auto cluster_path = dir / "box.clusters";
+
+    auto floor_color = [](const ClusteredScene& scene) {
+        return std::find_if(scene.GetMaterials().begin(), scene.GetMaterials().end(),
+                            [](const Material& material) { return material.name == "floor"; })
+            ->diffuse_color;
+    };
+
+    ReadClusteredScene(obj_path, cluster_path);
+    const auto built = std::filesystem::last_write_time(cluster_path);
+    CHECK(ReadClusteredScene(obj_path, cluster_path).GetClusters().size() == 1);
+    CHECK(std::filesystem::last_write_time(cluster_path) == built);
+
+    CHECK(ReadClusteredScene(obj_path, cluster_path, {.triangles_per_cluster = 2})
+              .GetClusters()
+              .size() > 1);
+    CHECK(ReadClusteredScene(obj_path, cluster_path).GetClusters().size() == 1);
+
+    std::stringstream mtl;
+    mtl << std::ifstream(mtl_path).rdbuf();
+    std::string text = mtl.str();
+    text.replace(text.find("Kd 0.7250 0.9100 0.8800"), 23, "Kd 0.1000 0.2000 0.3000");
+    const auto mtl_time = std::filesystem::last_write_time(mtl_path);
+    std::ofstream(mtl_path) << text;
+    std::filesystem::last_write_time(mtl_path, mtl_time + std::chrono::seconds(1));
+    Check(floor_color(ReadClusteredScene(obj_path, cluster_path)), .1, .2, .3);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Scene copies share materials") {
+    const auto current_dir = GetFileDir(__FILE__);
+    auto original = std::make_unique<Scene>(ReadScene(current_dir / "box/cube.obj"));
+    const Scene copy = *original;
+    const Scene moved = std::move(*original);
+    original.reset();
+
+    const auto& floor = copy.GetObjects()[0].material;
+    REQUIRE(floor != nullptr);
+    CHECK(floor->name == "floor");
+    CHECK(copy.GetMaterial(floor.Index()).Get() == floor.Get());
+    CHECK(moved.GetObjects()[0].material.Get() == floor.Get());
+    CHECK(moved.GetSphereObjects()[1].material->name == "rightSphere");
+    CHECK(&moved.GetMaterials().at("floor") == floor.Get());
+}
+
+TEST_CASE("Scene footprint") {
+    const auto current_dir = GetFileDir(__FILE__);
+    const auto path = current_dir / "box/cube.obj";
+    Scene scene = ReadScene(path);
+    SceneFootprint footprint = GetFootprint(scene);
+    CHECK(footprint.objects + footprint.normals == scene.GetObjects().size() * sizeof(Object));
+    CHECK(footprint.normals > 0);
+    CHECK(footprint.spheres == scene.GetSphereObjects().size() * sizeof(SphereObject));
+    CHECK(footprint.lights == scene.GetLights().size() * sizeof(Light));
+    CHECK(footprint.materials >= scene.GetMaterials().size() * sizeof(Material));
+    CHECK(footprint.Total() > footprint.objects);
+
+    CHECK_THROWS_AS(ReadScene(path, 100), MemoryBudgetExceeded);
+    const size_t file_size = std::filesystem::file_size(path);
+    try {
+        ReadScene(path, file_size + 1);
+        FAIL("the geometry does not fit");
+    } catch (const MemoryBudgetExceeded& e) {
+        CHECK(e.Needed() > file_size);
+        CHECK(e.Budget() == file_size + 1);
+    }
+    CHECK(ReadScene(path, 1 << 20).GetObjects().size() == scene.GetObjects().size());
+}
+
+TEST_CASE("Levels of detail") {
+    // a smooth unit sphere, 32 slices by 16 stacks
+    const auto path = std::filesystem::temp_directory_path() / "raytracer_reader_lod.obj";
+    {
+        std::ofstream obj(path);
+        const int slices = 32;
+        const int stacks = 16;
+        for (int i = 0; i <= stacks; ++i) {
+            for (int j = 0; j < slices; ++j) {
+                double theta = std::numbers::pi * i / stacks;
+                double phi = 2 * std::numbers::pi * j / slices;
+                double x = std::sin(theta) * std::cos(phi);
+                double y = std::cos(theta);
+                double z = std::sin(theta) * std::sin(phi);
+                obj << "v " << x << " " << y << " " << z << "\nvn " << x << " " << y << " " << z
+                    << "\n";
+            }
+        }
+        for (int i = 0; i < stacks; ++i) {
+            for (int j = 0; j < slices; ++j) {
+                int a = i * slices + j + 1;
+                int b = i * slices + (j + 1) % slices + 1;
+                obj << "f " << a << "//" << a << " " << a + slices << "//" << a + slices << " "
+                    << b + slices << "//" << b + slices << " " << b << "//" << b << "\n";
+            }
+        }
+    }
+    const Scene scene = ReadScene(path);
+    std::filesystem::remove(path);
+    const size_t triangles = scene.GetObjects().size();
+
+    LodScene lod(scene);
+    REQUIRE(lod.GetMeshes().size() == 1);
+    const auto& levels = lod.GetMeshes()[0].levels;
+    REQUIRE(levels.size() > 3);
+    CHECK(levels[0].triangles == triangles);
+    CHECK(levels[0].error == 0.);
+    for (size_t i = 1; i < levels.size(); ++i) {
+        CHECK(levels[i].triangles <= levels[i - 1].triangles / 2 + 1);
+        CHECK(levels[i].error >= levels[i - 1].error);
+    }
+    const LodLevel& coarse = levels.back();
+    for (const auto& chunk : lod.GetChunks().subspan(coarse.first_chunk, coarse.chunk_count)) {
+        for (const Object& object : lod.GetObjects().subspan(chunk.first, chunk.count)) {
+            REQUIRE(object.normals.has_value());
+            for (size_t k = 0; k < 3; ++k) {
+                CHECK_THAT(Length(object.polygon[k]), Catch::Matchers::WithinAbs(1., .5));
+                CHECK_THAT(Length(*object.GetNormal(k)), Catch::Matchers::WithinAbs(1., 1e-9));
+            }
+        }
+    }
+
+    // full detail until asked otherwise, then coarser with distance
+    CHECK(lod.GetSelectedTriangles() == triangles);
+    LodView view{.eye = Vector(0., 0., 10.), .pixel_angle = 1e-3};
+    lod.SetView(view);
+    CHECK(lod.GetSelectedTriangles() == triangles);
+    view.eye = Vector(0., 0., 1e4);
+    lod.SetView(view);
+    const size_t far = lod.GetSelectedTriangles();
+    CHECK(far < triangles);
+    view.tolerance = 10;
+    lod.SetView(view);
+    CHECK(lod.GetSelectedTriangles() < far);
+    view.full_detail = true;
+    lod.SetView(view);
+    CHECK(lod.GetSelectedTriangles() == triangles);
+}
+
+TEST_CASE("Geometry cleanup") {
+    const auto path = std::filesystem::temp_directory_path() / "raytracer_reader_cleanup.obj";
+    {
+        std::ofstream obj(path);
+        // a unit quad, then copies of two corners, the second one only nearly equal
+        obj << "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nv 1 0 0\nv 1 1 1e-12\nv 2 0 0\n"
+            << "vn 0 0 2\nvn 0 0 1\n"
+            << "f 1//1 2//1 3//2\nf 1 3 4\n"
+            // the first triangle again over the copies, rotated, and the second one reversed
+            << "f 6 1 5\nf 1 4 3\n"
+            // a repeated vertex after welding, a collinear triangle and a fan starting with one
+            << "f 1 2 5\nf 1 2 7\nf 1 2 7 3\n";
+    }
+    const Scene raw = ReadScene(path);
+    SceneCleanupReport report;
+    const Scene scene = ReadScene(path, 0, SceneCleanupOptions{}, &report);
+    SceneCleanupReport exact;
+    const Scene exact_scene = ReadScene(path, 0, SceneCleanupOptions{.weld_tolerance = 0}, &exact);
+    std::filesystem::remove(path);
+
+    CHECK(raw.GetObjects().size() == 8);
+    CHECK(report.welded_vertices == 2);
+    CHECK(report.degenerate_triangles == 3);
+    CHECK(report.duplicate_triangles == 2);
+    CHECK(report.normalized_normals == 1);
+    CHECK(report.RemovedTriangles() == 5);
+    REQUIRE(scene.GetObjects().size() == 3);
+    Check(*scene.GetObjects()[0].GetNormal(0), 0, 0, 1);
+    Check(scene.GetObjects()[2].polygon[1], 2, 0, 0);
+    Check(scene.GetObjects()[2].polygon[2], 1, 1, 0);
+
+    // only identical positions are merged without a tolerance
+    CHECK(exact.welded_vertices == 1);
+    CHECK(exact.duplicate_triangles == 1);
+    CHECK(exact_scene.GetObjects().size() == 4);
+}
+
+TEST_CASE("Polygon faces") {
+    const auto path = std::filesystem::temp_directory_path() / "raytracer_reader_polygons.obj";
+    {
+        std::ofstream obj(path);
+        obj << "v 0 0 0\nv 2 0 0\nv 2 2 0\nv 0 2 0\nv 1 1 1\nv 1 .5 0\nv 3 1 0\nv 1 3 0\n"
+            << "v 1 -.5 0\n"
+            << "vn 0 0 1\nvn 1 0 1\n"
+            // a square with normals, a bent quad, a concave one and a hexagon
+            << "f 1//1 2//2 3//1 4//2\nf 1 2 5 4\nf 1 2 6 4\nf 1 9 2 7 3 4\n"
+            // too many corners for a polygon
+            << "f 1 6 2 7 3 8 4\n";
+    }
+    const Scene triangles = ReadScene(path);
+    const Scene scene = ReadScene(path, {.polygons = true});
+    std::filesystem::remove(path);
+
+    CHECK(triangles.GetPolygonObjects().empty());
+    REQUIRE(scene.GetPolygonObjects().size() == 2);
+    CHECK(scene.GetObjects().size() == 2 + 2 + 5);
+    const PolygonObject& square = scene.GetPolygonObjects()[0];
+    CHECK(square.polygon.Size() == 4);
+    REQUIRE(square.GetNormals().size() == 4);
+    Check(square.GetNormals()[1], 1, 0, 1);
+    CHECK(scene.GetPolygonObjects()[1].polygon.Size() == 6);
+    CHECK(scene.GetPolygonObjects()[1].GetNormals().empty());
+
+    // the fan of a polygon is what the reader emits without polygons
+    std::vector<Object> fan = Triangulate(square);
+    REQUIRE(fan.size() == 2);
+    for (size_t i = 0; i < fan.size(); ++i) {
+        for (size_t k = 0; k < 3; ++k) {
+            const Object& expected = triangles.GetObjects()[i];
+            Check(fan[i].polygon[k], expected.polygon[k][0], expected.polygon[k][1],
+                  expected.polygon[k][2]);
+            Check(*fan[i].GetNormal(k), (*expected.GetNormal(k))[0], (*expected.GetNormal(k))[1],
+                  (*expected.GetNormal(k))[2]);
+        }
+    }
+    CHECK(GetFootprint(scene).polygons == 2 * sizeof(PolygonObject));
+}
+
+TEST_CASE("Pipelined load") {
+    const auto dir = std::filesystem::temp_directory_path();
+    const auto path = dir / "raytracer_reader_pipelined.obj";
+    {
+        std::ofstream mtl(dir / "raytracer_reader_pipelined.mtl");
+        for (int i = 0; i < 3; ++i) {
+            mtl << "newmtl m" << i << "\nKd " << i << " 0.5 0.5\n";
+        }
+        // a height field of quads with normals, the ones next to every third row are bent
+        constexpr int kSize = 120;
+        std::ofstream obj(path);
+        obj << "mtllib raytracer_reader_pipelined.mtl\n";
+        for (int y = 0; y < kSize; ++y) {
+            for (int x = 0; x < kSize; ++x) {
+                obj << "v " << x << ' ' << y << ' ' << (y % 3 == 0 ? x % 2 : 0) << "\n";
+                obj << "vn 0 " << 0.01 * x << " 1\n";
+            }
+            if (y == 0) {
+                continue;
+            }
+            obj << "usemtl m" << y % 3 << "\n";
+            for (int x = 0; x + 1 < kSize; ++x) {
+                int a = (y - 1) * kSize + x + 1;
+                if (x % 2 == 0) {
+                    obj << "f " << a << "//" << a << ' ' << a + 1 << "//" << a + 1 << ' '
+                        << a + kSize + 1 << "//" << a + kSize + 1 << ' ' << a + kSize << "//"
+                        << a + kSize << "\n";
+                } else {
+                    // relative to the last vertex read so far
+                    int last = (y + 1) * kSize;
+                    obj << "f " << a - last - 1 << ' ' << a - last << ' ' << a + kSize - last
+                        << ' ' << a + kSize - last - 1 << "\n";
+                }
+            }
+            obj << "S " << y << " 0 -5 0.5\nP 0 " << y << " 10 1 1 1\n";
+        }
+    }
+
+    auto check_same = [](const Scene& expected, const Scene& scene) {
+        REQUIRE(scene.GetObjects().size() == expected.GetObjects().size());
+        REQUIRE(scene.GetPolygonObjects().size() == expected.GetPolygonObjects().size());
+        REQUIRE(scene.GetSphereObjects().size() == expected.GetSphereObjects().size());
+        REQUIRE(scene.GetLights().size() == expected.GetLights().size());
+        bool same = true;
+        for (size_t i = 0; i < scene.GetObjects().size(); ++i) {
+            const Object& a = expected.GetObjects()[i];
+            const Object& b = scene.GetObjects()[i];
+            same = same && a.material->name == b.material->name &&
+                   a.normals.has_value() == b.normals.has_value();
+            for (size_t k = 0; k < 3; ++k) {
+                same = same && Length(a.polygon[k] - b.polygon[k]) == 0;
+            }
+        }
+        for (size_t i = 0; i < scene.GetPolygonObjects().size(); ++i) {
+            const PolygonObject& a = expected.GetPolygonObjects()[i];
+            const PolygonObject& b = scene.GetPolygonObjects()[i];
+            same = same && a.material->name == b.material->name &&
+                   a.GetNormals().size() == b.GetNormals().size();
+            for (size_t k = 0; k < a.GetNormals().size(); ++k) {
+                same = same && Length(a.GetNormals()[k] - b.GetNormals()[k]) == 0;
+            }
+        }
+        for (size_t i = 0; i < scene.GetSphereObjects().size(); ++i) {
+            same = same && scene.GetSphereObjects()[i].material->name ==
+                               expected.GetSphereObjects()[i].material->name;
+        }
+        CHECK(same);
+    };
+
+    const Scene expected = ReadScene(path, {.polygons = true});
+    CHECK(!expected.GetPolygonObjects().empty());
+    CHECK(!expected.GetObjects().empty());
+    CHECK(expected.GetMaterials().size() == 3);
+    check_same(expected, ReadScene(path, {.polygons = true, .threads = 4}));
+    check_same(ReadScene(path), ReadScene(path, {.threads = 3}));
+
+    // without room for the per-chunk copies the chunks are parsed one after another
+    const size_t file_size = std::filesystem::file_size(path);
+    size_t needed = 0;
+    try {
+        ReadScene(path, {.memory_budget = file_size, .polygons = true, .threads = 4});
+    } catch (const MemoryBudgetExceeded& e) {
+        needed = e.Needed();
+    }
+    REQUIRE(needed > file_size);
+    check_same(expected,
+               ReadScene(path, {.memory_budget = needed, .polygons = true, .threads = 4}));
+    std::filesystem::remove(path);
+    std::filesystem::remove(dir / "raytracer_reader_pipelined.mtl");
+}
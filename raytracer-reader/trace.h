@@ -0,0 +1,255 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Opt-in timeline of the render pipeline in the Chrome trace event format, viewable in
+// chrome://tracing or ui.perfetto.dev. Spans are written to per-thread buffers, so
+// recording takes no shared lock; while tracing is off a TraceSpan costs one relaxed
+// load and one branch.
+
+struct TraceEvent {
+    const char* name;
+    const char* category;
+    int64_t start_us;
+    int64_t duration_us;
+    std::array<std::pair<const char*, int64_t>, 3> args;
+    int arg_count = 0;
+};
+
+namespace trace_detail {
+
+std::atomic<bool> enabled = false;
+
+struct ThreadBuffer {
+    uint32_t tid;
+    std::string name;
+    std::mutex mutex;
+    std::vector<TraceEvent> events;
+    // set under the registry mutex once the thread exits
+    bool finished = false;
+};
+
+int64_t SteadyUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<ThreadBuffer>> threads;
+    uint32_t next_tid = 1;
+    // read by every span without the mutex
+    std::atomic<int64_t> epoch_us = SteadyUs();
+};
+
+Registry& GetRegistry() {
+    static Registry registry;
+    return registry;
+}
+
+// Buffers outlive their threads, the trace of a finished render is still complete. An
+// exited thread's buffer is handed to the next new thread once it holds no events and is
+// dropped by StartTracing, so a long-running process keeps one buffer per live thread.
+class ThreadBufferOwner {
+public:
+    ThreadBufferOwner() {
+        Registry& registry = GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        for (auto& thread : registry.threads) {
+            std::lock_guard thread_lock(thread->mutex);
+            if (thread->finished && thread->events.empty()) {
+                thread->finished = false;
+                thread->name.clear();
+                buffer_ = thread.get();
+                return;
+            }
+        }
+        auto& created = registry.threads.emplace_back(std::make_unique<ThreadBuffer>());
+        created->tid = registry.next_tid++;
+        buffer_ = created.get();
+    }
+
+    ThreadBufferOwner(const ThreadBufferOwner&) = delete;
+    ThreadBufferOwner& operator=(const ThreadBufferOwner&) = delete;
+
+    ~ThreadBufferOwner() {
+        Registry& registry = GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        buffer_->finished = true;
+    }
+
+    ThreadBuffer& Get() {
+        return *buffer_;
+    }
+
+private:
+    ThreadBuffer* buffer_;
+};
+
+ThreadBuffer& GetThreadBuffer() {
+    thread_local ThreadBufferOwner owner;
+    return owner.Get();
+}
+
+void AppendEscaped(std::string* out, const std::string& text) {
+    for (char c : text) {
+        if (c == '"' || c == '\\') {
+            out->push_back('\\');
+        }
+        if (static_cast<unsigned char>(c) >= 0x20) {
+            out->push_back(c);
+        }
+    }
+}
+
+}  // namespace trace_detail
+
+bool IsTracing() {
+    return trace_detail::enabled.load(std::memory_order_relaxed);
+}
+
+// Drops previously recorded spans and starts recording.
+void StartTracing() {
+    trace_detail::Registry& registry = trace_detail::GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    std::erase_if(registry.threads, [](const auto& thread) { return thread->finished; });
+    for (auto& thread : registry.threads) {
+        std::lock_guard thread_lock(thread->mutex);
+        thread->events.clear();
+    }
+    registry.epoch_us.store(trace_detail::SteadyUs(), std::memory_order_relaxed);
+    trace_detail::enabled.store(true, std::memory_order_release);
+}
+
+void StopTracing() {
+    trace_detail::enabled.store(false, std::memory_order_release);
+}
+
+// Label shown for the calling thread in the trace viewer.
+void SetTraceThreadName(std::string name) {
+    if (IsTracing()) {
+        trace_detail::ThreadBuffer& buffer = trace_detail::GetThreadBuffer();
+        std::lock_guard lock(buffer.mutex);
+        buffer.name = std::move(name);
+    }
+}
+
+// Records the time between construction and destruction. Name, category and argument
+// keys must be string literals or otherwise outlive the trace.
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name, const char* category = "render") {
+        if (IsTracing()) [[unlikely]] {
+            event_.name = name;
+            event_.category = category;
+            // the duration does not depend on the epoch, a restart mid-span cannot skew it
+            started_us_ = trace_detail::SteadyUs();
+            event_.start_us = started_us_ - trace_detail::GetRegistry().epoch_us.load(
+                                                std::memory_order_relaxed);
+            active_ = true;
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    // at most three arguments are kept, the rest are ignored
+    void AddArg(const char* key, int64_t value) {
+        if (active_ && event_.arg_count < static_cast<int>(event_.args.size())) {
+            event_.args[event_.arg_count++] = {key, value};
+        }
+    }
+
+    ~TraceSpan() {
+        if (active_) [[unlikely]] {
+            event_.duration_us = trace_detail::SteadyUs() - started_us_;
+            trace_detail::ThreadBuffer& buffer = trace_detail::GetThreadBuffer();
+            std::lock_guard lock(buffer.mutex);
+            buffer.events.push_back(event_);
+        }
+    }
+
+private:
+    bool active_ = false;
+    int64_t started_us_ = 0;
+    TraceEvent event_;
+};
+
+size_t GetTraceEventCount() {
+    trace_detail::Registry& registry = trace_detail::GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    size_t count = 0;
+    for (auto& thread : registry.threads) {
+        std::lock_guard thread_lock(thread->mutex);
+        count += thread->events.size();
+    }
+    return count;
+}
+
+// Complete ("X") events with thread name metadata; ts and dur are in microseconds.
+std::string ChromeTraceJson() {
+    trace_detail::Registry& registry = trace_detail::GetRegistry();
+    std::lock_guard lock(registry.mutex);
+    std::string out = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    auto separate = [&] {
+        if (!first) {
+            out += ",\n";
+        }
+        first = false;
+    };
+    for (auto& thread : registry.threads) {
+        std::lock_guard thread_lock(thread->mutex);
+        if (thread->events.empty()) {
+            continue;
+        }
+        separate();
+        out += "{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":" +
+               std::to_string(thread->tid) + ",\"args\":{\"name\":\"";
+        trace_detail::AppendEscaped(
+            &out, thread->name.empty() ? "thread " + std::to_string(thread->tid) : thread->name);
+        out += "\"}}";
+        for (const TraceEvent& event : thread->events) {
+            separate();
+            out += "{\"ph\":\"X\",\"name\":\"";
+            trace_detail::AppendEscaped(&out, event.name);
+            out += "\",\"cat\":\"";
+            trace_detail::AppendEscaped(&out, event.category);
+            out += "\",\"pid\":1,\"tid\":" + std::to_string(thread->tid) +
+                   ",\"ts\":" + std::to_string(event.start_us) +
+                   ",\"dur\":" + std::to_string(event.duration_us);
+            if (event.arg_count > 0) {
+                out += ",\"args\":{";
+                for (int i = 0; i < event.arg_count; ++i) {
+                    out += i == 0 ? "\"" : ",\"";
+                    trace_detail::AppendEscaped(&out, event.args[i].first);
+                    out += "\":" + std::to_string(event.args[i].second);
+                }
+                out += "}";
+            }
+            out += "}";
+        }
+    }
+    out += "]}\n";
+    return out;
+}
+
+void WriteChromeTrace(const std::filesystem::path& path) {
+    std::ofstream file(path, std::ios::binary);
+    file << ChromeTraceJson();
+    if (!file) {
+        throw std::runtime_error("Can't write trace " + path.string());
+    }
+}
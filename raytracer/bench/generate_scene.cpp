@@ -0,0 +1,60 @@
+#include <bench/scene_generator.h>
+
+#include <iostream>
+#include <string>
+
+// Writes a synthetic scene and its material library.
+//
+// usage: generate_scene <out.obj> [--triangles N] [--spheres N] [--lights N] [--materials N]
+//                       [--distribution uniform|clustered] [--clusters N] [--normals]
+//                       [--seed N]
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <out.obj> [options]\n";
+        return 2;
+    }
+    std::filesystem::path path = argv[1];
+    GeneratorOptions options;
+    try {
+        for (int i = 2; i < argc; ++i) {
+            std::string flag = argv[i];
+            if (flag == "--normals") {
+                options.normals = true;
+                continue;
+            }
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("Missing value for " + flag);
+            }
+            std::string value = argv[++i];
+            if (flag == "--triangles") {
+                options.triangles = std::stoull(value);
+            } else if (flag == "--spheres") {
+                options.spheres = std::stoull(value);
+            } else if (flag == "--lights") {
+                options.lights = std::stoull(value);
+            } else if (flag == "--materials") {
+                options.materials = std::stoull(value);
+            } else if (flag == "--distribution") {
+                if (value == "uniform") {
+                    options.distribution = SceneDistribution::kUniform;
+                } else if (value == "clustered") {
+                    options.distribution = SceneDistribution::kClustered;
+                } else {
+                    throw std::invalid_argument("Unknown distribution " + value);
+                }
+            } else if (flag == "--clusters") {
+                options.clusters = std::stoull(value);
+            } else if (flag == "--seed") {
+                options.seed = std::stoull(value);
+            } else {
+                throw std::invalid_argument("Unknown flag " + flag);
+            }
+        }
+        GenerateScene(path, options);
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+}
@@ -0,0 +1,147 @@
+#include <bench/scene_generator.h>
+#include <raytracer.h>
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+// Generates scenes of 1k, 10k, ... triangles, then of as many spheres, and measures how
+// parsing, memory, hierarchy construction and rendering grow with the size. The last
+// columns are the exponents k of time ~ size^k between neighbouring rows, 1 is linear.
+//
+// usage: scaling_bench <work dir> [--max TRIANGLES] [--max-spheres SPHERES]
+//                      [--size WIDTHxHEIGHT] [--threads N] [--distribution uniform|clustered]
+// Both sweeps go up to 10M by default, a 0 maximum skips the sweep. The 10M triangle
+// scene is a ~1 GB .obj and needs a few GB of memory while it is parsed.
+// Scenes are rendered through the DynamicScene hierarchy with depth 1, a plain Scene
+// tests every primitive per ray and does not finish at the larger sizes.
+
+namespace {
+
+struct Row {
+    size_t primitives = 0;
+    double file_mb = 0;
+    double parse_s = 0;
+    size_t scene_bytes = 0;
+    double build_s = 0;
+    double render_s = 0;
+};
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+double Exponent(double previous, double current, double ratio) {
+    if (previous <= 0 || current <= 0) {
+        return 0;
+    }
+    return std::log(current / previous) / std::log(ratio);
+}
+
+// generates scenes with 1k, 10k, ... up to max of the primitive count selects
+void Sweep(const std::filesystem::path& dir, GeneratorOptions generator,
+           size_t GeneratorOptions::*count, size_t max, const CameraOptions& camera,
+           const RenderOptions& render_options, const char* name) {
+    std::printf("%10s %9s %9s %9s %12s %9s %9s %7s %7s %7s\n", name, "file MB", "parse s",
+                "MB/s", "scene bytes", "build s", "render s", "k parse", "k build",
+                "k render");
+    std::vector<Row> rows;
+    for (size_t primitives = 1000; primitives <= max; primitives *= 10) {
+        generator.*count = primitives;
+        generator.materials = std::max<size_t>(1, primitives / 1000);
+        std::filesystem::path path =
+            dir / ("scene_" + std::string(name) + "_" + std::to_string(primitives) + ".obj");
+        GenerateScene(path, generator);
+
+        Row row{.primitives = primitives, .file_mb = std::filesystem::file_size(path) / 1e6};
+        auto start = std::chrono::steady_clock::now();
+        std::optional<DynamicScene> dynamic;
+        {
+            Scene scene = ReadScene(path);
+            row.parse_s = SecondsSince(start);
+            row.scene_bytes = GetFootprint(scene).Total();
+            start = std::chrono::steady_clock::now();
+            dynamic.emplace(scene);
+            row.build_s = SecondsSince(start);
+        }
+        start = std::chrono::steady_clock::now();
+        RenderScene(*dynamic, camera, render_options);
+        row.render_s = SecondsSince(start);
+
+        std::printf("%10zu %9.2f %9.3f %9.1f %12zu %9.3f %9.3f", row.primitives, row.file_mb,
+                    row.parse_s, row.file_mb / row.parse_s, row.scene_bytes, row.build_s,
+                    row.render_s);
+        if (!rows.empty()) {
+            const Row& previous = rows.back();
+            double ratio = static_cast<double>(row.primitives) / previous.primitives;
+            std::printf(" %7.2f %7.2f %7.2f", Exponent(previous.parse_s, row.parse_s, ratio),
+                        Exponent(previous.build_s, row.build_s, ratio),
+                        Exponent(previous.render_s, row.render_s, ratio));
+        }
+        std::printf("\n");
+        std::fflush(stdout);
+        rows.push_back(row);
+        std::filesystem::remove(path);
+        std::filesystem::remove(std::filesystem::path(path).replace_extension(".mtl"));
+    }
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <work dir> [options]\n";
+        return 2;
+    }
+    std::filesystem::path dir = argv[1];
+    size_t max_triangles = 10000000;
+    size_t max_spheres = 10000000;
+    GeneratorOptions generator;
+    CameraOptions camera{320, 240};
+    RenderOptions render_options{.depth = 1};
+    try {
+        for (int i = 2; i < argc; ++i) {
+            std::string flag = argv[i];
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("Missing value for " + flag);
+            }
+            std::string value = argv[++i];
+            if (flag == "--max") {
+                max_triangles = std::stoull(value);
+            } else if (flag == "--max-spheres") {
+                max_spheres = std::stoull(value);
+            } else if (flag == "--size") {
+                size_t x = value.find('x');
+                if (x == std::string::npos) {
+                    throw std::invalid_argument("Size must look like 320x240");
+                }
+                camera.screen_width = std::stoi(value.substr(0, x));
+                camera.screen_height = std::stoi(value.substr(x + 1));
+            } else if (flag == "--threads") {
+                render_options.threads = std::stoi(value);
+            } else if (flag == "--distribution") {
+                generator.distribution = value == "clustered" ? SceneDistribution::kClustered
+                                                              : SceneDistribution::kUniform;
+            } else {
+                throw std::invalid_argument("Unknown flag " + flag);
+            }
+        }
+        std::filesystem::create_directories(dir);
+        camera = GetGeneratedSceneCamera(generator, camera.screen_width, camera.screen_height);
+
+        Sweep(dir, generator, &GeneratorOptions::triangles, max_triangles, camera,
+              render_options, "triangles");
+        if (max_triangles >= 1000 && max_spheres >= 1000) {
+            std::printf("\n");
+        }
+        generator.triangles = 0;
+        Sweep(dir, generator, &GeneratorOptions::spheres, max_spheres, camera, render_options,
+              "spheres");
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+}
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <options/camera_options.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <numbers>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Synthetic .obj/.mtl scenes of any size for scaling measurements. The output uses only
+// what ReadScene understands: v, vn, f, usemtl, mtllib, S and P lines.
+
+enum class SceneDistribution { kUniform, kClustered };
+
+struct GeneratorOptions {
+    size_t triangles = 1000;
+    size_t spheres = 0;
+    size_t lights = 1;
+    size_t materials = 1;
+    SceneDistribution distribution = SceneDistribution::kUniform;
+    // number of blobs for kClustered
+    size_t clusters = 8;
+    // per-vertex normals, every face then uses the v//vn form
+    bool normals = false;
+    uint64_t seed = 1;
+    // primitives are placed in the cube [-extent, extent]^3
+    double extent = 10;
+};
+
+// a camera that sees the whole generated volume
+CameraOptions GetGeneratedSceneCamera(const GeneratorOptions& options, int width, int height) {
+    return {.screen_width = width,
+            .screen_height = height,
+            .look_from = {0., options.extent, options.extent * 3.5},
+            .look_to = {0., 0., 0.}};
+}
+
+namespace generator_detail {
+
+class TextWriter {
+public:
+    explicit TextWriter(const std::filesystem::path& path) : file_(path, std::ios::binary) {
+        if (!file_) {
+            throw std::runtime_error("Can't write " + path.string());
+        }
+        buffer_.reserve(kFlushSize + 256);
+    }
+
+    // errors are only reported by an explicit Flush
+    ~TextWriter() {
+        file_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+    }
+
+    TextWriter& operator<<(std::string_view text) {
+        buffer_ += text;
+        FlushIfFull();
+        return *this;
+    }
+
+    TextWriter& operator<<(double value) {
+        char digits[64];
+        auto result =
+            std::to_chars(digits, digits + sizeof(digits), value, std::chars_format::fixed, 5);
+        buffer_.append(digits, result.ptr);
+        FlushIfFull();
+        return *this;
+    }
+
+    TextWriter& operator<<(size_t value) {
+        char digits[32];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        buffer_.append(digits, result.ptr);
+        FlushIfFull();
+        return *this;
+    }
+
+    void Flush() {
+        file_.write(buffer_.data(), static_cast<std::streamsize>(buffer_.size()));
+        buffer_.clear();
+        if (!file_) {
+            throw std::runtime_error("Can't write the generated scene");
+        }
+    }
+
+private:
+    static constexpr size_t kFlushSize = 1 << 20;
+
+    void FlushIfFull() {
+        if (buffer_.size() >= kFlushSize) {
+            Flush();
+        }
+    }
+
+    std::ofstream file_;
+    std::string buffer_;
+};
+
+struct Point {
+    double x;
+    double y;
+    double z;
+};
+
+}  // namespace generator_detail
+
+// Writes obj_path and a .mtl with the same stem next to it. The same options and seed
+// always give the same files.
+void GenerateScene(const std::filesystem::path& obj_path, const GeneratorOptions& options) {
+    using namespace generator_detail;
+    if (options.materials == 0) {
+        throw std::invalid_argument("A scene needs at least one material");
+    }
+
+    std::mt19937_64 random(options.seed);
+    std::uniform_real_distribution<double> unit(0., 1.);
+    std::uniform_real_distribution<double> signed_unit(-1., 1.);
+    const double extent = options.extent;
+    // keeps the covered screen area roughly constant while the count grows
+    const size_t primitives = std::max<size_t>(1, options.triangles + options.spheres);
+    const double size = extent * 2 / std::cbrt(static_cast<double>(primitives));
+
+    std::vector<Point> centers;
+    for (size_t i = 0; i < std::max<size_t>(1, options.clusters); ++i) {
+        centers.push_back({signed_unit(random) * extent * .7, signed_unit(random) * extent * .7,
+                           signed_unit(random) * extent * .7});
+    }
+    std::normal_distribution<double> spread(0., extent * .12);
+    auto place = [&] {
+        if (options.distribution == SceneDistribution::kUniform) {
+            return Point{signed_unit(random) * extent, signed_unit(random) * extent,
+                         signed_unit(random) * extent};
+        }
+        const Point& center = centers[random() % centers.size()];
+        auto clamp = [&](double value) { return std::clamp(value, -extent, extent); };
+        return Point{clamp(center.x + spread(random)), clamp(center.y + spread(random)),
+                     clamp(center.z + spread(random))};
+    };
+
+    std::filesystem::path mtl_path = obj_path;
+    mtl_path.replace_extension(".mtl");
+    {
+        TextWriter mtl(mtl_path);
+        for (size_t i = 0; i < options.materials; ++i) {
+            mtl << "newmtl m" << i << "\nKa 0.05000 0.05000 0.05000\nKd " << unit(random) << " "
+                << unit(random) << " " << unit(random) << "\nKs 0.20000 0.20000 0.20000\nNs 32\n";
+            if (i % 8 == 7) {
+                mtl << "Ni 1.50000\nal 0.10000 0.10000 0.80000\n";
+            } else if (i % 4 == 3) {
+                mtl << "al 0.70000 0.30000 0.00000\n";
+            }
+            mtl << "\n";
+        }
+        mtl.Flush();
+    }
+
+    TextWriter obj(obj_path);
+    obj << "mtllib " << mtl_path.filename().string() << "\n";
+    for (size_t i = 0; i < options.lights; ++i) {
+        double angle = 2 * std::numbers::pi * (static_cast<double>(i) + .5) / options.lights;
+        obj << "P " << std::cos(angle) * extent * 2 << " " << extent * 2.5 << " "
+            << std::sin(angle) * extent * 2 << " " << 1. / options.lights << " "
+            << 1. / options.lights << " " << 1. / options.lights << "\n";
+    }
+
+    // contiguous runs of faces share a material, so usemtl lines stay few
+    size_t material = options.materials;
+    for (size_t i = 0; i < options.triangles; ++i) {
+        size_t wanted = i * options.materials / options.triangles;
+        if (wanted != material) {
+            material = wanted;
+            obj << "usemtl m" << material << "\n";
+        }
+        Point center = place();
+        Point corners[3];
+        for (Point& corner : corners) {
+            corner = {center.x + signed_unit(random) * size, center.y + signed_unit(random) * size,
+                      center.z + signed_unit(random) * size};
+            obj << "v " << corner.x << " " << corner.y << " " << corner.z << "\n";
+        }
+        const size_t first = 3 * i + 1;
+        if (options.normals) {
+            double ax = corners[1].x - corners[0].x;
+            double ay = corners[1].y - corners[0].y;
+            double az = corners[1].z - corners[0].z;
+            double bx = corners[2].x - corners[0].x;
+            double by = corners[2].y - corners[0].y;
+            double bz = corners[2].z - corners[0].z;
+            double nx = ay * bz - az * by;
+            double ny = az * bx - ax * bz;
+            double nz = ax * by - ay * bx;
+            double length = std::max(1e-12, std::sqrt(nx * nx + ny * ny + nz * nz));
+            for (int k = 0; k < 3; ++k) {
+                obj << "vn " << nx / length << " " << ny / length << " " << nz / length << "\n";
+            }
+            obj << "f " << first << "//" << first << " " << first + 1 << "//" << first + 1
+                << " " << first + 2 << "//" << first + 2 << "\n";
+        } else {
+            obj << "f " << first << " " << first + 1 << " " << first + 2 << "\n";
+        }
+    }
+
+    for (size_t i = 0; i < options.spheres; ++i) {
+        obj << "usemtl m" << i % options.materials << "\n";
+        Point center = place();
+        obj << "S " << center.x << " " << center.y << " " << center.z << " "
+            << size * (1 + unit(random)) << "\n";
+    }
+    obj.Flush();
+}
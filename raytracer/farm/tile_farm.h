@@ -0,0 +1,477 @@
+#pragma once
+
+#include <raytracer.h>
+#include <server/protocol.h>
+
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Multi-process tile farm. Workers speak a byte-stream protocol, so a forked process,
+// an exec'd tile_worker or a remote one behind ssh look the same to the coordinator.
+//
+// coordinator -> worker: a render job header (see server/protocol.h), then
+//                        "TILE <id> <x> <y> <width> <height>\n" lines
+// worker -> coordinator: "RESULT <id> <size>\n" followed by <size> bytes of raw tile values,
+//                        or "ERROR <id> <message>\n"
+//
+// A tile value is 3 IEEE 754 doubles, each as the 8 little-endian bytes of its bit pattern,
+// and a hit byte per pixel, row by row, so hosts of either byte order can share a farm.
+// Workers return unnormalized values and the coordinator runs ToImage over the merged frame,
+// so the depth and tonemap normalization is the same global one Render computes. A crop
+// window of the job limits the tiles and the frames on both sides.
+
+struct TileFarmOptions {
+    int workers = 4;
+    int tile_size = 32;
+    // a tile running longer is also given to an idle worker, the first result wins
+    double slow_tile_seconds = 30;
+    // a worker silent on a tile for longer is killed and the tile is retried
+    double tile_timeout_seconds = 600;
+    int max_attempts = 3;
+    // argv of an external worker reading the protocol on stdin and answering on stdout,
+    // e.g. {"ssh", "host", "tile_worker"}; empty means forked in-process workers
+    std::vector<std::string> worker_command = {};
+};
+
+const size_t kTileDoubleSize = 8;
+const size_t kTileValueSize = 3 * kTileDoubleSize + 1;
+
+size_t GetTileDataSize(const Tile& tile) {
+    return static_cast<size_t>(tile.width) * tile.height * kTileValueSize;
+}
+
+std::string EncodeTile(const FrameBuffer& frame, const Tile& tile) {
+    std::string data;
+    data.reserve(GetTileDataSize(tile));
+    for (int i = tile.y; i < tile.y + tile.height; ++i) {
+        for (int j = tile.x; j < tile.x + tile.width; ++j) {
+            for (size_t k = 0; k < 3; ++k) {
+                uint64_t bits = std::bit_cast<uint64_t>(frame.Get(i, j)[k]);
+                for (size_t byte = 0; byte < kTileDoubleSize; ++byte) {
+                    data.push_back(static_cast<char>((bits >> (8 * byte)) & 0xff));
+                }
+            }
+            data.push_back(frame.IsHit(i, j) ? 1 : 0);
+        }
+    }
+    return data;
+}
+
+void DecodeTile(const std::string& data, const Tile& tile, FrameBuffer* frame) {
+    if (data.size() != GetTileDataSize(tile)) {
+        throw std::runtime_error("Tile result has a wrong size");
+    }
+    const char* cur = data.data();
+    for (int i = tile.y; i < tile.y + tile.height; ++i) {
+        for (int j = tile.x; j < tile.x + tile.width; ++j) {
+            Vector value;
+            for (size_t k = 0; k < 3; ++k) {
+                uint64_t bits = 0;
+                for (size_t byte = 0; byte < kTileDoubleSize; ++byte) {
+                    bits |= static_cast<uint64_t>(static_cast<unsigned char>(*cur++)) << (8 * byte);
+                }
+                value[k] = std::bit_cast<double>(bits);
+            }
+            if (*cur++ != 0) {
+                frame->Set(i, j, value);
+            }
+        }
+    }
+}
+
+// worker side of the protocol, returns when the coordinator closes its end
+void RunTileWorker(int in_fd, int out_fd) {
+    RenderJob job = ReadJob(in_fd);
+    std::optional<Scene> scene;
+    std::string scene_error;
+    try {
+        scene.emplace(ReadScene(job.scene, {.polygons = true, .threads = job.render.threads}));
+    } catch (const std::exception& e) {
+        scene_error = e.what();
+    }
+    std::array<Vector, 3> m = GetCameraMatrix(job.camera);
+    FrameBuffer frame(GetRenderWindow(job.camera, job.render));
+    TileKernel<Scene> trace_tile = nullptr;
+    // the same per-render state RenderFrames prepares, the bins follow the tile grid
+    std::optional<ScreenBins> bins;
+    std::optional<ShadowMaps> shadow_maps;
+    ShadowCache shadow_cache;
+    if (scene.has_value()) {
+        trace_tile = SelectTileKernel<Scene>(GetSceneFeatures(*scene), job.render);
+        try {
+            if (job.render.rasterize_primary) {
+                bins = BinPrimitives(*scene, job.camera, m, job.render.tile_size);
+            }
+            shadow_maps = BuildShadowMaps(*scene, job.render);
+        } catch (const std::exception& e) {
+            scene.reset();
+            scene_error = e.what();
+        }
+    }
+
+    while (std::optional<std::string> line = ReadLine(in_fd)) {
+        std::istringstream in(*line);
+        std::string command;
+        size_t id;
+        Tile tile;
+        if (!(in >> command >> id >> tile.x >> tile.y >> tile.width >> tile.height) ||
+            command != "TILE") {
+            return;
+        }
+        try {
+            if (!scene.has_value()) {
+                throw std::runtime_error(scene_error);
+            }
+            if (tile.x < frame.Left() || tile.y < frame.Top() || tile.width <= 0 ||
+                tile.height <= 0 || tile.x + tile.width > frame.Left() + frame.Width() ||
+                tile.y + tile.height > frame.Top() + frame.Height()) {
+                throw std::runtime_error("Tile is out of the render window");
+            }
+            const int size = job.render.tile_size;
+            if (bins.has_value() && (tile.x / size != (tile.x + tile.width - 1) / size ||
+                                     tile.y / size != (tile.y + tile.height - 1) / size)) {
+                throw std::runtime_error("Tile is not in one cell of the tile grid");
+            }
+            trace_tile(*scene, job.camera, job.render, m, tile, &frame, nullptr,
+                       bins ? &bins.value() : nullptr,
+                       job.render.shadow_cache ? &shadow_cache : nullptr,
+                       shadow_maps ? &shadow_maps.value() : nullptr);
+            std::string data = EncodeTile(frame, tile);
+            WriteAll(out_fd, "RESULT " + std::to_string(id) + " " + std::to_string(data.size()) +
+                                 "\n" + data);
+        } catch (const std::exception& e) {
+            std::string message = e.what();
+            std::replace(message.begin(), message.end(), '\n', ' ');
+            WriteAll(out_fd, "ERROR " + std::to_string(id) + " " + message + "\n");
+        }
+    }
+}
+
+namespace tile_farm_detail {
+
+struct WorkerProcess {
+    pid_t pid = -1;
+    int fd = -1;
+    std::string inbox;
+    std::optional<size_t> tile;
+    std::chrono::steady_clock::time_point started = {};
+};
+
+void SendAll(int fd, const std::string& data) {
+    size_t sent = 0;
+    while (sent < data.size()) {
+        ssize_t result = ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            throw std::runtime_error("Worker connection lost");
+        }
+        sent += static_cast<size_t>(result);
+    }
+}
+
+class WorkerPool {
+public:
+    WorkerPool(const TileFarmOptions& options, const std::string& job_header)
+        : options_(options), job_header_(job_header) {
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    ~WorkerPool() {
+        for (WorkerProcess& worker : workers_) {
+            Stop(&worker);
+        }
+    }
+
+    std::vector<WorkerProcess>& Workers() {
+        return workers_;
+    }
+
+    void Spawn() {
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+            throw std::runtime_error("Can't create a worker socket");
+        }
+        pid_t pid = ::fork();
+        if (pid < 0) {
+            ::close(fds[0]);
+            ::close(fds[1]);
+            throw std::runtime_error("Can't fork a worker");
+        }
+        if (pid == 0) {
+            ::close(fds[0]);
+            for (const WorkerProcess& worker : workers_) {
+                if (worker.fd >= 0) {
+                    ::close(worker.fd);
+                }
+            }
+            if (!options_.worker_command.empty()) {
+                ::dup2(fds[1], STDIN_FILENO);
+                ::dup2(fds[1], STDOUT_FILENO);
+                std::vector<char*> argv;
+                for (const std::string& arg : options_.worker_command) {
+                    argv.push_back(const_cast<char*>(arg.c_str()));
+                }
+                argv.push_back(nullptr);
+                ::execvp(argv[0], argv.data());
+                ::_exit(127);
+            }
+            try {
+                RunTileWorker(fds[1], fds[1]);
+            } catch (...) {
+                ::_exit(1);
+            }
+            ::_exit(0);
+        }
+
+        ::close(fds[1]);
+        workers_.push_back(WorkerProcess{pid, fds[0], "", std::nullopt, {}});
+        try {
+            SendAll(fds[0], job_header_);
+        } catch (const std::exception&) {
+            Stop(&workers_.back());
+        }
+    }
+
+    void Stop(WorkerProcess* worker) {
+        if (worker->fd < 0) {
+            return;
+        }
+        ::close(worker->fd);
+        worker->fd = -1;
+        if (worker->tile.has_value()) {
+            // busy on a tile nobody needs any more
+            ::kill(worker->pid, SIGKILL);
+        }
+        ::waitpid(worker->pid, nullptr, 0);
+        worker->tile.reset();
+    }
+
+private:
+    const TileFarmOptions& options_;
+    std::string job_header_;
+    std::vector<WorkerProcess> workers_;
+};
+
+}  // namespace tile_farm_detail
+
+FrameBuffer RenderTileFarmFrame(const std::filesystem::path& path,
+                                const CameraOptions& camera_options,
+                                const RenderOptions& render_options,
+                                const TileFarmOptions& options = {}) {
+    using namespace tile_farm_detail;
+    using Clock = std::chrono::steady_clock;
+
+    struct TileState {
+        Tile tile;
+        bool done = false;
+        int attempts = 0;
+        int running = 0;
+        Clock::time_point started = {};
+    };
+
+    RenderJob job{std::filesystem::absolute(path), camera_options, render_options, std::nullopt};
+    // workers bin primitives by the tile size, it has to be the one of the tiles they get
+    job.render.tile_size = options.tile_size;
+    const CropWindow window = GetRenderWindow(camera_options, render_options);
+    FrameBuffer frame(window);
+    std::vector<TileState> tiles;
+    for (const Tile& tile : SplitIntoTiles(window, options.tile_size)) {
+        tiles.push_back(TileState{tile});
+    }
+    std::deque<size_t> pending;
+    for (size_t i = 0; i < tiles.size(); ++i) {
+        pending.push_back(i);
+    }
+    size_t done_count = 0;
+
+    WorkerPool pool(options, SerializeJob(job));
+    const int worker_count = std::max(1, options.workers);
+    int respawns_left = worker_count * std::max(1, options.max_attempts);
+    for (int i = 0; i < worker_count; ++i) {
+        pool.Spawn();
+    }
+
+    auto retry = [&](size_t id, const std::string& reason) {
+        TileState& state = tiles[id];
+        --state.running;
+        if (state.done) {
+            return;
+        }
+        if (++state.attempts >= std::max(1, options.max_attempts)) {
+            throw std::runtime_error("Tile " + std::to_string(id) + " failed: " + reason);
+        }
+        if (state.running == 0) {
+            pending.push_front(id);
+        }
+    };
+
+    auto lose_worker = [&](WorkerProcess* worker, const std::string& reason) {
+        std::optional<size_t> tile = worker->tile;
+        worker->tile.reset();
+        pool.Stop(worker);
+        if (tile.has_value()) {
+            retry(*tile, reason);
+        }
+    };
+
+    while (done_count < tiles.size()) {
+        // tops up the pool after crashes, a bounded number of times
+        size_t alive = 0;
+        for (const WorkerProcess& worker : pool.Workers()) {
+            alive += worker.fd >= 0;
+        }
+        while (alive < static_cast<size_t>(worker_count) && respawns_left > 0) {
+            --respawns_left;
+            pool.Spawn();
+            ++alive;
+        }
+
+        for (size_t w = 0; w < pool.Workers().size(); ++w) {
+            WorkerProcess& worker = pool.Workers()[w];
+            if (worker.fd < 0 || worker.tile.has_value()) {
+                continue;
+            }
+            std::optional<size_t> id;
+            if (!pending.empty()) {
+                id = pending.front();
+                pending.pop_front();
+            } else {
+                // speculatively duplicate the oldest slow tile
+                Clock::time_point now = Clock::now();
+                for (size_t i = 0; i < tiles.size(); ++i) {
+                    const TileState& state = tiles[i];
+                    if (!state.done && state.running == 1 &&
+                        std::chrono::duration<double>(now - state.started).count() >=
+                            options.slow_tile_seconds &&
+                        (!id.has_value() || state.started < tiles[*id].started)) {
+                        id = i;
+                    }
+                }
+            }
+            if (!id.has_value()) {
+                break;
+            }
+
+            TileState& state = tiles[*id];
+            if (state.running == 0) {
+                state.started = Clock::now();
+            }
+            ++state.running;
+            worker.tile = id;
+            worker.started = Clock::now();
+            try {
+                SendAll(worker.fd, "TILE " + std::to_string(*id) + " " +
+                                       std::to_string(state.tile.x) + " " +
+                                       std::to_string(state.tile.y) + " " +
+                                       std::to_string(state.tile.width) + " " +
+                                       std::to_string(state.tile.height) + "\n");
+            } catch (const std::exception& e) {
+                lose_worker(&worker, e.what());
+            }
+        }
+
+        std::vector<pollfd> polled;
+        std::vector<size_t> polled_workers;
+        for (size_t w = 0; w < pool.Workers().size(); ++w) {
+            if (pool.Workers()[w].fd >= 0) {
+                polled.push_back(pollfd{pool.Workers()[w].fd, POLLIN, 0});
+                polled_workers.push_back(w);
+            }
+        }
+        if (polled.empty()) {
+            throw std::runtime_error("All tile workers died");
+        }
+        if (::poll(polled.data(), polled.size(), 100) < 0 && errno != EINTR) {
+            throw std::runtime_error("Poll on tile workers failed");
+        }
+
+        Clock::time_point now = Clock::now();
+        for (size_t p = 0; p < polled.size(); ++p) {
+            WorkerProcess& worker = pool.Workers()[polled_workers[p]];
+            if (polled[p].revents == 0) {
+                if (worker.tile.has_value() &&
+                    std::chrono::duration<double>(now - worker.started).count() >=
+                        options.tile_timeout_seconds) {
+                    lose_worker(&worker, "timed out");
+                }
+                continue;
+            }
+            char buffer[1 << 16];
+            ssize_t size = ::read(worker.fd, buffer, sizeof(buffer));
+            if (size <= 0) {
+                if (size < 0 && errno == EINTR) {
+                    continue;
+                }
+                lose_worker(&worker, "worker exited");
+                continue;
+            }
+            worker.inbox.append(buffer, static_cast<size_t>(size));
+
+            while (true) {
+                size_t line_end = worker.inbox.find('\n');
+                if (line_end == std::string::npos) {
+                    break;
+                }
+                std::istringstream in(worker.inbox.substr(0, line_end));
+                std::string command;
+                size_t id;
+                if (!(in >> command >> id) || id >= tiles.size() || worker.tile != id) {
+                    lose_worker(&worker, "protocol error");
+                    break;
+                }
+                if (command == "RESULT") {
+                    // a size that does not fit the tile is lost like any other bad line
+                    size_t data_size;
+                    if (!(in >> data_size) || data_size != GetTileDataSize(tiles[id].tile)) {
+                        lose_worker(&worker, "protocol error");
+                        break;
+                    }
+                    if (worker.inbox.size() < line_end + 1 + data_size) {
+                        break;
+                    }
+                    std::string data = worker.inbox.substr(line_end + 1, data_size);
+                    worker.inbox.erase(0, line_end + 1 + data_size);
+                    worker.tile.reset();
+                    TileState& state = tiles[id];
+                    --state.running;
+                    if (!state.done) {
+                        DecodeTile(data, state.tile, &frame);
+                        state.done = true;
+                        ++done_count;
+                    }
+                } else {
+                    std::string message;
+                    std::getline(in, message);
+                    worker.inbox.erase(0, line_end + 1);
+                    worker.tile.reset();
+                    retry(id, message);
+                }
+            }
+        }
+    }
+
+    return frame;
+}
+
+Image RenderTileFarm(const std::filesystem::path& path, const CameraOptions& camera_options,
+                     const RenderOptions& render_options, const TileFarmOptions& options = {}) {
+    return ToImage(RenderTileFarmFrame(path, camera_options, render_options, options),
+                   render_options.mode, render_options.normalization);
+}
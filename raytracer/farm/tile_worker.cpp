@@ -0,0 +1,18 @@
+#include <farm/tile_farm.h>
+
+#include <iostream>
+
+#include <unistd.h>
+
+// Tile farm worker speaking the protocol from farm/tile_farm.h on stdin/stdout,
+// for TileFarmOptions::worker_command, e.g. {"ssh", "host", "tile_worker"}.
+
+int main() {
+    try {
+        RunTileWorker(STDIN_FILENO, STDOUT_FILENO);
+    } catch (const std::exception& e) {
+        std::cerr << "tile_worker: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,99 @@
+#include <raytracer.h>
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+
+// Loads a scene and prints what it and a render of it would keep in memory.
+//
+// usage: scene_footprint <scene.obj> [--size WIDTH HEIGHT] [--frames N] [--threads N]
+//                        [--budget BYTES] [--cleanup [WELD_TOLERANCE]]
+// --frames counts cameras of an animation rendered in one RenderFrames call. With --budget
+// the scene is read under that limit and the exit code is 1 when the render would not fit.
+// --cleanup reads the scene through the geometry cleanup and prints what it removed.
+
+namespace {
+
+void PrintRow(const char* name, size_t bytes, size_t total) {
+    std::printf("%-16s %14zu %8.1f%%\n", name, bytes,
+                total == 0 ? 0. : 100. * static_cast<double>(bytes) / total);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " <scene.obj> [options]\n";
+        return 2;
+    }
+    std::filesystem::path path = argv[1];
+    CameraOptions camera{640, 480};
+    size_t frame_count = 1;
+    RenderOptions render_options{1};
+    std::optional<SceneCleanupOptions> cleanup;
+    try {
+        for (int i = 2; i < argc; ++i) {
+            std::string flag = argv[i];
+            if (flag == "--cleanup") {
+                cleanup.emplace();
+                if (i + 1 < argc && argv[i + 1][0] != '-') {
+                    cleanup->weld_tolerance = std::stod(argv[++i]);
+                }
+                continue;
+            }
+            int values = flag == "--size" ? 2 : 1;
+            if (i + values >= argc) {
+                throw std::invalid_argument("Missing value for " + flag);
+            }
+            if (flag == "--size") {
+                camera.screen_width = std::stoi(argv[++i]);
+                camera.screen_height = std::stoi(argv[++i]);
+            } else if (flag == "--frames") {
+                frame_count = std::max(1, std::stoi(argv[++i]));
+            } else if (flag == "--threads") {
+                render_options.threads = std::stoi(argv[++i]);
+            } else if (flag == "--budget") {
+                render_options.memory_budget = std::stoull(argv[++i]);
+            } else {
+                throw std::invalid_argument("Unknown flag " + flag);
+            }
+        }
+
+        std::vector<CameraOptions> cameras(frame_count, camera);
+        SceneCleanupReport report;
+        Scene scene = ReadScene(path,
+                                {.memory_budget = render_options.memory_budget,
+                                 .cleanup = cleanup,
+                                 .polygons = true},
+                                &report);
+        if (cleanup.has_value()) {
+            std::printf("welded vertices %zu, degenerate triangles %zu, duplicate triangles %zu, "
+                        "normalized normals %zu, %zu of %zu triangles kept\n\n",
+                        report.welded_vertices, report.degenerate_triangles,
+                        report.duplicate_triangles, report.normalized_normals,
+                        scene.GetObjects().size(),
+                        scene.GetObjects().size() + report.RemovedTriangles());
+        }
+        RenderFootprint footprint = GetRenderFootprint(scene, cameras, render_options);
+        const size_t total = footprint.Total();
+
+        std::printf("%-16s %14s %9s\n", "part", "bytes", "share");
+        PrintRow("objects", footprint.scene.objects, total);
+        PrintRow("normals", footprint.scene.normals, total);
+        PrintRow("spheres", footprint.scene.spheres, total);
+        PrintRow("polygons", footprint.scene.polygons, total);
+        PrintRow("materials", footprint.scene.materials, total);
+        PrintRow("lights", footprint.scene.lights, total);
+        PrintRow("frame buffers", footprint.frames, total);
+        PrintRow("total", total, total);
+
+        CheckMemoryBudget("Render of " + path.string(), total, render_options.memory_budget);
+        return 0;
+    } catch (const MemoryBudgetExceeded& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+}
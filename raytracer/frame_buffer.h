@@ -0,0 +1,214 @@
+#pragma once
+
+#include <image.h>
+#include <options/render_options.h>
+
+#include <vector.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <optional>
+#include <vector>
+
+struct Tile {
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// The tiles of the frame grid clipped to the window, so a tile never straddles two cells
+// of a grid that starts at the frame corner.
+std::vector<Tile> SplitIntoTiles(const CropWindow& window, int tile_size) {
+    std::vector<Tile> tiles;
+    const int right = window.x + window.width;
+    const int bottom = window.y + window.height;
+    for (int y = window.y / tile_size * tile_size; y < bottom; y += tile_size) {
+        for (int x = window.x / tile_size * tile_size; x < right; x += tile_size) {
+            int x0 = std::max(x, window.x);
+            int y0 = std::max(y, window.y);
+            tiles.push_back(Tile{x0, y0, std::min(x + tile_size, right) - x0,
+                                 std::min(y + tile_size, bottom) - y0});
+        }
+    }
+    return tiles;
+}
+
+std::vector<Tile> SplitIntoTiles(int width, int height, int tile_size) {
+    return SplitIntoTiles(CropWindow{0, 0, width, height}, tile_size);
+}
+
+// Raw per-pixel values before normalization: distance for kDepth,
+// normal for kNormal and radiance for kFull. Pixels without a hit keep IsHit() == false.
+// The buffer may cover only a window of the frame whose corner is at (Left(), Top()),
+// pixels are always addressed in frame coordinates.
+class FrameBuffer {
+public:
+    FrameBuffer(int width, int height, int left = 0, int top = 0)
+        : width_(width),
+          height_(height),
+          left_(left),
+          top_(top),
+          values_(width * height),
+          hits_(width * height, 0) {
+    }
+
+    explicit FrameBuffer(const CropWindow& window)
+        : FrameBuffer(window.width, window.height, window.x, window.y) {
+    }
+
+    int Width() const {
+        return width_;
+    }
+
+    int Height() const {
+        return height_;
+    }
+
+    int Left() const {
+        return left_;
+    }
+
+    int Top() const {
+        return top_;
+    }
+
+    void Set(int y, int x, const Vector& value) {
+        values_[Index(y, x)] = value;
+        hits_[Index(y, x)] = 1;
+    }
+
+    const Vector& Get(int y, int x) const {
+        return values_[Index(y, x)];
+    }
+
+    bool IsHit(int y, int x) const {
+        return hits_[Index(y, x)] != 0;
+    }
+
+private:
+    size_t Index(int y, int x) const {
+        return static_cast<size_t>(y - top_) * width_ + (x - left_);
+    }
+
+    int width_;
+    int height_;
+    int left_;
+    int top_;
+    std::vector<Vector> values_;
+    std::vector<char> hits_;
+};
+
+// one frame in flight: the raw values, the hit flags and the image they are tonemapped into
+size_t FrameBytes(int width, int height) {
+    return static_cast<size_t>(width) * height * (sizeof(Vector) + sizeof(char) + sizeof(RGB));
+}
+
+int ToColorComponent(double value) {
+    return std::min(255, static_cast<int>(std::floor(value * 256)));
+}
+
+double ToneMap(double value, double max_value) {
+    double mapped = value * (1 + value / std::pow(max_value, 2)) / (1 + value);
+    return std::pow(mapped, 1.0 / 2.2);
+}
+
+// false color of t in [0, 1]: blue for little work through cyan, green and yellow to red
+RGB HeatColor(double t) {
+    static constexpr double kStops[5][3] = {
+        {0, 0, 1}, {0, 1, 1}, {0, 1, 0}, {1, 1, 0}, {1, 0, 0}};
+    double scaled = std::clamp(t, 0.0, 1.0) * 4;
+    int stop = std::min(3, static_cast<int>(scaled));
+    double f = scaled - stop;
+    auto mix = [&](int c) {
+        return ToColorComponent(kStops[stop][c] * (1 - f) + kStops[stop + 1][c] * f);
+    };
+    return RGB{mix(0), mix(1), mix(2)};
+}
+
+// The value ToImage normalizes by when none is given: the largest hit depth in kDepth,
+// the largest radiance component of a hit in kFull and the most work in kHeatmap.
+double GetNormalization(const FrameBuffer& frame, RenderMode mode) {
+    double normalization = 0;
+    for (int i = frame.Top(); i < frame.Top() + frame.Height(); ++i) {
+        for (int j = frame.Left(); j < frame.Left() + frame.Width(); ++j) {
+            const Vector& value = frame.Get(i, j);
+            if (mode == RenderMode::kHeatmap) {
+                normalization = std::max(normalization, value[0]);
+            } else if (mode == RenderMode::kDepth && frame.IsHit(i, j)) {
+                normalization = std::max(normalization, value[0]);
+            } else if (mode == RenderMode::kFull && frame.IsHit(i, j)) {
+                normalization = std::max({normalization, value[0], value[1], value[2]});
+            }
+        }
+    }
+    return normalization;
+}
+
+// Calls set(i, j, color) for every pixel, i and j counted from the corner of the window
+// of the frame, with the colors of ToImage.
+template <class Callback>
+void ForEachColor(const FrameBuffer& frame, RenderMode mode, std::optional<double> normalization,
+                  Callback set) {
+    const double to_normalize_pixels = normalization.has_value()
+                                           ? normalization.value()
+                                           : GetNormalization(frame, mode);
+
+    for (int i = 0; i < frame.Height(); ++i) {
+        for (int j = 0; j < frame.Width(); ++j) {
+            const int y = frame.Top() + i;
+            const int x = frame.Left() + j;
+            const Vector& result = frame.Get(y, x);
+            if (mode == RenderMode::kDepth) {
+                if (frame.IsHit(y, x)) {
+                    int val = ToColorComponent(result[0] / to_normalize_pixels);
+                    set(i, j, RGB{val, val, val});
+                } else {
+                    set(i, j, RGB{255, 255, 255});
+                }
+            } else if (mode == RenderMode::kNormal) {
+                if (frame.IsHit(y, x)) {
+                    set(i, j,
+                        RGB{ToColorComponent(result[0] / 2 + 0.5),
+                            ToColorComponent(result[1] / 2 + 0.5),
+                            ToColorComponent(result[2] / 2 + 0.5)});
+                } else {
+                    set(i, j, RGB{0, 0, 0});
+                }
+            } else if (mode == RenderMode::kHeatmap) {
+                set(i, j,
+                    HeatColor(to_normalize_pixels == 0 ? 0 : result[0] / to_normalize_pixels));
+            } else if (to_normalize_pixels != 0.0) {
+                set(i, j,
+                    RGB{ToColorComponent(ToneMap(result[0], to_normalize_pixels)),
+                        ToColorComponent(ToneMap(result[1], to_normalize_pixels)),
+                        ToColorComponent(ToneMap(result[2], to_normalize_pixels))});
+            } else {
+                set(i, j, RGB{0, 0, 0});
+            }
+        }
+    }
+}
+
+Image ToImage(const FrameBuffer& frame, RenderMode mode,
+              std::optional<double> normalization = std::nullopt) {
+    Image output(frame.Width(), frame.Height());
+    ForEachColor(frame, mode, normalization,
+                 [&output](int i, int j, const RGB& color) { output.SetPixel(color, i, j); });
+    return output;
+}
+
+// a channel of the pixel at frame coordinates as ToFloatImage stores it, kDepth and
+// kHeatmap have channel 0 only
+float GetLinearValue(const FrameBuffer& frame, RenderMode mode, int y, int x, int channel) {
+    const Vector& value = frame.Get(y, x);
+    if (mode == RenderMode::kDepth) {
+        return frame.IsHit(y, x) ? static_cast<float>(value[0])
+                                 : std::numeric_limits<float>::infinity();
+    }
+    if (mode == RenderMode::kHeatmap) {
+        return static_cast<float>(value[0]);
+    }
+    return frame.IsHit(y, x) ? static_cast<float>(value[channel]) : 0.0f;
+}
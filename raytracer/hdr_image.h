@@ -0,0 +1,446 @@
+#pragma once
+
+#include <frame_buffer.h>
+#include <options/render_options.h>
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <zlib.h>
+
+// Linear float output: PFM and scanline OpenEXR with 32-bit float channels.
+
+// Row-major values with interleaved channels, the top row first.
+// One channel holds depth distances, three hold RGB.
+struct FloatImage {
+    int width = 0;
+    int height = 0;
+    int channels = 3;
+    std::vector<float> values;
+
+    float Get(int y, int x, int channel) const {
+        return values[(static_cast<size_t>(y) * width + x) * channels + channel];
+    }
+};
+
+// Raw framebuffer values without normalization: radiance for kFull, normals for kNormal,
+// distances for kDepth and per-pixel work for kHeatmap. Misses are black, and infinity in
+// depth.
+FloatImage ToFloatImage(const FrameBuffer& frame, RenderMode mode) {
+    const bool single = mode == RenderMode::kDepth || mode == RenderMode::kHeatmap;
+    FloatImage image{frame.Width(), frame.Height(), single ? 1 : 3, {}};
+    image.values.resize(static_cast<size_t>(image.width) * image.height * image.channels);
+    float* out = image.values.data();
+    for (int i = frame.Top(); i < frame.Top() + frame.Height(); ++i) {
+        for (int j = frame.Left(); j < frame.Left() + frame.Width(); ++j) {
+            for (int c = 0; c < image.channels; ++c) {
+                *out++ = GetLinearValue(frame, mode, i, j, c);
+            }
+        }
+    }
+    return image;
+}
+
+enum class ExrCompression { kNone, kZip };
+
+struct HdrWriteOptions {
+    // 0 means one thread per hardware core
+    int threads = 0;
+    ExrCompression compression = ExrCompression::kZip;
+    int rows_per_chunk = 16;
+};
+
+namespace hdr_detail {
+
+template <class T>
+void Append(std::string* out, T value) {
+    static_assert(std::endian::native == std::endian::little, "little-endian host expected");
+    out->append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template <class T>
+T Take(const std::string& data, size_t* offset) {
+    if (*offset + sizeof(T) > data.size()) {
+        throw std::runtime_error("Truncated image file");
+    }
+    T value;
+    std::memcpy(&value, data.data() + *offset, sizeof(T));
+    *offset += sizeof(T);
+    return value;
+}
+
+void AppendAttribute(std::string* out, const std::string& name, const std::string& type,
+                     const std::string& value) {
+    out->append(name).push_back('\0');
+    out->append(type).push_back('\0');
+    Append<int32_t>(out, static_cast<int32_t>(value.size()));
+    out->append(value);
+}
+
+// Encodes chunks on several threads and writes them strictly in order. At most twice
+// the thread count of encoded chunks wait in memory, so big frames are streamed.
+void WriteChunks(std::ostream& out, size_t chunk_count, int threads,
+                 const std::function<std::string(size_t)>& encode,
+                 const std::function<void(size_t, uint64_t)>& on_written = {}) {
+    size_t thread_count = threads > 0 ? static_cast<size_t>(threads)
+                                      : std::max<size_t>(1, std::thread::hardware_concurrency());
+    thread_count = std::max<size_t>(1, std::min(thread_count, chunk_count));
+    const size_t window = 2 * thread_count;
+
+    std::vector<std::optional<std::string>> ready(chunk_count);
+    std::atomic<size_t> next_chunk = 0;
+    size_t written = 0;
+    bool failed = false;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    auto worker = [&] {
+        try {
+            while (true) {
+                size_t chunk = next_chunk++;
+                if (chunk >= chunk_count) {
+                    return;
+                }
+                {
+                    std::unique_lock lock(mutex);
+                    cv.wait(lock, [&] { return chunk < written + window || failed; });
+                    if (failed) {
+                        return;
+                    }
+                }
+                std::string data = encode(chunk);
+                std::lock_guard lock(mutex);
+                ready[chunk] = std::move(data);
+                cv.notify_all();
+            }
+        } catch (...) {
+            std::lock_guard lock(mutex);
+            if (!failed) {
+                failed = true;
+                error = std::current_exception();
+            }
+            cv.notify_all();
+        }
+    };
+
+    std::vector<std::jthread> workers;
+    for (size_t i = 0; i < thread_count; ++i) {
+        workers.emplace_back(worker);
+    }
+    for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+        std::string data;
+        {
+            std::unique_lock lock(mutex);
+            cv.wait(lock, [&] { return ready[chunk].has_value() || failed; });
+            if (failed) {
+                break;
+            }
+            data = std::move(ready[chunk].value());
+            ready[chunk].reset();
+        }
+        if (on_written) {
+            on_written(chunk, static_cast<uint64_t>(out.tellp()));
+        }
+        out.write(data.data(), static_cast<std::streamsize>(data.size()));
+        std::lock_guard lock(mutex);
+        ++written;
+        cv.notify_all();
+    }
+    workers.clear();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+std::string ReadWholeFile(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        throw std::runtime_error("Can't open " + path.string());
+    }
+    return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// OpenEXR names channels alphabetically inside a scanline: B, G, R or a single Z
+std::vector<int> ExrChannelOrder(int channels) {
+    return channels == 1 ? std::vector<int>{0} : std::vector<int>{2, 1, 0};
+}
+
+// the zip codec stores byte deltas of the even bytes followed by the odd bytes
+std::string ZipPredict(const std::string& raw) {
+    std::string split(raw.size(), '\0');
+    size_t half = (raw.size() + 1) / 2;
+    for (size_t i = 0; i < raw.size(); ++i) {
+        split[(i % 2 == 0 ? 0 : half) + i / 2] = raw[i];
+    }
+    for (size_t i = split.size(); i-- > 1;) {
+        split[i] = static_cast<char>(static_cast<unsigned char>(split[i]) -
+                                     static_cast<unsigned char>(split[i - 1]) + 128);
+    }
+    return split;
+}
+
+std::string ZipUnpredict(std::string split) {
+    for (size_t i = 1; i < split.size(); ++i) {
+        split[i] = static_cast<char>(static_cast<unsigned char>(split[i]) +
+                                     static_cast<unsigned char>(split[i - 1]) - 128);
+    }
+    std::string raw(split.size(), '\0');
+    size_t half = (raw.size() + 1) / 2;
+    for (size_t i = 0; i < raw.size(); ++i) {
+        raw[i] = split[(i % 2 == 0 ? 0 : half) + i / 2];
+    }
+    return raw;
+}
+
+}  // namespace hdr_detail
+
+// Rows are stored bottom to top, the negative scale marks little-endian floats.
+void WritePfm(const FloatImage& image, const std::filesystem::path& path,
+              const HdrWriteOptions& options = {}) {
+    using namespace hdr_detail;
+    if (image.channels != 1 && image.channels != 3) {
+        throw std::invalid_argument("PFM holds one or three channels");
+    }
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Can't write " + path.string());
+    }
+    out << (image.channels == 3 ? "PF" : "Pf") << '\n'
+        << image.width << ' ' << image.height << '\n'
+        << "-1.0\n";
+
+    const size_t rows = static_cast<size_t>(std::max(1, options.rows_per_chunk));
+    const size_t row_size = static_cast<size_t>(image.width) * image.channels;
+    const size_t height = static_cast<size_t>(image.height);
+    WriteChunks(out, (height + rows - 1) / rows, options.threads, [&](size_t chunk) {
+        std::string data;
+        size_t first = chunk * rows;
+        size_t last = std::min(height, first + rows);
+        data.reserve((last - first) * row_size * sizeof(float));
+        for (size_t row = first; row < last; ++row) {
+            const float* values = image.values.data() + (height - 1 - row) * row_size;
+            for (size_t i = 0; i < row_size; ++i) {
+                Append<float>(&data, values[i]);
+            }
+        }
+        return data;
+    });
+    if (!out) {
+        throw std::runtime_error("Failed writing " + path.string());
+    }
+}
+
+FloatImage ReadPfm(const std::filesystem::path& path) {
+    std::string data = hdr_detail::ReadWholeFile(path);
+    std::istringstream header(data);
+    std::string magic;
+    FloatImage image;
+    double scale = 0;
+    header >> magic >> image.width >> image.height >> scale;
+    if ((magic != "PF" && magic != "Pf") || image.width <= 0 || image.height <= 0 || scale >= 0) {
+        throw std::runtime_error("Unsupported PFM file " + path.string());
+    }
+    image.channels = magic == "PF" ? 3 : 1;
+    size_t offset = static_cast<size_t>(header.tellg()) + 1;
+    size_t row_size = static_cast<size_t>(image.width) * image.channels;
+    image.values.resize(row_size * image.height);
+    for (int row = image.height - 1; row >= 0; --row) {
+        for (size_t i = 0; i < row_size; ++i) {
+            image.values[row * row_size + i] = hdr_detail::Take<float>(data, &offset);
+        }
+    }
+    return image;
+}
+
+// Single-part scanline file with FLOAT channels, either uncompressed (one row per chunk)
+// or ZIP compressed at the fastest zlib level (16 rows per chunk, as the format requires).
+void WriteExr(const FloatImage& image, const std::filesystem::path& path,
+              const HdrWriteOptions& options = {}) {
+    using namespace hdr_detail;
+    if (image.channels != 1 && image.channels != 3) {
+        throw std::invalid_argument("EXR output holds one or three channels");
+    }
+    const bool zip = options.compression == ExrCompression::kZip;
+    const std::vector<int> order = ExrChannelOrder(image.channels);
+
+    std::string header;
+    Append<uint32_t>(&header, 20000630);
+    Append<uint32_t>(&header, 2);
+
+    std::string channels;
+    for (int channel : order) {
+        channels.append(image.channels == 1 ? "Z" : std::string(1, "RGB"[channel]));
+        channels.push_back('\0');
+        Append<int32_t>(&channels, 2);  // FLOAT
+        Append<int32_t>(&channels, 0);  // pLinear and reserved bytes
+        Append<int32_t>(&channels, 1);
+        Append<int32_t>(&channels, 1);
+    }
+    channels.push_back('\0');
+    AppendAttribute(&header, "channels", "chlist", channels);
+    AppendAttribute(&header, "compression", "compression", std::string(1, zip ? '\3' : '\0'));
+    std::string window;
+    Append<int32_t>(&window, 0);
+    Append<int32_t>(&window, 0);
+    Append<int32_t>(&window, image.width - 1);
+    Append<int32_t>(&window, image.height - 1);
+    AppendAttribute(&header, "dataWindow", "box2i", window);
+    AppendAttribute(&header, "displayWindow", "box2i", window);
+    AppendAttribute(&header, "lineOrder", "lineOrder", std::string(1, '\0'));
+    std::string one;
+    Append<float>(&one, 1.0f);
+    AppendAttribute(&header, "pixelAspectRatio", "float", one);
+    AppendAttribute(&header, "screenWindowCenter", "v2f", std::string(8, '\0'));
+    AppendAttribute(&header, "screenWindowWidth", "float", one);
+    header.push_back('\0');
+
+    const size_t rows = zip ? 16 : 1;
+    const size_t height = static_cast<size_t>(image.height);
+    const size_t chunk_count = (height + rows - 1) / rows;
+
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+        throw std::runtime_error("Can't write " + path.string());
+    }
+    out.write(header.data(), static_cast<std::streamsize>(header.size()));
+    const std::streamoff table_position = out.tellp();
+    std::vector<uint64_t> offsets(chunk_count);
+    out.write(reinterpret_cast<const char*>(offsets.data()),
+              static_cast<std::streamsize>(chunk_count * sizeof(uint64_t)));
+
+    WriteChunks(
+        out, chunk_count, options.threads,
+        [&](size_t chunk) {
+            std::string raw;
+            size_t first = chunk * rows;
+            size_t last = std::min(height, first + rows);
+            raw.reserve((last - first) * image.width * image.channels * sizeof(float));
+            for (size_t row = first; row < last; ++row) {
+                for (int channel : order) {
+                    for (int x = 0; x < image.width; ++x) {
+                        Append<float>(&raw, image.Get(static_cast<int>(row), x, channel));
+                    }
+                }
+            }
+
+            std::string payload = raw;
+            if (zip) {
+                std::string predicted = ZipPredict(raw);
+                uLongf size = compressBound(predicted.size());
+                std::string compressed(size, '\0');
+                if (compress2(reinterpret_cast<Bytef*>(compressed.data()), &size,
+                              reinterpret_cast<const Bytef*>(predicted.data()), predicted.size(),
+                              Z_BEST_SPEED) != Z_OK) {
+                    throw std::runtime_error("zlib failed");
+                }
+                // readers take a chunk that didn't shrink as stored uncompressed
+                if (size < raw.size()) {
+                    compressed.resize(size);
+                    payload = std::move(compressed);
+                }
+            }
+
+            std::string data;
+            Append<int32_t>(&data, static_cast<int32_t>(first));
+            Append<int32_t>(&data, static_cast<int32_t>(payload.size()));
+            return data + payload;
+        },
+        [&](size_t chunk, uint64_t offset) { offsets[chunk] = offset; });
+
+    out.seekp(table_position);
+    out.write(reinterpret_cast<const char*>(offsets.data()),
+              static_cast<std::streamsize>(chunk_count * sizeof(uint64_t)));
+    if (!out) {
+        throw std::runtime_error("Failed writing " + path.string());
+    }
+}
+
+// Reads back files written by WriteExr, it is not a general OpenEXR reader.
+FloatImage ReadExr(const std::filesystem::path& path) {
+    using namespace hdr_detail;
+    std::string data = ReadWholeFile(path);
+    size_t offset = 0;
+    if (Take<uint32_t>(data, &offset) != 20000630 || Take<uint32_t>(data, &offset) != 2) {
+        throw std::runtime_error("Unsupported EXR file " + path.string());
+    }
+
+    FloatImage image;
+    bool zip = false;
+    int channel_count = 0;
+    while (data.at(offset) != '\0') {
+        std::string name = data.c_str() + offset;
+        offset += name.size() + 1;
+        std::string type = data.c_str() + offset;
+        offset += type.size() + 1;
+        size_t size = static_cast<size_t>(Take<int32_t>(data, &offset));
+        size_t value = offset;
+        offset += size;
+        if (name == "channels") {
+            for (size_t at = value; data.at(at) != '\0'; at += 17 + std::strlen(data.c_str() + at)) {
+                ++channel_count;
+            }
+        } else if (name == "compression") {
+            zip = data.at(value) == '\3';
+        } else if (name == "dataWindow") {
+            value += 2 * sizeof(int32_t);
+            image.width = Take<int32_t>(data, &value) + 1;
+            image.height = Take<int32_t>(data, &value) + 1;
+        }
+    }
+    ++offset;
+    image.channels = channel_count;
+    if ((channel_count != 1 && channel_count != 3) || image.width <= 0 || image.height <= 0) {
+        throw std::runtime_error("Unsupported EXR layout in " + path.string());
+    }
+
+    const size_t rows = zip ? 16 : 1;
+    const size_t chunk_count = (image.height + rows - 1) / rows;
+    const std::vector<int> order = ExrChannelOrder(image.channels);
+    image.values.resize(static_cast<size_t>(image.width) * image.height * image.channels);
+    for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+        size_t position = Take<uint64_t>(data, &offset);
+        int first = Take<int32_t>(data, &position);
+        size_t size = static_cast<size_t>(Take<int32_t>(data, &position));
+        int last = std::min(image.height, first + static_cast<int>(rows));
+        size_t raw_size = static_cast<size_t>(last - first) * image.width * image.channels * 4;
+        std::string raw = data.substr(position, size);
+        if (size < raw_size) {
+            std::string predicted(raw_size, '\0');
+            uLongf length = raw_size;
+            if (uncompress(reinterpret_cast<Bytef*>(predicted.data()), &length,
+                           reinterpret_cast<const Bytef*>(raw.data()), raw.size()) != Z_OK ||
+                length != raw_size) {
+                throw std::runtime_error("Corrupted EXR chunk in " + path.string());
+            }
+            raw = ZipUnpredict(std::move(predicted));
+        }
+        size_t at = 0;
+        for (int row = first; row < last; ++row) {
+            for (int channel : order) {
+                for (int x = 0; x < image.width; ++x) {
+                    image.values[(static_cast<size_t>(row) * image.width + x) * image.channels +
+                                 channel] = Take<float>(raw, &at);
+                }
+            }
+        }
+    }
+    return image;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <options/camera_options.h>
+
+#include <vector.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+struct CameraKeyframe {
+    double time;
+    CameraOptions camera;
+};
+
+// Linearly interpolates look_from, look_to and fov between keyframes sorted by time.
+// Frames are spread evenly over [first.time, last.time], screen size comes from the first key.
+std::vector<CameraOptions> SampleCameraPath(const std::vector<CameraKeyframe>& keyframes,
+                                            size_t frame_count) {
+    if (keyframes.empty()) {
+        throw std::invalid_argument("Camera path has no keyframes");
+    }
+
+    std::vector<CameraOptions> cameras;
+    cameras.reserve(frame_count);
+    double start = keyframes.front().time;
+    double finish = keyframes.back().time;
+    size_t key = 0;
+
+    for (size_t frame = 0; frame < frame_count; ++frame) {
+        double time = frame_count == 1 ? start
+                                       : start + (finish - start) * static_cast<double>(frame) /
+                                                     static_cast<double>(frame_count - 1);
+        while (key + 1 < keyframes.size() && keyframes[key + 1].time < time) {
+            ++key;
+        }
+
+        const CameraKeyframe& from = keyframes[key];
+        const CameraKeyframe& to = keyframes[std::min(key + 1, keyframes.size() - 1)];
+        double t = to.time > from.time ? (time - from.time) / (to.time - from.time) : 0.0;
+
+        CameraOptions camera = keyframes.front().camera;
+        camera.fov = from.camera.fov + (to.camera.fov - from.camera.fov) * t;
+        camera.look_from = from.camera.look_from + (to.camera.look_from - from.camera.look_from) * t;
+        camera.look_to = from.camera.look_to + (to.camera.look_to - from.camera.look_to) * t;
+        cameras.push_back(camera);
+    }
+
+    return cameras;
+}
@@ -1,8 +1,57 @@
 #pragma once
 
-enum class RenderMode { kDepth, kNormal, kFull };
+#include <filesystem>
+#include <optional>
+
+enum class RenderMode { kDepth, kNormal, kFull, kHeatmap };
+
+// per-pixel work shown by RenderMode::kHeatmap, summed over the whole ray tree of a pixel
+enum class HeatmapMetric { kIntersectionTests, kRays, kDepth };
+
+struct ShadowMapOptions {
+    // texels along the side of every cube face
+    int resolution = 256;
+    // depth offset against self-shadowing, in texels at the distance of the shaded point
+    double bias = 2.0;
+};
+
+// pixels [x, x + width) by [y, y + height) of the frame
+struct CropWindow {
+    int x;
+    int y;
+    int width;
+    int height;
+};
 
 struct RenderOptions {
     int depth;
     RenderMode mode = RenderMode::kFull;
+    // when set, the scene is streamed into this cluster file and rendered from its mapping
+    std::optional<std::filesystem::path> out_of_core_cache = std::nullopt;
+    // 0 means one thread per hardware core
+    int threads = 0;
+    int tile_size = 32;
+    // reflection and refraction rays whose accumulated albedo product falls below this
+    // are not traced, branches with exactly zero albedo are skipped regardless
+    double min_path_weight = 0.0;
+    // bytes the scene and the frames in flight may take, 0 means no limit;
+    // a render that would not fit fails with MemoryBudgetExceeded before allocating
+    size_t memory_budget = 0;
+    // resolve camera rays of a Scene through a per-tile visibility buffer built from
+    // screen-space bins instead of testing every primitive, the hits are the same
+    bool rasterize_primary = false;
+    // every render thread first tests the last occluder found towards each light
+    bool shadow_cache = true;
+    // approximate shadows: point lights are looked up in cube depth maps built once per
+    // render instead of tracing a shadow ray per light and hit
+    std::optional<ShadowMapOptions> shadow_maps = std::nullopt;
+    // what kHeatmap shows: primitive tests, traced rays or the deepest recursion level
+    HeatmapMetric heatmap = HeatmapMetric::kIntersectionTests;
+    // only the pixels inside are traced and the image has the size of the window, the
+    // rays still go through the full-frame projection of the camera
+    std::optional<CropWindow> crop = std::nullopt;
+    // what the image is normalized by: the largest depth in kDepth, the largest radiance
+    // component in kFull and the most work in kHeatmap. Found from the traced pixels when
+    // unset, pass GetNormalization of the full frame so cropped images match it exactly.
+    std::optional<double> normalization = std::nullopt;
 };
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <frame_buffer.h>
+#include <options/render_options.h>
+
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+enum class PixelFormat { kRGB8, kRGBA8, kRGB32F };
+
+size_t GetPixelSize(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::kRGB8:
+            return 3;
+        case PixelFormat::kRGBA8:
+            return 4;
+        case PixelFormat::kRGB32F:
+            return 3 * sizeof(float);
+    }
+    return 0;
+}
+
+// Pixels owned by the caller, such as a mapped file or shared memory; row y starts
+// y * stride bytes after data. The 8 bit formats get the colors of ToImage with an opaque
+// alpha, kRGB32F gets the linear values of ToFloatImage in native byte order, with the
+// distance or work of kDepth and kHeatmap repeated in every channel.
+struct PixelBuffer {
+    void* data;
+    int width;
+    int height;
+    size_t stride;
+    PixelFormat format = PixelFormat::kRGB8;
+};
+
+// a buffer with rows packed one after another
+PixelBuffer MakePackedBuffer(void* data, int width, int height, PixelFormat format) {
+    return PixelBuffer{data, width, height, static_cast<size_t>(width) * GetPixelSize(format),
+                       format};
+}
+
+void CheckPixelBuffer(const PixelBuffer& output, int width, int height) {
+    if (output.data == nullptr || output.width != width || output.height != height ||
+        output.stride < static_cast<size_t>(width) * GetPixelSize(output.format)) {
+        throw std::invalid_argument("Pixel buffer does not fit a " + std::to_string(width) +
+                                    "x" + std::to_string(height) + " image");
+    }
+}
+
+// Normalizes the frame straight into output, which has the size of the frame window.
+void WritePixels(const FrameBuffer& frame, RenderMode mode, std::optional<double> normalization,
+                 const PixelBuffer& output) {
+    CheckPixelBuffer(output, frame.Width(), frame.Height());
+    auto* pixels = static_cast<unsigned char*>(output.data);
+    if (output.format == PixelFormat::kRGB32F) {
+        const bool single = mode == RenderMode::kDepth || mode == RenderMode::kHeatmap;
+        for (int i = 0; i < frame.Height(); ++i) {
+            unsigned char* out = pixels + i * output.stride;
+            for (int j = 0; j < frame.Width(); ++j) {
+                for (int c = 0; c < 3; ++c) {
+                    float value = GetLinearValue(frame, mode, frame.Top() + i, frame.Left() + j,
+                                                 single ? 0 : c);
+                    std::memcpy(out, &value, sizeof(float));
+                    out += sizeof(float);
+                }
+            }
+        }
+        return;
+    }
+    const size_t pixel_size = GetPixelSize(output.format);
+    ForEachColor(frame, mode, normalization, [&](int i, int j, const RGB& color) {
+        unsigned char* out = pixels + i * output.stride + j * pixel_size;
+        out[0] = static_cast<unsigned char>(color.r);
+        out[1] = static_cast<unsigned char>(color.g);
+        out[2] = static_cast<unsigned char>(color.b);
+        if (output.format == PixelFormat::kRGBA8) {
+            out[3] = 255;
+        }
+    });
+}
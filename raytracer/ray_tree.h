@@ -0,0 +1,61 @@
+#pragma once
+
+#include <material.h>
+
+#include <intersection.h>
+#include <ray.h>
+#include <vector.h>
+
+#include <cstddef>
+#include <optional>
+#include <vector>
+
+// Every ray the shading of one pixel traced, for profiling a single pixel.
+
+enum class RayKind { kCamera, kReflection, kRefraction, kShadow };
+
+struct RayTreeNode {
+    RayKind kind = RayKind::kCamera;
+    // index of the ray whose hit spawned this one, -1 for the camera ray
+    int parent = -1;
+    // recursion level of the hit the ray belongs to, 1 for the camera ray
+    int depth = 1;
+    Vector origin;
+    Vector direction;
+    // first hit and its material, shadow rays leave both empty
+    std::optional<Intersection> hit = std::nullopt;
+    const Material* material = nullptr;
+    // shadow rays only: the light and the share of it that reaches the parent hit
+    size_t light = 0;
+    double visibility = 1.0;
+};
+
+// Nodes are kept in the order the rays were traced, so a parent precedes its children.
+struct RayTree {
+    std::vector<RayTreeNode> nodes;
+    // kind and parent of the next ray ShadeHit records
+    RayKind next_kind = RayKind::kCamera;
+    int next_parent = -1;
+
+    int Add(const Ray& ray, int depth, const std::optional<Intersection>& hit,
+            const Material* material) {
+        nodes.push_back({next_kind, next_parent, depth, ray.GetOrigin(), ray.GetDirection(), hit,
+                         material});
+        return static_cast<int>(nodes.size()) - 1;
+    }
+
+    void AddShadowRay(int parent, int depth, const Ray& ray, size_t light, double visibility) {
+        nodes.push_back({RayKind::kShadow, parent, depth, ray.GetOrigin(), ray.GetDirection(),
+                         std::nullopt, nullptr, light, visibility});
+    }
+
+    std::vector<int> GetChildren(int node) const {
+        std::vector<int> children;
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (nodes[i].parent == node) {
+                children.push_back(static_cast<int>(i));
+            }
+        }
+        return children;
+    }
+};
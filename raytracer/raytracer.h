@@ -1,6 +1,12 @@
 #pragma once
 
 #include <image.h>
+#include <frame_buffer.h>
+#include <hdr_image.h>
+#include <pixel_buffer.h>
+#include <visibility.h>
+#include <shadow_map.h>
+#include <ray_tree.h>
 #include <options/camera_options.h>
 #include <options/render_options.h>
 
@@ -8,7 +14,11 @@
 #include <material.h>
 #include <object.h>
 #include <scene.h>
+#include <clustered_scene.h>
+#include <dynamic_scene.h>
+#include <lod_scene.h>
 
+#include <bounding_box.h>
 #include <geometry.h>
 #include <intersection.h>
 #include <ray.h>
@@ -17,8 +27,26 @@
 #include <vector.h>
 #include <cmath>
 
-#include <optional>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <chrono>
 #include <filesystem>
+#include <functional>
+#include <future>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <stop_token>
+#include <thread>
+#include <type_traits>
+#include <variant>
+#include <vector>
 
 const std::array<Vector, 3> LookAt(const Vector& from, const Vector& to, const Vector& up,
                                    const Vector& add_up) {
@@ -51,7 +79,8 @@ const std::array<Vector, 3> LookAt(const Vector& from, const Vector& to, const V
     return m;
 }
 
-Vector Convert(const Vector& direction, const CameraOptions& options, std::array<Vector, 3>& m) {
+Vector Convert(const Vector& direction, const CameraOptions& options,
+               const std::array<Vector, 3>& m) {
     Vector to_return;
     Vector converted;
     converted[0] = 2 * (direction[0] + 0.5) / options.screen_width - 1;
@@ -71,65 +100,179 @@ Vector Convert(const Vector& direction, const CameraOptions& options, std::array
     return to_return;
 }
 
-std::optional<Intersection> SetCorrectNormal(const Ray& ray, std::optional<Intersection>& to_change,
-                                             const Object& object) {
-    Vector barycentric_coords =
-        GetBarycentricCoords(object.polygon, to_change.value().GetPosition());
-    Vector new_normal = *object.GetNormal(0) * barycentric_coords[0] +
-                        *object.GetNormal(1) * barycentric_coords[1] +
-                        *object.GetNormal(2) * barycentric_coords[2];
+HitRecord GetClosestHit(const Ray& ray, const Scene& scene) {
+    std::span<const Object> objects = scene.GetObjects();
+    std::span<const SphereObject> sphere_objects = scene.GetSphereObjects();
 
-    if (DotProduct(new_normal, ray.GetDirection()) > 0) {
-        -new_normal;
+    HitRecord hit;
+    for (size_t i = 0; i < objects.size(); ++i) {
+        UpdateClosestHit(ray, objects[i].polygon, i, &hit);
     }
-
-    return std::make_optional<Intersection>(to_change.value().GetPosition(), new_normal,
-                                            to_change.value().GetDistance());
+    for (size_t i = 0; i < sphere_objects.size(); ++i) {
+        UpdateClosestHit(ray, sphere_objects[i].sphere, i, &hit);
+    }
+    std::span<const PolygonObject> polygon_objects = scene.GetPolygonObjects();
+    for (size_t i = 0; i < polygon_objects.size(); ++i) {
+        UpdateClosestHit(ray, polygon_objects[i].polygon, i, &hit);
+    }
+    return hit;
 }
 
-std::tuple<std::optional<Intersection>, const Material*, bool> GetFirstIntersection(
-    const Ray& ray, const Scene& scene) {
-    std::vector<Object> objects = scene.GetObjects();
-    std::vector<SphereObject> sphere_objects = scene.GetSphereObjects();
-
-    double closest_length = -1;
-    bool flag_not_found_yet = true;
-    std::optional<Intersection> to_return = std::nullopt;
-    const Material* material_to_return = nullptr;
-    size_t use_to_set_correct_normal = 0;
+HitRecord GetClosestHit(const Ray& ray, const ClusteredScene& scene) {
+    HitRecord hit;
+    for (const Cluster& cluster : scene.GetClusters()) {
+        if (!IntersectsBox(ray, cluster.box, hit.distance)) {
+            continue;
+        }
+        std::span<const PackedTriangle> triangles = scene.GetTriangles(cluster);
+        for (size_t i = 0; i < triangles.size(); ++i) {
+            UpdateClosestHit(ray,
+                             Triangle(triangles[i].vertices[0], triangles[i].vertices[1],
+                                      triangles[i].vertices[2]),
+                             cluster.first + i, &hit);
+        }
+    }
+    const std::vector<SphereObject>& sphere_objects = scene.GetSphereObjects();
+    for (size_t i = 0; i < sphere_objects.size(); ++i) {
+        UpdateClosestHit(ray, sphere_objects[i].sphere, i, &hit);
+    }
+    return hit;
+}
 
-    bool is_sphere = false;
+HitRecord GetClosestHit(const Ray& ray, const DynamicScene& scene) {
+    std::span<const BvhNode> nodes = scene.GetNodes();
+    HitRecord hit;
+    thread_local std::vector<uint32_t> stack;
+    stack.assign(1, scene.GetRoot());
+    while (!stack.empty()) {
+        const BvhNode& node = nodes[stack.back()];
+        stack.pop_back();
+        if (node.box.IsEmpty() || !IntersectsBox(ray, node.box, hit.distance)) {
+            continue;
+        }
+        if (!node.IsLeaf()) {
+            stack.push_back(node.right);
+            stack.push_back(node.left);
+            continue;
+        }
+        for (PrimitiveRef ref : node.primitives) {
+            if (ref.kind == PrimitiveKind::kSphere) {
+                UpdateClosestHit(ray, scene.GetSphere(ref.slot).sphere, ref.slot, &hit);
+            } else {
+                UpdateClosestHit(ray, scene.GetObject(ref.slot).polygon, ref.slot, &hit);
+            }
+        }
+    }
+    return hit;
+}
 
-    for (size_t i = 0; i < objects.size(); ++i) {
-        std::optional<Intersection> other = GetIntersection(ray, objects[i].polygon);
-        if ((other.has_value() && other.value().GetDistance() < closest_length) ||
-            (other.has_value() && flag_not_found_yet)) {
-            flag_not_found_yet = false;
-            to_return = other;
-            material_to_return = objects[i].material;
-            use_to_set_correct_normal = i;
-            closest_length = other.value().GetDistance();
+// only the level the current view selected for a mesh is traced
+HitRecord GetClosestHit(const Ray& ray, const LodScene& scene) {
+    std::span<const LodMesh> meshes = scene.GetMeshes();
+    std::span<const LodChunk> chunks = scene.GetChunks();
+    std::span<const Object> objects = scene.GetObjects();
+    HitRecord hit;
+    for (size_t i = 0; i < meshes.size(); ++i) {
+        if (!IntersectsBox(ray, meshes[i].box, hit.distance)) {
+            continue;
         }
+        const LodLevel& level = scene.GetSelectedLevel(i);
+        for (const LodChunk& chunk : chunks.subspan(level.first_chunk, level.chunk_count)) {
+            if (!IntersectsBox(ray, chunk.box, hit.distance)) {
+                continue;
+            }
+            for (uint32_t j = chunk.first; j < chunk.first + chunk.count; ++j) {
+                UpdateClosestHit(ray, objects[j].polygon, j, &hit);
+            }
+        }
+    }
+    std::span<const SphereObject> sphere_objects = scene.GetSphereObjects();
+    for (size_t i = 0; i < sphere_objects.size(); ++i) {
+        UpdateClosestHit(ray, sphere_objects[i].sphere, i, &hit);
     }
+    return hit;
+}
+
+// normal interpolation and material lookup happen here, only for the final hit
+std::tuple<std::optional<Intersection>, const Material*, bool> ResolveHit(
+    const Ray& ray, const HitRecord& hit, const SphereObject& sphere_object) {
+    return std::make_tuple(GetIntersection(ray, hit, sphere_object.sphere),
+                           sphere_object.material.Get(), true);
+}
 
+std::tuple<std::optional<Intersection>, const Material*, bool> ResolveHit(
+    const Ray& ray, const HitRecord& hit, const Object& object) {
     // правильная нормаль в случае, если заданна кастомная
-    if (to_return.has_value() && objects[use_to_set_correct_normal].normals.has_value()) {
-        to_return = SetCorrectNormal(ray, to_return, objects[use_to_set_correct_normal]);
+    if (object.normals.has_value()) {
+        return std::make_tuple(GetInterpolatedIntersection(ray, hit, object.normals.value()),
+                               object.material.Get(), false);
     }
+    return std::make_tuple(GetIntersection(ray, hit, object.polygon), object.material.Get(),
+                           false);
+}
 
-    for (size_t i = 0; i < sphere_objects.size(); ++i) {
-        std::optional<Intersection> other = GetIntersection(ray, sphere_objects[i].sphere);
-        if ((other.has_value() && other.value().GetDistance() < closest_length) ||
-            (other.has_value() && flag_not_found_yet)) {
-            flag_not_found_yet = false;
-            is_sphere = true;
-            to_return = other;
-            material_to_return = sphere_objects[i].material;
-            closest_length = other.value().GetDistance();
-        }
+std::tuple<std::optional<Intersection>, const Material*, bool> ResolveHit(
+    const Ray& ray, const HitRecord& hit, const PolygonObject& polygon_object) {
+    if (polygon_object.normals.has_value()) {
+        return std::make_tuple(GetInterpolatedIntersection(ray, hit, polygon_object.polygon,
+                                                           polygon_object.GetNormals()),
+                               polygon_object.material.Get(), false);
+    }
+    return std::make_tuple(GetIntersection(ray, hit, polygon_object.polygon),
+                           polygon_object.material.Get(), false);
+}
+
+std::tuple<std::optional<Intersection>, const Material*, bool> ResolveHit(
+    const Ray& ray, const HitRecord& hit, const Scene& scene) {
+    if (!hit.IsHit()) {
+        return std::make_tuple(std::nullopt, nullptr, false);
+    }
+    if (hit.kind == PrimitiveKind::kSphere) {
+        return ResolveHit(ray, hit, scene.GetSphereObjects()[hit.primitive]);
+    }
+    if (hit.kind == PrimitiveKind::kPolygon) {
+        return ResolveHit(ray, hit, scene.GetPolygonObjects()[hit.primitive]);
+    }
+    return ResolveHit(ray, hit, scene.GetObjects()[hit.primitive]);
+}
+
+std::tuple<std::optional<Intersection>, const Material*, bool> ResolveHit(
+    const Ray& ray, const HitRecord& hit, const ClusteredScene& scene) {
+    if (!hit.IsHit()) {
+        return std::make_tuple(std::nullopt, nullptr, false);
+    }
+    if (hit.kind == PrimitiveKind::kSphere) {
+        return ResolveHit(ray, hit, scene.GetSphereObjects()[hit.primitive]);
+    }
+    return ResolveHit(ray, hit, scene.GetObject(scene.GetTriangle(hit.primitive)));
+}
+
+std::tuple<std::optional<Intersection>, const Material*, bool> ResolveHit(
+    const Ray& ray, const HitRecord& hit, const DynamicScene& scene) {
+    if (!hit.IsHit()) {
+        return std::make_tuple(std::nullopt, nullptr, false);
+    }
+    if (hit.kind == PrimitiveKind::kSphere) {
+        return ResolveHit(ray, hit, scene.GetSphere(hit.primitive));
+    }
+    return ResolveHit(ray, hit, scene.GetObject(hit.primitive));
+}
+
+std::tuple<std::optional<Intersection>, const Material*, bool> ResolveHit(
+    const Ray& ray, const HitRecord& hit, const LodScene& scene) {
+    if (!hit.IsHit()) {
+        return std::make_tuple(std::nullopt, nullptr, false);
+    }
+    if (hit.kind == PrimitiveKind::kSphere) {
+        return ResolveHit(ray, hit, scene.GetSphereObjects()[hit.primitive]);
     }
+    return ResolveHit(ray, hit, scene.GetObjects()[hit.primitive]);
+}
 
-    return std::make_tuple(to_return, material_to_return, is_sphere);
+template <class SceneType>
+std::tuple<std::optional<Intersection>, const Material*, bool> GetFirstIntersection(
+    const Ray& ray, const SceneType& scene) {
+    return ResolveHit(ray, GetClosestHit(ray, scene), scene);
 }
 
 Vector GetReflected(const Vector& kd, const Vector& i, const Vector& n, const Vector& vl) {
@@ -151,16 +294,290 @@ Vector GetSpecular(const Vector& ks, const Vector& i, double n, const Vector& ve
     return specular_light;
 }
 
-Vector RecursiveCounting(const Scene& scene, const Ray& ray, bool inside_object,
-                         int cur_recursion_level, int recursion_level) {
+// Counters of one render, summed over all tiles.
+struct RenderStats {
+    uint64_t camera_rays = 0;
+    uint64_t secondary_rays = 0;
+    uint64_t shadow_rays = 0;
+    // secondary and shadow rays skipped by path weight pruning, their subtrees not included
+    uint64_t pruned_rays = 0;
+    // shadow rays that had a cached occluder to test first, and those it blocked
+    uint64_t shadow_cache_lookups = 0;
+    uint64_t shadow_cache_hits = 0;
+    // light visibility looked up in shadow maps instead of traced
+    uint64_t shadow_map_lookups = 0;
+    // ray-primitive tests of all rays, bounding box tests not included
+    uint64_t intersection_tests = 0;
+    // deepest recursion level a ray reached, the camera ray is level 1
+    int max_depth = 0;
+
+    RenderStats& operator+=(const RenderStats& other) {
+        camera_rays += other.camera_rays;
+        secondary_rays += other.secondary_rays;
+        shadow_rays += other.shadow_rays;
+        pruned_rays += other.pruned_rays;
+        shadow_cache_lookups += other.shadow_cache_lookups;
+        shadow_cache_hits += other.shadow_cache_hits;
+        shadow_map_lookups += other.shadow_map_lookups;
+        intersection_tests += other.intersection_tests;
+        max_depth = std::max(max_depth, other.max_depth);
+        return *this;
+    }
+
+    double ShadowCacheHitRate() const {
+        return shadow_cache_lookups == 0
+                   ? 0.0
+                   : static_cast<double>(shadow_cache_hits) / shadow_cache_lookups;
+    }
+};
+
+// Last primitive that blocked a shadow ray towards each light. One cache belongs to one
+// render thread and one scene, neighbouring pixels usually share their occluders.
+struct ShadowCache {
+    struct Occluder {
+        PrimitiveKind kind = PrimitiveKind::kNone;
+        size_t primitive = 0;
+    };
+
+    Occluder& Get(size_t light) {
+        if (light >= occluders.size()) {
+            occluders.resize(light + 1);
+        }
+        return occluders[light];
+    }
+
+    std::vector<Occluder> occluders;
+};
+
+bool UpdateClosestHit(const Ray& ray, const Scene& scene, PrimitiveKind kind, size_t primitive,
+                      HitRecord* hit) {
+    if (kind == PrimitiveKind::kSphere) {
+        return UpdateClosestHit(ray, scene.GetSphereObjects()[primitive].sphere, primitive, hit);
+    }
+    if (kind == PrimitiveKind::kPolygon) {
+        return UpdateClosestHit(ray, scene.GetPolygonObjects()[primitive].polygon, primitive,
+                                hit);
+    }
+    return UpdateClosestHit(ray, scene.GetObjects()[primitive].polygon, primitive, hit);
+}
+
+bool UpdateClosestHit(const Ray& ray, const ClusteredScene& scene, PrimitiveKind kind,
+                      size_t primitive, HitRecord* hit) {
+    if (kind == PrimitiveKind::kSphere) {
+        return UpdateClosestHit(ray, scene.GetSphereObjects()[primitive].sphere, primitive, hit);
+    }
+    const PackedTriangle& triangle = scene.GetTriangle(primitive);
+    return UpdateClosestHit(
+        ray, Triangle(triangle.vertices[0], triangle.vertices[1], triangle.vertices[2]),
+        primitive, hit);
+}
+
+bool UpdateClosestHit(const Ray& ray, const DynamicScene& scene, PrimitiveKind kind,
+                      size_t primitive, HitRecord* hit) {
+    if (kind == PrimitiveKind::kSphere) {
+        return UpdateClosestHit(ray, scene.GetSphere(primitive).sphere, primitive, hit);
+    }
+    return UpdateClosestHit(ray, scene.GetObject(primitive).polygon, primitive, hit);
+}
+
+bool UpdateClosestHit(const Ray& ray, const LodScene& scene, PrimitiveKind kind, size_t primitive,
+                      HitRecord* hit) {
+    if (kind == PrimitiveKind::kSphere) {
+        return UpdateClosestHit(ray, scene.GetSphereObjects()[primitive].sphere, primitive, hit);
+    }
+    return UpdateClosestHit(ray, scene.GetObjects()[primitive].polygon, primitive, hit);
+}
+
+// Scene properties the render kernels are specialized on. The defaults describe a scene
+// about which nothing is known, kernels built for them handle everything.
+struct SceneFeatures {
+    bool spheres = true;
+    bool normals = true;
+    bool refraction = true;
+};
+
+template <class SceneType>
+SceneFeatures GetSceneFeatures(const SceneType&) {
+    return {};
+}
+
+SceneFeatures GetSceneFeatures(const Scene& scene) {
+    SceneFeatures features{!scene.GetSphereObjects().empty(), false, false};
+    for (const Object& object : scene.GetObjects()) {
+        if (object.normals.has_value()) {
+            features.normals = true;
+            break;
+        }
+    }
+    for (const PolygonObject& object : scene.GetPolygonObjects()) {
+        features.normals = features.normals || object.normals.has_value();
+    }
+    for (const auto& [name, material] : scene.GetMaterials()) {
+        features.refraction = features.refraction || material.albedo[2] != 0.0;
+    }
+    return features;
+}
+
+// Compile-time shape of a render kernel: branches for absent features are dropped,
+// a nonzero depth replaces RenderOptions::depth with a constant.
+struct KernelConfig {
+    RenderMode mode = RenderMode::kFull;
+    bool spheres = true;
+    bool normals = true;
+    bool refraction = true;
+    int depth = 0;
+};
+
+template <KernelConfig kConfig, class SceneType>
+HitRecord KernelClosestHit(const Ray& ray, const SceneType& scene) {
+    if constexpr (std::is_same_v<SceneType, Scene> && !kConfig.spheres) {
+        std::span<const Object> objects = scene.GetObjects();
+        HitRecord hit;
+        for (size_t i = 0; i < objects.size(); ++i) {
+            UpdateClosestHit(ray, objects[i].polygon, i, &hit);
+        }
+        std::span<const PolygonObject> polygon_objects = scene.GetPolygonObjects();
+        for (size_t i = 0; i < polygon_objects.size(); ++i) {
+            UpdateClosestHit(ray, polygon_objects[i].polygon, i, &hit);
+        }
+        return hit;
+    } else {
+        return GetClosestHit(ray, scene);
+    }
+}
+
+// GetFirstIntersection of a kernel, primary is a hit found by RasterizeTile
+template <KernelConfig kConfig, class SceneType>
+std::tuple<std::optional<Intersection>, const Material*, bool> KernelIntersection(
+    const Ray& ray, const SceneType& scene, const HitRecord* primary = nullptr,
+    RenderStats* stats = nullptr) {
+    HitRecord hit = primary != nullptr ? *primary : KernelClosestHit<kConfig>(ray, scene);
+    if (stats != nullptr) {
+        stats->intersection_tests += hit.tests;
+    }
+    if constexpr (std::is_same_v<SceneType, Scene>) {
+        if (!hit.IsHit()) {
+            return std::make_tuple(std::nullopt, nullptr, false);
+        }
+        if constexpr (kConfig.spheres) {
+            if (hit.kind == PrimitiveKind::kSphere) {
+                return ResolveHit(ray, hit, scene.GetSphereObjects()[hit.primitive]);
+            }
+        }
+        if (hit.kind == PrimitiveKind::kPolygon) {
+            const PolygonObject& object = scene.GetPolygonObjects()[hit.primitive];
+            if constexpr (kConfig.normals) {
+                return ResolveHit(ray, hit, object);
+            } else {
+                return std::make_tuple(std::optional<Intersection>(
+                                           GetIntersection(ray, hit, object.polygon)),
+                                       object.material.Get(), false);
+            }
+        }
+        const Object& object = scene.GetObjects()[hit.primitive];
+        if constexpr (kConfig.normals) {
+            return ResolveHit(ray, hit, object);
+        } else {
+            return std::make_tuple(std::optional<Intersection>(
+                                       GetIntersection(ray, hit, object.polygon)),
+                                   object.material.Get(), false);
+        }
+    } else {
+        return ResolveHit(ray, hit, scene);
+    }
+}
+
+// A point is lit when the first hit of the ray from the light is the point itself. The
+// cached occluder only short-circuits when it is hit clearly before the point, so the
+// answer is the same as without the cache.
+template <KernelConfig kConfig = KernelConfig{}, class SceneType>
+bool IsShadowed(const SceneType& scene, const Ray& ray, const Vector& position, size_t light,
+                ShadowCache* cache, RenderStats* stats) {
+    const double epsilon = 0.0001;
+    ShadowCache::Occluder* occluder = cache != nullptr ? &cache->Get(light) : nullptr;
+    if (occluder != nullptr && occluder->kind != PrimitiveKind::kNone) {
+        ++stats->shadow_cache_lookups;
+        HitRecord hit;
+        // a hit this far before the point differs from it by more than epsilon on some axis
+        hit.distance = Length(position - ray.GetOrigin()) - 4 * epsilon;
+        bool blocked = hit.distance > 0 &&
+                       UpdateClosestHit(ray, scene, occluder->kind, occluder->primitive, &hit);
+        stats->intersection_tests += hit.tests;
+        if (blocked) {
+            ++stats->shadow_cache_hits;
+            return true;
+        }
+    }
+
+    HitRecord hit = KernelClosestHit<kConfig>(ray, scene);
+    stats->intersection_tests += hit.tests;
+    if (!hit.IsHit()) {
+        return false;
+    }
+    Vector hit_position = ray.GetOrigin() + ray.GetDirection() * hit.distance;
+    bool shadowed = std::abs(hit_position[0] - position[0]) > epsilon ||
+                    std::abs(hit_position[1] - position[1]) > epsilon ||
+                    std::abs(hit_position[2] - position[2]) > epsilon;
+    if (shadowed && occluder != nullptr) {
+        *occluder = {hit.kind, hit.primitive};
+    }
+    return shadowed;
+}
+
+template <KernelConfig kConfig, class SceneType>
+Vector ShadeHit(const SceneType& scene, const Ray& ray,
+                const std::tuple<std::optional<Intersection>, const Material*, bool>&
+                    intersec_result,
+                bool inside_object, int cur_recursion_level, int recursion_level,
+                double path_weight, double min_path_weight, RenderStats* stats,
+                ShadowCache* shadow_cache, const ShadowMaps* shadow_maps,
+                RayTree* ray_tree = nullptr);
+
+// path_weight is the product of the albedo factors applied to this ray on its way from
+// the camera, branches that would contribute less than min_path_weight are not traced
+template <class SceneType>
+Vector RecursiveCounting(const SceneType& scene, const Ray& ray, bool inside_object,
+                         int cur_recursion_level, int recursion_level, double path_weight = 1.0,
+                         double min_path_weight = 0.0, RenderStats* stats = nullptr,
+                         ShadowCache* shadow_cache = nullptr,
+                         const ShadowMaps* shadow_maps = nullptr) {
+    return ShadeHit<KernelConfig{}>(
+        scene, ray, KernelIntersection<KernelConfig{}>(ray, scene, nullptr, stats),
+        inside_object, cur_recursion_level, recursion_level, path_weight, min_path_weight, stats,
+        shadow_cache, shadow_maps);
+}
+
+// lighting and secondary rays of a hit that is already found, with a ray_tree every
+// traced ray is recorded into it
+template <KernelConfig kConfig, class SceneType>
+Vector ShadeHit(const SceneType& scene, const Ray& ray,
+                const std::tuple<std::optional<Intersection>, const Material*, bool>&
+                    intersec_result,
+                bool inside_object, int cur_recursion_level, int recursion_level,
+                double path_weight, double min_path_weight, RenderStats* stats,
+                ShadowCache* shadow_cache, const ShadowMaps* shadow_maps, RayTree* ray_tree) {
     double epsilon = 0.0001;
     cur_recursion_level++;
-    auto intersec_result = GetFirstIntersection(ray, scene);
+    RenderStats unused_stats;
+    if (stats == nullptr) {
+        stats = &unused_stats;
+    }
+    stats->max_depth = std::max(stats->max_depth, cur_recursion_level);
+    auto should_trace = [&](double albedo) {
+        if (albedo == 0.0 || path_weight * albedo < min_path_weight) {
+            ++stats->pruned_rays;
+            return false;
+        }
+        ++stats->secondary_rays;
+        return true;
+    };
     Vector ve = ray.GetDirection();
     -ve;
     std::optional<Intersection> intersection = std::get<0>(intersec_result);
     const Material* material = std::get<1>(intersec_result);
     bool is_sphere = std::get<2>(intersec_result);
+    const int node =
+        ray_tree != nullptr ? ray_tree->Add(ray, cur_recursion_level, intersection, material) : -1;
 
     if (!intersection.has_value() || material == nullptr) {
         return Vector(0, 0, 0);
@@ -168,7 +585,15 @@ Vector RecursiveCounting(const Scene& scene, const Ray& ray, bool inside_object,
 
     Vector output = material->ambient_color + material->intensity;
 
-    for (Light light : scene.GetLights()) {
+    if (material->albedo[0] == 0.0) {
+        stats->pruned_rays += scene.GetLights().size();
+    }
+    const auto& lights = scene.GetLights();
+    for (size_t light_index = 0; light_index < lights.size(); ++light_index) {
+        if (material->albedo[0] == 0.0) {
+            break;
+        }
+        const Light& light = lights[light_index];
         Vector vl = light.position - intersection.value().GetPosition();
         vl.Normalize();
 
@@ -178,14 +603,24 @@ Vector RecursiveCounting(const Scene& scene, const Ray& ray, bool inside_object,
         temp_vl[2] = vl[2];
         -temp_vl;
 
-        auto intersec_with_light =
-            std::get<0>(GetFirstIntersection(Ray(light.position, temp_vl), scene));
-        if (std::abs(intersec_with_light.value().GetPosition()[0] -
-                     intersection.value().GetPosition()[0]) > epsilon ||
-            std::abs(intersec_with_light.value().GetPosition()[1] -
-                     intersection.value().GetPosition()[1]) > epsilon ||
-            std::abs(intersec_with_light.value().GetPosition()[2] -
-                     intersection.value().GetPosition()[2]) > epsilon) {
+        double visibility = 1.0;
+        if (shadow_maps != nullptr) {
+            ++stats->shadow_map_lookups;
+            visibility = shadow_maps->Visibility(light_index, intersection.value().GetPosition(),
+                                                 intersection.value().GetNormal());
+        } else {
+            ++stats->shadow_rays;
+            if (IsShadowed<kConfig>(scene, Ray(light.position, temp_vl),
+                                    intersection.value().GetPosition(), light_index,
+                                    shadow_cache, stats)) {
+                visibility = 0.0;
+            }
+        }
+        if (ray_tree != nullptr) {
+            ray_tree->AddShadowRay(node, cur_recursion_level, Ray(light.position, temp_vl),
+                                   light_index, visibility);
+        }
+        if (visibility == 0.0) {
             continue;
         }
 
@@ -193,70 +628,56 @@ Vector RecursiveCounting(const Scene& scene, const Ray& ray, bool inside_object,
 
         output = output + GetReflected(material->diffuse_color, light.intensity,
                                        intersection.value().GetNormal(), vl) *
-                              material->albedo[0];
+                              (material->albedo[0] * visibility);
         output = output + GetSpecular(material->specular_color, light.intensity,
                                       material->specular_exponent, ve, vr) *
-                              material->albedo[0];
-    }
-
-    if (cur_recursion_level != recursion_level) {
-        if (inside_object && is_sphere) {
-            // 4/3?? discussible
-            std::optional<Vector> refracted =
-                Refract(ray.GetDirection(), intersection.value().GetNormal(),
-                        material->refraction_index / 1.0);
-            if (refracted.has_value()) {
-                output =
-                    output + RecursiveCounting(scene,
-                                               Ray(intersection.value().GetPosition() -
-                                                       intersection.value().GetNormal() * epsilon,
-                                                   refracted.value()),
-                                               false, cur_recursion_level, recursion_level);
+                              (material->albedo[0] * visibility);
+    }
+
+    if (cur_recursion_level != (kConfig.depth > 0 ? kConfig.depth : recursion_level)) {
+        const Vector& position = intersection.value().GetPosition();
+        const Vector& normal = intersection.value().GetNormal();
+        auto trace = [&](const Ray& next, bool next_inside, double albedo, RayKind kind) {
+            if (ray_tree != nullptr) {
+                ray_tree->next_kind = kind;
+                ray_tree->next_parent = node;
+            }
+            return ShadeHit<kConfig>(scene, next,
+                                     KernelIntersection<kConfig>(next, scene, nullptr, stats),
+                                     next_inside, cur_recursion_level, recursion_level,
+                                     path_weight * albedo, min_path_weight, stats,
+                                     shadow_cache, shadow_maps, ray_tree);
+        };
+
+        if constexpr (kConfig.spheres && kConfig.refraction) {
+            if (inside_object && is_sphere) {
+                // 4/3?? discussible
+                std::optional<Vector> refracted =
+                    Refract(ray.GetDirection(), normal, material->refraction_index / 1.0);
+                if (refracted.has_value() && should_trace(1.0)) {
+                    output = output + trace(Ray(position - normal * epsilon, refracted.value()),
+                                            false, 1.0, RayKind::kRefraction);
+                }
             }
-        } else if (!inside_object && is_sphere) {
-            output =
-                output + RecursiveCounting(
-                             scene,
-                             Ray(intersection.value().GetPosition() +
-                                     intersection.value().GetNormal() * epsilon,
-                                 Reflect(ray.GetDirection(), intersection.value().GetNormal())),
-                             false, cur_recursion_level, recursion_level) *
-                             material->albedo[1];
-
-            std::optional<Vector> refracted =
-                Refract(ray.GetDirection(), intersection.value().GetNormal(),
-                        1.0 / material->refraction_index);
-            if (refracted.has_value()) {
-                output =
-                    output + RecursiveCounting(scene,
-                                               Ray(intersection.value().GetPosition() -
-                                                       intersection.value().GetNormal() * epsilon,
-                                                   refracted.value()),
-                                               true, cur_recursion_level, recursion_level) *
-                                 material->albedo[2];
+        }
+        if (!inside_object) {
+            if (should_trace(material->albedo[1])) {
+                output = output + trace(Ray(position + normal * epsilon,
+                                            Reflect(ray.GetDirection(), normal)),
+                                        false, material->albedo[1], RayKind::kReflection) *
+                                      material->albedo[1];
             }
-        } else if (!inside_object && !is_sphere) {
-            output =
-                output + RecursiveCounting(
-                             scene,
-                             Ray(intersection.value().GetPosition() +
-                                     intersection.value().GetNormal() * epsilon,
-                                 Reflect(ray.GetDirection(), intersection.value().GetNormal())),
-                             false, cur_recursion_level, recursion_level) *
-                             material->albedo[1];
-
-            // 1.0?? discussible
-            std::optional<Vector> refracted =
-                Refract(ray.GetDirection(), intersection.value().GetNormal(),
-                        1.0 / material->refraction_index);
-            if (refracted.has_value()) {
-                output =
-                    output + RecursiveCounting(scene,
-                                               Ray(intersection.value().GetPosition() -
-                                                       intersection.value().GetNormal() * epsilon,
-                                                   refracted.value()),
-                                               false, cur_recursion_level, recursion_level) *
-                                 material->albedo[2];
+
+            if constexpr (kConfig.refraction) {
+                // 1.0?? discussible for triangles, spheres are entered
+                std::optional<Vector> refracted =
+                    Refract(ray.GetDirection(), normal, 1.0 / material->refraction_index);
+                if (refracted.has_value() && should_trace(material->albedo[2])) {
+                    output = output + trace(Ray(position - normal * epsilon, refracted.value()),
+                                            kConfig.spheres && is_sphere, material->albedo[2],
+                                            RayKind::kRefraction) *
+                                          material->albedo[2];
+                }
             }
         }
     }
@@ -264,8 +685,7 @@ Vector RecursiveCounting(const Scene& scene, const Ray& ray, bool inside_object,
     return output;
 }
 
-Image Render(const std::filesystem::path& path, const CameraOptions& camera_options,
-             const RenderOptions& render_options) {
+std::array<Vector, 3> GetCameraMatrix(const CameraOptions& camera_options) {
     Vector add_up;
     if (camera_options.look_from[0] == 0.0 && camera_options.look_from[1] == 2.0 &&
         camera_options.look_from[2] == 0.0) {
@@ -273,127 +693,737 @@ Image Render(const std::filesystem::path& path, const CameraOptions& camera_opti
     } else {
         add_up[2] = 1;
     }
+    return LookAt(camera_options.look_from, camera_options.look_to, Vector(0, 1, 0), add_up);
+}
 
-    Image output(camera_options.screen_width, camera_options.screen_height);
-    Scene scene = ReadScene(path);
+// level selection of a LodScene for the pixels of this camera
+LodView GetLodView(const CameraOptions& camera_options, double tolerance = 1.0) {
+    return {camera_options.look_from, 2 * std::tan(camera_options.fov / 2) /
+                                          camera_options.screen_height,
+            tolerance};
+}
 
-    std::array<Vector, 3> m =
-        LookAt(camera_options.look_from, camera_options.look_to, Vector(0, 1, 0), add_up);
+// Visibility buffer of one tile: every binned primitive is tested only against the camera
+// rays of the pixels its screen rectangle covers, in the order GetClosestHit uses.
+std::vector<HitRecord> RasterizeTile(const Scene& scene, const ScreenBins& bins,
+                                     const std::vector<Ray>& rays, const Tile& tile) {
+    std::vector<HitRecord> hits(rays.size());
+    const size_t bin =
+        static_cast<size_t>(tile.y / bins.tile_size) * bins.tiles_x + tile.x / bins.tile_size;
+    auto scan = [&](const ScreenRect& rect, const auto& primitive, uint32_t index) {
+        int x0 = std::max(rect.x0, tile.x);
+        int x1 = std::min(rect.x1, tile.x + tile.width - 1);
+        int y0 = std::max(rect.y0, tile.y);
+        int y1 = std::min(rect.y1, tile.y + tile.height - 1);
+        for (int i = y0; i <= y1; ++i) {
+            for (int j = x0; j <= x1; ++j) {
+                size_t pixel = static_cast<size_t>(i - tile.y) * tile.width + (j - tile.x);
+                UpdateClosestHit(rays[pixel], primitive, index, &hits[pixel]);
+            }
+        }
+    };
+    std::span<const Object> objects = scene.GetObjects();
+    for (uint32_t index : bins.triangles[bin]) {
+        scan(bins.triangle_rects[index], objects[index].polygon, index);
+    }
+    std::span<const SphereObject> spheres = scene.GetSphereObjects();
+    for (uint32_t index : bins.spheres[bin]) {
+        scan(bins.sphere_rects[index], spheres[index].sphere, index);
+    }
+    std::span<const PolygonObject> polygons = scene.GetPolygonObjects();
+    for (uint32_t index : bins.polygons[bin]) {
+        scan(bins.polygon_rects[index], polygons[index].polygon, index);
+    }
+    return hits;
+}
 
-    if (render_options.mode == RenderMode::kDepth) {
-        double to_normalize_pixels = 0;
+// work of one pixel for RenderMode::kHeatmap, the stats of its shading without the camera ray
+double GetHeatmapValue(const RenderStats& pixel_stats, HeatmapMetric metric) {
+    switch (metric) {
+        case HeatmapMetric::kIntersectionTests:
+            return static_cast<double>(pixel_stats.intersection_tests);
+        case HeatmapMetric::kRays:
+            return static_cast<double>(1 + pixel_stats.secondary_rays + pixel_stats.shadow_rays);
+        case HeatmapMetric::kDepth:
+            return pixel_stats.max_depth;
+    }
+    return 0.0;
+}
 
-        for (int i = 0; i < camera_options.screen_height; ++i) {
-            for (int j = 0; j < camera_options.screen_width; ++j) {
-                Vector direction = Convert(Vector(j, i, -1), camera_options, m);
-                std::optional<Intersection> intersection = std::get<0>(
-                    GetFirstIntersection(Ray(camera_options.look_from, direction), scene));
-                if (intersection.has_value() &&
-                    intersection.value().GetDistance() > to_normalize_pixels) {
-                    to_normalize_pixels = intersection.value().GetDistance();
+// Pixel loop of one kernel. With bins (only built for a Scene) the primary hits come
+// from RasterizeTile, everything after the first hit is traced as usual.
+template <KernelConfig kConfig, class SceneType>
+void TraceTileKernel(const SceneType& scene, const CameraOptions& camera_options,
+                     const RenderOptions& render_options, const std::array<Vector, 3>& m,
+                     const Tile& tile, FrameBuffer* frame, RenderStats* stats,
+                     const ScreenBins* bins, ShadowCache* shadow_cache,
+                     const ShadowMaps* shadow_maps) {
+    RenderStats tile_stats;
+    std::vector<Ray> rays;
+    std::vector<HitRecord> primary;
+    if constexpr (std::is_same_v<SceneType, Scene>) {
+        if (bins != nullptr) {
+            rays.reserve(static_cast<size_t>(tile.width) * tile.height);
+            for (int i = tile.y; i < tile.y + tile.height; ++i) {
+                for (int j = tile.x; j < tile.x + tile.width; ++j) {
+                    rays.emplace_back(camera_options.look_from,
+                                      Convert(Vector(j, i, -1), camera_options, m));
                 }
             }
+            primary = RasterizeTile(scene, *bins, rays, tile);
         }
+    }
 
-        for (int i = 0; i < camera_options.screen_height; ++i) {
-            for (int j = 0; j < camera_options.screen_width; ++j) {
-                Vector direction = Convert(Vector(j, i, -1), camera_options, m);
+    size_t pixel = 0;
+    for (int i = tile.y; i < tile.y + tile.height; ++i) {
+        for (int j = tile.x; j < tile.x + tile.width; ++j, ++pixel) {
+            ++tile_stats.camera_rays;
+            const HitRecord* primary_hit = primary.empty() ? nullptr : &primary[pixel];
+            Ray ray = rays.empty()
+                          ? Ray(camera_options.look_from,
+                                Convert(Vector(j, i, -1), camera_options, m))
+                          : rays[pixel];
+            if constexpr (kConfig.mode == RenderMode::kDepth) {
+                HitRecord hit =
+                    primary_hit != nullptr ? *primary_hit : KernelClosestHit<kConfig>(ray, scene);
+                tile_stats.intersection_tests += hit.tests;
+                tile_stats.max_depth = std::max(tile_stats.max_depth, 1);
+                if (hit.IsHit()) {
+                    frame->Set(i, j, Vector(hit.distance, hit.distance, hit.distance));
+                }
+            } else if constexpr (kConfig.mode == RenderMode::kNormal) {
                 std::optional<Intersection> intersection = std::get<0>(
-                    GetFirstIntersection(Ray(camera_options.look_from, direction), scene));
+                    KernelIntersection<kConfig>(ray, scene, primary_hit, &tile_stats));
+                tile_stats.max_depth = std::max(tile_stats.max_depth, 1);
                 if (intersection.has_value()) {
-                    int val = static_cast<int>(
-                        std::floor(intersection.value().GetDistance() / to_normalize_pixels * 256));
-                    if (val == 256) {
-                        val = 255;
-                    }
-                    output.SetPixel(RGB{val, val, val}, i, j);
-                } else {
-                    output.SetPixel(RGB{255, 255, 255}, i, j);
+                    frame->Set(i, j, intersection.value().GetNormal());
+                }
+            } else if constexpr (kConfig.mode == RenderMode::kHeatmap) {
+                RenderStats pixel_stats;
+                ShadeHit<kConfig>(scene, ray,
+                                  KernelIntersection<kConfig>(ray, scene, primary_hit,
+                                                              &pixel_stats),
+                                  false, 0, render_options.depth, 1.0,
+                                  render_options.min_path_weight, &pixel_stats, shadow_cache,
+                                  shadow_maps);
+                double value = GetHeatmapValue(pixel_stats, render_options.heatmap);
+                frame->Set(i, j, Vector(value, value, value));
+                tile_stats += pixel_stats;
+            } else {
+                Vector result = ShadeHit<kConfig>(
+                    scene, ray,
+                    KernelIntersection<kConfig>(ray, scene, primary_hit, &tile_stats), false, 0,
+                    render_options.depth, 1.0, render_options.min_path_weight, &tile_stats,
+                    shadow_cache, shadow_maps);
+                if (result[0] != 0.0 || result[1] != 0.0 || result[2] != 0.0) {
+                    frame->Set(i, j, result);
                 }
             }
         }
-    } else if (render_options.mode == RenderMode::kNormal) {
-        for (int i = 0; i < camera_options.screen_height; ++i) {
-            for (int j = 0; j < camera_options.screen_width; ++j) {
-                Vector direction = Convert(Vector(j, i, -1), camera_options, m);
-                std::optional<Intersection> intersection = std::get<0>(
-                    GetFirstIntersection(Ray(camera_options.look_from, direction), scene));
-                if (intersection.has_value()) {
-                    Vector normal = intersection.value().GetNormal();
-                    int x = static_cast<int>(std::floor((normal[0] / 2 + 0.5) * 256));
-                    if (x == 256) {
-                        x = 255;
-                    }
-                    int y = static_cast<int>(std::floor((normal[1] / 2 + 0.5) * 256));
-                    if (y == 256) {
-                        y = 255;
+    }
+    if (stats != nullptr) {
+        *stats += tile_stats;
+    }
+}
+
+template <class SceneType>
+using TileKernel = void (*)(const SceneType&, const CameraOptions&, const RenderOptions&,
+                            const std::array<Vector, 3>&, const Tile&, FrameBuffer*,
+                            RenderStats*, const ScreenBins*, ShadowCache*, const ShadowMaps*);
+
+namespace kernel_detail {
+
+template <class SceneType, KernelConfig kConfig>
+TileKernel<SceneType> SelectDepth(int depth) {
+    auto with_depth = []<int kDepth>() {
+        return &TraceTileKernel<KernelConfig{kConfig.mode, kConfig.spheres, kConfig.normals,
+                                             kConfig.refraction, kDepth},
+                                SceneType>;
+    };
+    if constexpr (kConfig.mode == RenderMode::kFull) {
+        switch (depth) {
+            case 1:
+                return with_depth.template operator()<1>();
+            case 2:
+                return with_depth.template operator()<2>();
+            case 3:
+                return with_depth.template operator()<3>();
+            case 4:
+                return with_depth.template operator()<4>();
+        }
+    }
+    return &TraceTileKernel<kConfig, SceneType>;
+}
+
+// Only a Scene reports its features, other scene types get the general kernel of the
+// mode. Depth and normal passes never shade, refraction does not matter to them. A heatmap
+// shades exactly like a full render to count its work.
+template <class SceneType, RenderMode kMode>
+TileKernel<SceneType> SelectFeatures(const SceneFeatures& features, int depth) {
+    if constexpr (!std::is_same_v<SceneType, Scene>) {
+        return SelectDepth<SceneType, KernelConfig{kMode}>(depth);
+    } else {
+        auto with_refraction = [&]<bool kSpheres, bool kNormals>() {
+            if (kMode == RenderMode::kDepth || kMode == RenderMode::kNormal ||
+                features.refraction) {
+                return SelectDepth<SceneType, KernelConfig{kMode, kSpheres, kNormals, true}>(
+                    depth);
+            }
+            return SelectDepth<SceneType, KernelConfig{kMode, kSpheres, kNormals, false}>(depth);
+        };
+        auto with_normals = [&]<bool kSpheres>() {
+            if (kMode == RenderMode::kDepth || features.normals) {
+                return with_refraction.template operator()<kSpheres, true>();
+            }
+            return with_refraction.template operator()<kSpheres, false>();
+        };
+        if (features.spheres) {
+            return with_normals.template operator()<true>();
+        }
+        return with_normals.template operator()<false>();
+    }
+}
+
+}  // namespace kernel_detail
+
+// Picks the kernel instantiation for a render once, so the per-pixel loops do not branch
+// on the mode, on absent scene features or on a small recursion depth.
+template <class SceneType>
+TileKernel<SceneType> SelectTileKernel(const SceneFeatures& features,
+                                       const RenderOptions& render_options) {
+    using namespace kernel_detail;
+    switch (render_options.mode) {
+        case RenderMode::kDepth:
+            return SelectFeatures<SceneType, RenderMode::kDepth>(features, render_options.depth);
+        case RenderMode::kNormal:
+            return SelectFeatures<SceneType, RenderMode::kNormal>(features, render_options.depth);
+        case RenderMode::kHeatmap:
+            return SelectFeatures<SceneType, RenderMode::kHeatmap>(features, render_options.depth);
+        case RenderMode::kFull:
+            break;
+    }
+    return SelectFeatures<SceneType, RenderMode::kFull>(features, render_options.depth);
+}
+
+// Renders one tile with the kernel for the mode and depth, assuming every scene feature.
+template <class SceneType>
+void TraceTile(const SceneType& scene, const CameraOptions& camera_options,
+               const RenderOptions& render_options, const std::array<Vector, 3>& m,
+               const Tile& tile, FrameBuffer* frame, RenderStats* stats = nullptr,
+               const ScreenBins* bins = nullptr, ShadowCache* shadow_cache = nullptr,
+               const ShadowMaps* shadow_maps = nullptr) {
+    SelectTileKernel<SceneType>(SceneFeatures{}, render_options)(
+        scene, camera_options, render_options, m, tile, frame, stats, bins, shadow_cache,
+        shadow_maps);
+}
+
+// The pixels of the frame a render traces, the whole frame unless a crop is set. Also
+// rejects a fixed normalization the pixels could not be divided by.
+CropWindow GetRenderWindow(const CameraOptions& camera_options,
+                           const RenderOptions& render_options) {
+    if (camera_options.screen_width < 0 || camera_options.screen_height < 0) {
+        throw std::invalid_argument("Negative screen size");
+    }
+    if (render_options.normalization.has_value() &&
+        !(std::isfinite(render_options.normalization.value()) &&
+          render_options.normalization.value() > 0)) {
+        throw std::invalid_argument("Normalization must be finite and positive");
+    }
+    if (!render_options.crop.has_value()) {
+        return CropWindow{0, 0, camera_options.screen_width, camera_options.screen_height};
+    }
+    const CropWindow& crop = render_options.crop.value();
+    if (crop.width <= 0 || crop.height <= 0 || crop.x < 0 || crop.y < 0 ||
+        crop.x + crop.width > camera_options.screen_width ||
+        crop.y + crop.height > camera_options.screen_height) {
+        throw std::invalid_argument("Crop window is outside the frame");
+    }
+    return crop;
+}
+
+int GetThreadCount(const RenderOptions& render_options, size_t task_count) {
+    size_t threads = render_options.threads > 0
+                         ? static_cast<size_t>(render_options.threads)
+                         : std::max<size_t>(1, std::thread::hardware_concurrency());
+    return static_cast<int>(std::max<size_t>(1, std::min(threads, task_count)));
+}
+
+class RenderCancelled : public std::runtime_error {
+public:
+    RenderCancelled() : std::runtime_error("Render was cancelled") {
+    }
+};
+
+// Called from the render threads. on_tile may read the raw values inside the finished tile,
+// they are not normalized yet since the normalization needs the whole frame.
+struct RenderCallbacks {
+    std::function<void(size_t frame, const Tile& tile, const FrameBuffer& buffer)> on_tile = nullptr;
+    std::function<void(size_t tiles_done, size_t tiles_total)> on_progress = nullptr;
+    // the finished frame before it is normalized into an Image
+    std::function<void(size_t frame, const FrameBuffer& buffer)> on_frame_buffer = nullptr;
+    // called once from the calling thread after every frame was delivered
+    std::function<void(const RenderStats& stats)> on_finish = nullptr;
+};
+
+// The maps render_options.shadow_maps asks for, none if it is unset or the mode does not
+// shade with lights.
+template <class SceneType>
+std::optional<ShadowMaps> BuildShadowMaps(const SceneType& scene,
+                                          const RenderOptions& render_options) {
+    if (!render_options.shadow_maps.has_value() || (render_options.mode != RenderMode::kFull &&
+                                                    render_options.mode != RenderMode::kHeatmap)) {
+        return std::nullopt;
+    }
+    TraceSpan span("shadow maps");
+    const int threads = GetThreadCount(render_options, scene.GetLights().size() * 6);
+    if constexpr (std::is_same_v<SceneType, Scene>) {
+        return RasterizeShadowMaps(render_options.shadow_maps.value(), scene, threads);
+    } else {
+        return CastShadowMaps(render_options.shadow_maps.value(), scene.GetLights(), threads,
+                              [&scene](const Ray& ray) { return GetClosestHit(ray, scene); });
+    }
+}
+
+namespace render_detail {
+
+// RenderFrames with the output of a finished frame made by convert on the render thread
+// that finished it, on_frame gets the outputs in camera order.
+template <class SceneType, class Output>
+void RenderFrames(const SceneType& scene, const std::vector<CameraOptions>& cameras,
+                  const RenderOptions& render_options,
+                  const std::function<Output(size_t, const FrameBuffer&)>& convert,
+                  const std::function<void(size_t, Output&&)>& on_frame,
+                  const RenderCallbacks& callbacks, std::stop_token stop_token) {
+    struct FrameState {
+        std::vector<Tile> tiles;
+        std::array<Vector, 3> m;
+        FrameBuffer buffer;
+        std::atomic<size_t> tiles_left;
+        std::optional<ScreenBins> bins;
+    };
+
+    std::vector<size_t> first_task(cameras.size() + 1, 0);
+    for (size_t frame = 0; frame < cameras.size(); ++frame) {
+        const CropWindow window = GetRenderWindow(cameras[frame], render_options);
+        first_task[frame + 1] =
+            first_task[frame] + SplitIntoTiles(window, render_options.tile_size).size();
+    }
+    const size_t task_count = first_task.back();
+    const int thread_count = GetThreadCount(render_options, task_count);
+    const size_t frames_in_flight = static_cast<size_t>(thread_count) + 1;
+
+    std::vector<std::unique_ptr<FrameState>> frames(cameras.size());
+    std::vector<bool> preparing(cameras.size(), false);
+    std::vector<std::optional<Output>> ready(cameras.size());
+    std::atomic<size_t> next_task = 0;
+    std::atomic<size_t> tiles_done = 0;
+    size_t delivered = 0;
+    bool failed = false;
+    std::exception_ptr error;
+    std::mutex mutex;
+    std::condition_variable cv;
+
+    auto fail = [&](std::exception_ptr exception) {
+        std::lock_guard lock(mutex);
+        if (!failed) {
+            failed = true;
+            error = exception;
+        }
+        cv.notify_all();
+    };
+    std::stop_callback on_stop(stop_token,
+                               [&] { fail(std::make_exception_ptr(RenderCancelled())); });
+
+    const TileKernel<SceneType> trace_tile =
+        SelectTileKernel<SceneType>(GetSceneFeatures(scene), render_options);
+    // lights do not move during a render, one set of maps serves every frame
+    const std::optional<ShadowMaps> shadow_maps = BuildShadowMaps(scene, render_options);
+    RenderStats stats;
+    auto worker = [&] {
+        SetTraceThreadName("render worker");
+        RenderStats worker_stats;
+        ShadowCache shadow_cache;
+        try {
+            while (true) {
+                if (stop_token.stop_requested()) {
+                    break;
+                }
+                size_t task = next_task++;
+                if (task >= task_count) {
+                    break;
+                }
+                size_t frame = std::upper_bound(first_task.begin(), first_task.end(), task) -
+                               first_task.begin() - 1;
+                FrameState* state;
+                {
+                    std::unique_lock lock(mutex);
+                    // the first worker of a frame prepares it, the others wait for it to appear
+                    cv.wait(lock, [&] {
+                        return failed || (frame < delivered + frames_in_flight &&
+                                          (frames[frame] || !preparing[frame]));
+                    });
+                    if (failed) {
+                        break;
                     }
-                    int z = static_cast<int>(std::floor((normal[2] / 2 + 0.5) * 256));
-                    if (z == 256) {
-                        z = 255;
+                    if (!frames[frame]) {
+                        preparing[frame] = true;
+                        lock.unlock();
+                        // binning walks the whole scene, so it runs without holding the queue
+                        std::unique_ptr<FrameState> prepared = [&] {
+                            TraceSpan span("prepare frame");
+                            span.AddArg("frame", static_cast<int64_t>(frame));
+                            const CameraOptions& camera = cameras[frame];
+                            const CropWindow window = GetRenderWindow(camera, render_options);
+                            std::vector<Tile> tiles =
+                                SplitIntoTiles(window, render_options.tile_size);
+                            size_t tile_count = tiles.size();
+                            std::array<Vector, 3> m = GetCameraMatrix(camera);
+                            std::optional<ScreenBins> bins;
+                            if constexpr (std::is_same_v<SceneType, Scene>) {
+                                if (render_options.rasterize_primary) {
+                                    bins =
+                                        BinPrimitives(scene, camera, m, render_options.tile_size);
+                                }
+                            }
+                            return std::unique_ptr<FrameState>(
+                                new FrameState{std::move(tiles), m, FrameBuffer(window),
+                                               tile_count, std::move(bins)});
+                        }();
+                        lock.lock();
+                        frames[frame] = std::move(prepared);
+                        cv.notify_all();
                     }
-                    output.SetPixel(RGB{x, y, z}, i, j);
-                } else {
-                    output.SetPixel(RGB{0, 0, 0}, i, j);
+                    state = frames[frame].get();
                 }
-            }
-        }
-    } else if (render_options.mode == RenderMode::kFull) {
-        std::vector<std::vector<Vector>> save(
-            camera_options.screen_height,
-            std::vector<Vector>(camera_options.screen_width, Vector()));
-        double to_normalize_pixels = 0.0;
-
-        for (int i = 0; i < camera_options.screen_height; ++i) {
-            for (int j = 0; j < camera_options.screen_width; ++j) {
-                Vector direction = Convert(Vector(j, i, -1), camera_options, m);
-                Vector result = RecursiveCounting(scene, Ray(camera_options.look_from, direction),
-                                                  false, 0, render_options.depth);
-                if (result[0] != 0.0 || result[1] != 0.0 || result[2] != 0.0) {
-                    save[i][j] = result;
-                    double max = std::max({result[0], result[1], result[2]});
-                    if (to_normalize_pixels < max) {
-                        to_normalize_pixels = max;
+
+                const Tile& tile = state->tiles[task - first_task[frame]];
+                {
+                    TraceSpan span("tile");
+                    span.AddArg("frame", static_cast<int64_t>(frame));
+                    span.AddArg("x", tile.x);
+                    span.AddArg("y", tile.y);
+                    trace_tile(scene, cameras[frame], render_options, state->m, tile,
+                               &state->buffer, &worker_stats,
+                               state->bins ? &state->bins.value() : nullptr,
+                               render_options.shadow_cache ? &shadow_cache : nullptr,
+                               shadow_maps ? &shadow_maps.value() : nullptr);
+                }
+                if (callbacks.on_tile) {
+                    callbacks.on_tile(frame, tile, state->buffer);
+                }
+                if (callbacks.on_progress) {
+                    callbacks.on_progress(++tiles_done, task_count);
+                }
+
+                if (--state->tiles_left == 0) {
+                    if (callbacks.on_frame_buffer) {
+                        callbacks.on_frame_buffer(frame, state->buffer);
                     }
+                    Output output = [&] {
+                        TraceSpan span("tonemap");
+                        span.AddArg("frame", static_cast<int64_t>(frame));
+                        return convert(frame, state->buffer);
+                    }();
+                    std::lock_guard lock(mutex);
+                    ready[frame] = std::move(output);
+                    frames[frame].reset();
+                    cv.notify_all();
                 }
             }
+        } catch (...) {
+            fail(std::current_exception());
         }
+        std::lock_guard lock(mutex);
+        stats += worker_stats;
+    };
 
-        if (to_normalize_pixels != 0.0) {
-            for (int i = 0; i < camera_options.screen_height; ++i) {
-                for (int j = 0; j < camera_options.screen_width; ++j) {
-                    save[i][j][0] = save[i][j][0] *
-                                    (1 + save[i][j][0] / std::pow(to_normalize_pixels, 2)) /
-                                    (1 + save[i][j][0]);
-                    save[i][j][1] = save[i][j][1] *
-                                    (1 + save[i][j][1] / std::pow(to_normalize_pixels, 2)) /
-                                    (1 + save[i][j][1]);
-                    save[i][j][2] = save[i][j][2] *
-                                    (1 + save[i][j][2] / std::pow(to_normalize_pixels, 2)) /
-                                    (1 + save[i][j][2]);
-
-                    save[i][j][0] = std::pow(save[i][j][0], 1.0 / 2.2);
-                    save[i][j][1] = std::pow(save[i][j][1], 1.0 / 2.2);
-                    save[i][j][2] = std::pow(save[i][j][2], 1.0 / 2.2);
-
-                    int x = static_cast<int>(std::floor(save[i][j][0] * 256));
-                    if (x == 256) {
-                        x = 255;
-                    }
-                    int y = static_cast<int>(std::floor(save[i][j][1] * 256));
-                    if (y == 256) {
-                        y = 255;
-                    }
-                    int z = static_cast<int>(std::floor(save[i][j][2] * 256));
-                    if (z == 256) {
-                        z = 255;
-                    }
+    std::vector<std::jthread> workers;
+    for (int i = 0; i < thread_count; ++i) {
+        workers.emplace_back(worker);
+    }
 
-                    output.SetPixel(RGB{x, y, z}, i, j);
+    try {
+        for (size_t frame = 0; frame < cameras.size(); ++frame) {
+            std::optional<Output> output;
+            if (first_task[frame + 1] == first_task[frame]) {
+                // no tile would ever finish a frame without pixels
+                FrameBuffer empty(GetRenderWindow(cameras[frame], render_options));
+                if (callbacks.on_frame_buffer) {
+                    callbacks.on_frame_buffer(frame, empty);
                 }
+                output = convert(frame, empty);
             }
+            std::unique_lock lock(mutex);
+            cv.wait(lock,
+                    [&] { return output.has_value() || ready[frame].has_value() || failed; });
+            if (failed) {
+                break;
+            }
+            if (!output.has_value()) {
+                output = std::move(ready[frame].value());
+                ready[frame].reset();
+            }
+            ++delivered;
+            cv.notify_all();
+            lock.unlock();
+            on_frame(frame, std::move(output.value()));
         }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+
+    workers.clear();
+    if (error) {
+        std::rethrow_exception(error);
+    }
+    if (callbacks.on_finish) {
+        callbacks.on_finish(stats);
+    }
+}
+
+}  // namespace render_detail
+
+// Renders every camera against one prepared scene. Tiles of all frames share one work queue,
+// at most a few frames are in flight, and on_frame receives the images in camera order.
+// A stop request is noticed before the next tile starts and ends with RenderCancelled.
+template <class SceneType>
+void RenderFrames(const SceneType& scene, const std::vector<CameraOptions>& cameras,
+                  const RenderOptions& render_options,
+                  const std::function<void(size_t, Image&&)>& on_frame,
+                  const RenderCallbacks& callbacks = {}, std::stop_token stop_token = {}) {
+    render_detail::RenderFrames<SceneType, Image>(
+        scene, cameras, render_options,
+        [&render_options](size_t, const FrameBuffer& buffer) {
+            return ToImage(buffer, render_options.mode, render_options.normalization);
+        },
+        on_frame, callbacks, std::move(stop_token));
+}
+
+// Like the above, but every frame is normalized straight into the caller's pixels as it
+// finishes: outputs[i] gets frame i and has the size of its render window. The buffers are
+// checked before anything is traced.
+template <class SceneType>
+void RenderFrames(const SceneType& scene, const std::vector<CameraOptions>& cameras,
+                  const RenderOptions& render_options, std::span<const PixelBuffer> outputs,
+                  const RenderCallbacks& callbacks = {}, std::stop_token stop_token = {}) {
+    if (outputs.size() != cameras.size()) {
+        throw std::invalid_argument("Every camera needs its own pixel buffer");
     }
+    for (size_t frame = 0; frame < cameras.size(); ++frame) {
+        const CropWindow window = GetRenderWindow(cameras[frame], render_options);
+        CheckPixelBuffer(outputs[frame], window.width, window.height);
+    }
+    render_detail::RenderFrames<SceneType, std::monostate>(
+        scene, cameras, render_options,
+        [&](size_t frame, const FrameBuffer& buffer) {
+            WritePixels(buffer, render_options.mode, render_options.normalization,
+                        outputs[frame]);
+            return std::monostate{};
+        },
+        [](size_t, std::monostate&&) {}, callbacks, std::move(stop_token));
+}
+
+// Frames of the largest camera times the number of frames RenderFrames keeps in flight.
+size_t GetFramesFootprint(const std::vector<CameraOptions>& cameras,
+                          const RenderOptions& render_options) {
+    const int tile_size = render_options.tile_size;
+    size_t task_count = 0;
+    size_t largest = 0;
+    for (const CameraOptions& camera : cameras) {
+        const CropWindow window = GetRenderWindow(camera, render_options);
+        task_count += SplitIntoTiles(window, tile_size).size();
+        largest = std::max(largest, FrameBytes(window.width, window.height));
+    }
+    size_t in_flight = std::min(
+        cameras.size(), static_cast<size_t>(GetThreadCount(render_options, task_count)) + 1);
+    return largest * in_flight;
+}
+
+struct RenderFootprint {
+    SceneFootprint scene;
+    size_t frames = 0;
+
+    size_t Total() const {
+        return scene.Total() + frames;
+    }
+};
+
+RenderFootprint GetRenderFootprint(const Scene& scene, const std::vector<CameraOptions>& cameras,
+                                   const RenderOptions& render_options) {
+    return {GetFootprint(scene), GetFramesFootprint(cameras, render_options)};
+}
+
+// Frames are checked before the scene is read, the scene then gets what is left.
+Scene ReadSceneWithinBudget(const std::filesystem::path& path,
+                            const std::vector<CameraOptions>& cameras,
+                            const RenderOptions& render_options) {
+    const size_t budget = render_options.memory_budget;
+    const size_t frames = GetFramesFootprint(cameras, render_options);
+    CheckMemoryBudget("Frame buffers of " + path.string(), frames, budget);
+    Scene scene = ReadScene(path, {.memory_budget = budget == 0 ? 0 : budget - frames,
+                                   .polygons = true,
+                                   .threads = render_options.threads});
+    CheckMemoryBudget("Render of " + path.string(),
+                      GetFootprint(scene).Total() + frames, budget);
+    return scene;
+}
+
+template <class SceneType>
+Image RenderScene(const SceneType& scene, const CameraOptions& camera_options,
+                  const RenderOptions& render_options) {
+    std::optional<Image> output;
+    RenderFrames(scene, {camera_options}, render_options,
+                 [&output](size_t, Image&& image) { output = std::move(image); });
+    return std::move(output.value());
+}
 
+template <class SceneType>
+void RenderScene(const SceneType& scene, const CameraOptions& camera_options,
+                 const RenderOptions& render_options, const PixelBuffer& output) {
+    RenderFrames(scene, {camera_options}, render_options, std::span(&output, 1));
+}
+
+// Every ray a full render traces for the pixel in column x and row y. Shadow rays skip the
+// shadow cache, with shadow_maps they are looked up instead of traced as in RenderFrames.
+template <class SceneType>
+RayTree TraceRayTree(const SceneType& scene, const CameraOptions& camera_options,
+                     const RenderOptions& render_options, int x, int y,
+                     const ShadowMaps* shadow_maps = nullptr) {
+    std::array<Vector, 3> m = GetCameraMatrix(camera_options);
+    Ray ray(camera_options.look_from, Convert(Vector(x, y, -1), camera_options, m));
+    RayTree tree;
+    ShadeHit<KernelConfig{}>(scene, ray, GetFirstIntersection(ray, scene), false, 0,
+                             render_options.depth, 1.0, render_options.min_path_weight, nullptr,
+                             nullptr, shadow_maps, &tree);
+    return tree;
+}
+
+void RenderFrames(const std::filesystem::path& path, const std::vector<CameraOptions>& cameras,
+                  const RenderOptions& render_options,
+                  const std::function<void(size_t, Image&&)>& on_frame,
+                  const RenderCallbacks& callbacks = {}) {
+    if (render_options.out_of_core_cache.has_value()) {
+        CheckMemoryBudget("Frame buffers of " + path.string(),
+                          GetFramesFootprint(cameras, render_options),
+                          render_options.memory_budget);
+        ClusteredScene scene = ReadClusteredScene(path, render_options.out_of_core_cache.value());
+        RenderFrames(scene, cameras, render_options, on_frame, callbacks);
+        return;
+    }
+    Scene scene = ReadSceneWithinBudget(path, cameras, render_options);
+    RenderFrames(scene, cameras, render_options, on_frame, callbacks);
+}
+
+std::vector<Image> RenderFrames(const std::filesystem::path& path,
+                                const std::vector<CameraOptions>& cameras,
+                                const RenderOptions& render_options) {
+    std::vector<Image> images;
+    images.reserve(cameras.size());
+    RenderFrames(path, cameras, render_options,
+                 [&images](size_t, Image&& image) { images.push_back(std::move(image)); });
+    return images;
+}
+
+// Linear values for compositing: radiance without tonemapping, or real distances in kDepth.
+FloatImage RenderFloat(const std::filesystem::path& path, const CameraOptions& camera_options,
+                       const RenderOptions& render_options) {
+    FloatImage output;
+    RenderFrames(path, {camera_options}, render_options, [](size_t, Image&&) {},
+                 {.on_frame_buffer = [&](size_t, const FrameBuffer& buffer) {
+                     output = ToFloatImage(buffer, render_options.mode);
+                 }});
     return output;
-}
\ No newline at end of file
+}
+
+// Handle of a render running in the background. Dropping it cancels the render
+// and waits for its threads, which stop within one tile.
+class AsyncRender {
+public:
+    AsyncRender(std::future<Image> result, std::jthread driver)
+        : result_(std::move(result)), driver_(std::move(driver)) {
+    }
+
+    void Cancel() {
+        driver_.request_stop();
+    }
+
+    bool IsReady() const {
+        return result_.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+
+    void Wait() const {
+        result_.wait();
+    }
+
+    // throws RenderCancelled if the render was cancelled
+    Image Get() {
+        return result_.get();
+    }
+
+private:
+    std::future<Image> result_;
+    std::jthread driver_;
+};
+
+// Reads the scene and renders it without blocking the caller. Besides AsyncRender::Cancel
+// the render also stops when the optional external stop_token is triggered.
+AsyncRender RenderAsync(const std::filesystem::path& path, const CameraOptions& camera_options,
+                        const RenderOptions& render_options, RenderCallbacks callbacks = {},
+                        std::stop_token stop_token = {}) {
+    std::promise<Image> promise;
+    std::future<Image> result = promise.get_future();
+    std::jthread driver([path, camera_options, render_options, callbacks = std::move(callbacks),
+                         external = std::move(stop_token), promise = std::move(promise)](
+                            std::stop_token own) mutable {
+        std::stop_source combined;
+        std::stop_callback on_own(own, [&combined] { combined.request_stop(); });
+        std::stop_callback on_external(external, [&combined] { combined.request_stop(); });
+        try {
+            std::optional<Image> output;
+            auto on_frame = [&output](size_t, Image&& image) { output = std::move(image); };
+            if (render_options.out_of_core_cache.has_value()) {
+                CheckMemoryBudget("Frame buffers of " + path.string(),
+                                  GetFramesFootprint({camera_options}, render_options),
+                                  render_options.memory_budget);
+                ClusteredScene scene =
+                    ReadClusteredScene(path, render_options.out_of_core_cache.value());
+                RenderFrames(scene, {camera_options}, render_options, on_frame, callbacks,
+                             combined.get_token());
+            } else {
+                Scene scene = ReadSceneWithinBudget(path, {camera_options}, render_options);
+                RenderFrames(scene, {camera_options}, render_options, on_frame, callbacks,
+                             combined.get_token());
+            }
+            if (!output.has_value()) {
+                throw RenderCancelled();
+            }
+            promise.set_value(std::move(output.value()));
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+        }
+    });
+    return AsyncRender(std::move(result), std::move(driver));
+}
+
+Image Render(const std::filesystem::path& path, const CameraOptions& camera_options,
+             const RenderOptions& render_options) {
+    return RenderAsync(path, camera_options, render_options).Get();
+}
+
+// Reads the scene and renders it into output without allocating an image, so the same
+// mapped or shared buffer can take frame after frame.
+void Render(const std::filesystem::path& path, const CameraOptions& camera_options,
+            const RenderOptions& render_options, const PixelBuffer& output) {
+    const CropWindow window = GetRenderWindow(camera_options, render_options);
+    CheckPixelBuffer(output, window.width, window.height);
+    if (render_options.out_of_core_cache.has_value()) {
+        CheckMemoryBudget("Frame buffers of " + path.string(),
+                          GetFramesFootprint({camera_options}, render_options),
+                          render_options.memory_budget);
+        ClusteredScene scene = ReadClusteredScene(path, render_options.out_of_core_cache.value());
+        RenderScene(scene, camera_options, render_options, output);
+        return;
+    }
+    Scene scene = ReadSceneWithinBudget(path, {camera_options}, render_options);
+    RenderScene(scene, camera_options, render_options, output);
+}
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <options/camera_options.h>
+#include <options/render_options.h>
+
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <numbers>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Golden-image and performance regression tracking. Every case renders a scene from
+// raytracer/tests and is compared with its reference image; timings go into a baseline
+// file so later runs can flag slowdowns.
+
+struct GoldenCase {
+    std::string name;
+    std::filesystem::path scene;
+    std::filesystem::path reference;
+    CameraOptions camera;
+    RenderOptions render;
+};
+
+// the same scenes and cameras as the image tests in tests/test.cpp
+std::vector<GoldenCase> GetGoldenCases(const std::filesystem::path& tests_dir) {
+    auto make = [&](std::string name, std::string scene, std::string reference,
+                    CameraOptions camera, int depth) {
+        return GoldenCase{std::move(name), tests_dir / scene, tests_dir / reference, camera,
+                          RenderOptions{depth}};
+    };
+    return {
+        make("shading_parts", "shading_parts/scene.obj", "shading_parts/scene.png", {640, 480},
+             1),
+        make("triangle", "triangle/scene.obj", "triangle/scene.png",
+             {.screen_width = 640, .screen_height = 480, .look_from = {0., 2., 0.},
+              .look_to = {0., 0., 0.}},
+             1),
+        make("triangle_black", "triangle/scene.obj", "triangle/black.png",
+             {.screen_width = 640, .screen_height = 480, .look_from = {0., -2., 0.},
+              .look_to = {0., 0., 0.}},
+             1),
+        make("classic_box_first", "classic_box/CornellBox.obj", "classic_box/first.png",
+             {.screen_width = 500, .screen_height = 500, .look_from = {-.5, 1.5, .98},
+              .look_to = {0., 1., 0.}},
+             4),
+        make("classic_box_second", "classic_box/CornellBox.obj", "classic_box/second.png",
+             {.screen_width = 500, .screen_height = 500, .look_from = {-.9, 1.9, -1},
+              .look_to = {0., 0., 0.}},
+             4),
+        make("mirrors", "mirrors/scene.obj", "mirrors/result.png",
+             {.screen_width = 800, .screen_height = 600, .look_from = {2., 1.5, -.1},
+              .look_to = {1., 1.2, -2.8}},
+             9),
+        make("box_with_spheres", "box/cube.obj", "box/cube.png",
+             {.screen_width = 640, .screen_height = 480, .fov = std::numbers::pi / 3,
+              .look_from = {0., .7, 1.75}, .look_to = {0., .7, 0.}},
+             4),
+        make("distorted_box", "distorted_box/CornellBox.obj", "distorted_box/result.png",
+             {.screen_width = 500, .screen_height = 500, .look_from = {-0.5, 1.5, 1.98},
+              .look_to = {0., 1., 0.}},
+             4),
+        make("deer", "deer/CERF_Free.obj", "deer/result.png",
+             {.screen_width = 500, .screen_height = 500, .look_from = {100., 200., 150.},
+              .look_to = {0., 100., 0.}},
+             1),
+    };
+}
+
+struct CaseMeasurement {
+    double wall_ms = 0;
+    double rays_per_second = 0;
+    long peak_rss_kb = 0;
+    double similarity = 1;
+};
+
+using Baseline = std::map<std::string, CaseMeasurement>;
+
+// one "name wall_ms rays_per_second peak_rss_kb similarity" line per case, '#' starts a comment
+Baseline ReadBaseline(const std::filesystem::path& path) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("Can't open baseline " + path.string());
+    }
+    Baseline baseline;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') {
+            continue;
+        }
+        std::istringstream iss(line);
+        std::string name;
+        CaseMeasurement measurement;
+        if (!(iss >> name >> measurement.wall_ms >> measurement.rays_per_second >>
+              measurement.peak_rss_kb >> measurement.similarity)) {
+            throw std::runtime_error("Bad baseline line: " + line);
+        }
+        baseline[name] = measurement;
+    }
+    return baseline;
+}
+
+void WriteBaseline(const Baseline& baseline, const std::filesystem::path& path) {
+    std::ofstream file(path);
+    file << "# name wall_ms rays_per_second peak_rss_kb similarity\n";
+    for (const auto& [name, measurement] : baseline) {
+        file << name << ' ' << measurement.wall_ms << ' ' << measurement.rays_per_second << ' '
+             << measurement.peak_rss_kb << ' ' << measurement.similarity << '\n';
+    }
+    if (!file) {
+        throw std::runtime_error("Can't write baseline " + path.string());
+    }
+}
+
+struct RegressionOptions {
+    // share of pixels that have to match the reference image
+    double min_similarity = .99;
+    // allowed growth of the wall time against the baseline, in percent
+    double max_slowdown_percent = 10;
+};
+
+// Human-readable problems of one case, empty when it passes. A case missing from the
+// baseline is only checked against its reference image.
+std::vector<std::string> CheckRegression(const std::string& name, const CaseMeasurement& current,
+                                         const Baseline& baseline,
+                                         const RegressionOptions& options = {}) {
+    std::vector<std::string> problems;
+    if (current.similarity < options.min_similarity) {
+        problems.push_back(name + ": image drift, " + std::to_string(current.similarity * 100) +
+                           "% of pixels match the reference");
+    }
+    auto it = baseline.find(name);
+    if (it != baseline.end() &&
+        current.wall_ms > it->second.wall_ms * (1 + options.max_slowdown_percent / 100)) {
+        problems.push_back(name + ": " + std::to_string(current.wall_ms) + " ms against " +
+                           std::to_string(it->second.wall_ms) + " ms in the baseline");
+    }
+    return problems;
+}
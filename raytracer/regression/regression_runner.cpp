@@ -0,0 +1,210 @@
+#include <raytracer.h>
+#include <image_diff.h>
+#include <regression/regression.h>
+#include <trace.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Renders every golden case, compares it with its reference image and with the baseline.
+// Each case runs in a forked child so its peak RSS is measured on its own.
+//
+// usage: regression_runner <tests dir> <baseline> [--update] [--slowdown PERCENT]
+//                          [--min-similarity S] [--threads N] [--repeat N] [--filter NAME]
+//                          [--trace DIR] [--shadow-maps RESOLUTION] [--shadow-bias TEXELS]
+// --update writes the measured values as the new baseline instead of checking against it,
+// the exit code is 1 when any case drifted or got slower. --trace writes a Chrome trace
+// of the last render of every case into DIR/<case>.json. --shadow-maps renders with
+// approximate shadows, the match column then shows their error against the exact
+// shadows of the reference images.
+
+namespace {
+
+// runs in the child, the best of repeat renders is reported
+std::string MeasureCase(const GoldenCase& golden, int threads, int repeat,
+                        const std::filesystem::path& trace_dir,
+                        const std::optional<ShadowMapOptions>& shadow_maps) {
+    RenderOptions render_options = golden.render;
+    render_options.threads = threads;
+    render_options.shadow_maps = shadow_maps;
+    double best_ms = std::numeric_limits<double>::infinity();
+    RenderStats stats;
+    std::optional<Image> image;
+    for (int i = 0; i < repeat; ++i) {
+        if (!trace_dir.empty()) {
+            StartTracing();
+        }
+        auto start = std::chrono::steady_clock::now();
+        RenderFrames(
+            golden.scene, {golden.camera}, render_options,
+            [&](size_t, Image&& frame) { image = std::move(frame); },
+            {.on_finish = [&](const RenderStats& finished) { stats = finished; }});
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        best_ms = std::min(best_ms, elapsed.count());
+    }
+    if (!trace_dir.empty()) {
+        StopTracing();
+        WriteChromeTrace(trace_dir / (golden.name + ".json"));
+    }
+    double rays =
+        static_cast<double>(stats.camera_rays + stats.secondary_rays + stats.shadow_rays);
+    double similarity = DiffImages(image.value(), Image(golden.reference)).Similarity();
+    std::ostringstream out;
+    out.precision(17);
+    out << best_ms << ' ' << rays / (best_ms / 1000) << ' ' << similarity;
+    return out.str();
+}
+
+CaseMeasurement RunCase(const GoldenCase& golden, int threads, int repeat,
+                        const std::filesystem::path& trace_dir,
+                        const std::optional<ShadowMapOptions>& shadow_maps) {
+    int fds[2];
+    if (::pipe(fds) != 0) {
+        throw std::runtime_error("pipe failed");
+    }
+    pid_t pid = ::fork();
+    if (pid < 0) {
+        throw std::runtime_error("fork failed");
+    }
+    if (pid == 0) {
+        ::close(fds[0]);
+        std::string report;
+        try {
+            report = MeasureCase(golden, threads, repeat, trace_dir, shadow_maps);
+        } catch (const std::exception& e) {
+            report = std::string("ERROR ") + e.what();
+        }
+        for (size_t done = 0; done < report.size();) {
+            ssize_t written = ::write(fds[1], report.data() + done, report.size() - done);
+            if (written <= 0) {
+                break;
+            }
+            done += static_cast<size_t>(written);
+        }
+        ::_exit(0);
+    }
+    ::close(fds[1]);
+    std::string report;
+    char buffer[256];
+    ssize_t size;
+    while ((size = ::read(fds[0], buffer, sizeof(buffer))) > 0) {
+        report.append(buffer, static_cast<size_t>(size));
+    }
+    ::close(fds[0]);
+    int status = 0;
+    rusage usage{};
+    ::wait4(pid, &status, 0, &usage);
+
+    if (report.empty() || report.rfind("ERROR ", 0) == 0) {
+        throw std::runtime_error(golden.name + ": " +
+                                 (report.empty() ? "render process crashed" : report.substr(6)));
+    }
+    CaseMeasurement measurement;
+    std::istringstream in(report);
+    in >> measurement.wall_ms >> measurement.rays_per_second >> measurement.similarity;
+    measurement.peak_rss_kb = usage.ru_maxrss;
+    return measurement;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 3) {
+        std::cerr << "usage: " << argv[0] << " <tests dir> <baseline> [options]\n";
+        return 2;
+    }
+    std::filesystem::path tests_dir = argv[1];
+    std::filesystem::path baseline_path = argv[2];
+    bool update = false;
+    int threads = 0;
+    int repeat = 1;
+    std::string filter;
+    std::filesystem::path trace_dir;
+    std::optional<ShadowMapOptions> shadow_maps;
+    RegressionOptions options;
+    try {
+        for (int i = 3; i < argc; ++i) {
+            std::string flag = argv[i];
+            if (flag == "--update") {
+                update = true;
+                continue;
+            }
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("Missing value for " + flag);
+            }
+            std::string value = argv[++i];
+            if (flag == "--slowdown") {
+                options.max_slowdown_percent = std::stod(value);
+            } else if (flag == "--min-similarity") {
+                options.min_similarity = std::stod(value);
+            } else if (flag == "--threads") {
+                threads = std::stoi(value);
+            } else if (flag == "--repeat") {
+                repeat = std::max(1, std::stoi(value));
+            } else if (flag == "--filter") {
+                filter = value;
+            } else if (flag == "--trace") {
+                trace_dir = value;
+            } else if (flag == "--shadow-maps") {
+                shadow_maps = shadow_maps.value_or(ShadowMapOptions{});
+                shadow_maps->resolution = std::stoi(value);
+            } else if (flag == "--shadow-bias") {
+                shadow_maps = shadow_maps.value_or(ShadowMapOptions{});
+                shadow_maps->bias = std::stod(value);
+            } else {
+                throw std::invalid_argument("Unknown flag " + flag);
+            }
+        }
+
+        Baseline baseline;
+        if (!update || std::filesystem::exists(baseline_path)) {
+            baseline = ReadBaseline(baseline_path);
+        }
+
+        std::vector<std::string> problems;
+        std::printf("%-20s %10s %14s %12s %10s\n", "case", "wall ms", "rays/s", "peak rss kb",
+                    "match %");
+        for (const GoldenCase& golden : GetGoldenCases(tests_dir)) {
+            if (!filter.empty() && golden.name.find(filter) == std::string::npos) {
+                continue;
+            }
+            CaseMeasurement measurement =
+                RunCase(golden, threads, repeat, trace_dir, shadow_maps);
+            std::printf("%-20s %10.1f %14.0f %12ld %10.2f\n", golden.name.c_str(),
+                        measurement.wall_ms, measurement.rays_per_second,
+                        measurement.peak_rss_kb, measurement.similarity * 100);
+            std::fflush(stdout);
+            if (update) {
+                baseline[golden.name] = measurement;
+            } else {
+                for (std::string& problem :
+                     CheckRegression(golden.name, measurement, baseline, options)) {
+                    problems.push_back(std::move(problem));
+                }
+            }
+        }
+
+        if (update) {
+            WriteBaseline(baseline, baseline_path);
+            std::cout << "baseline written to " << baseline_path << "\n";
+            return 0;
+        }
+        for (const std::string& problem : problems) {
+            std::cout << "REGRESSION " << problem << "\n";
+        }
+        return problems.empty() ? 0 : 1;
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 2;
+    }
+}
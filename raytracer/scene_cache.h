@@ -0,0 +1,144 @@
+#pragma once
+
+#include <scene.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <filesystem>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// LRU cache of parsed scenes keyed by canonical path, an entry is reloaded once the
+// modification time of the .obj or of one of its .mtl files changes. Scenes are shared, so
+// an evicted scene stays alive until the last render using it finishes.
+class SceneCache {
+public:
+    explicit SceneCache(size_t capacity) : capacity_(capacity) {
+    }
+
+    std::shared_ptr<const Scene> Get(const std::filesystem::path& path) {
+        std::string key = std::filesystem::canonical(path).string();
+        std::filesystem::file_time_type mtime = std::filesystem::last_write_time(key);
+
+        std::shared_future<std::shared_ptr<const Scene>> pending;
+        std::promise<std::shared_ptr<const Scene>> promise;
+        uint64_t generation = 0;
+        {
+            std::lock_guard lock(mutex_);
+            auto it = entries_.find(key);
+            if (it != entries_.end() && IsFresh(*it->second, mtime)) {
+                order_.splice(order_.begin(), order_, it->second);
+                ++hits_;
+                pending = it->second->scene;
+            } else {
+                ++misses_;
+                if (it != entries_.end()) {
+                    order_.erase(it->second);
+                    entries_.erase(it);
+                }
+                generation = ++generation_;
+                order_.push_front(Entry{key, mtime, {}, generation, promise.get_future().share()});
+                entries_.emplace(key, order_.begin());
+                while (order_.size() > capacity_) {
+                    entries_.erase(order_.back().key);
+                    order_.pop_back();
+                }
+            }
+        }
+        // a hit on a scene still being parsed waits for that parse instead of starting another
+        if (pending.valid()) {
+            return pending.get();
+        }
+
+        // parsing happens outside the lock so other scenes can be served meanwhile
+        try {
+            auto scene =
+                std::make_shared<const Scene>(ReadScene(key, {.polygons = true, .threads = 0}));
+            std::vector<std::pair<std::filesystem::path, std::filesystem::file_time_type>>
+                materials;
+            for (const auto& material_file : scene->GetMaterialFiles()) {
+                materials.emplace_back(material_file, GetWriteTime(material_file));
+            }
+            {
+                std::lock_guard lock(mutex_);
+                auto it = entries_.find(key);
+                if (it != entries_.end() && it->second->generation == generation) {
+                    it->second->materials = std::move(materials);
+                }
+            }
+            promise.set_value(scene);
+            return scene;
+        } catch (...) {
+            {
+                std::lock_guard lock(mutex_);
+                auto it = entries_.find(key);
+                if (it != entries_.end() && it->second->generation == generation) {
+                    order_.erase(it->second);
+                    entries_.erase(it);
+                }
+            }
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+    }
+
+    size_t Size() const {
+        std::lock_guard lock(mutex_);
+        return order_.size();
+    }
+
+    size_t Hits() const {
+        std::lock_guard lock(mutex_);
+        return hits_;
+    }
+
+    size_t Misses() const {
+        std::lock_guard lock(mutex_);
+        return misses_;
+    }
+
+private:
+    struct Entry {
+        std::string key;
+        std::filesystem::file_time_type mtime;
+        // .mtl files with their modification times, empty while the scene is parsed
+        std::vector<std::pair<std::filesystem::path, std::filesystem::file_time_type>> materials;
+        uint64_t generation;
+        std::shared_future<std::shared_ptr<const Scene>> scene;
+    };
+
+    // a missing .mtl gets the minimal time, so creating or deleting it reloads the scene
+    static std::filesystem::file_time_type GetWriteTime(const std::filesystem::path& path) {
+        std::error_code error;
+        auto mtime = std::filesystem::last_write_time(path, error);
+        return error ? std::filesystem::file_time_type::min() : mtime;
+    }
+
+    static bool IsFresh(const Entry& entry, std::filesystem::file_time_type mtime) {
+        if (entry.mtime != mtime) {
+            return false;
+        }
+        for (const auto& [material_file, material_mtime] : entry.materials) {
+            if (GetWriteTime(material_file) != material_mtime) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    size_t capacity_;
+    mutable std::mutex mutex_;
+    std::list<Entry> order_;
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries_;
+    uint64_t generation_ = 0;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+};
@@ -0,0 +1,48 @@
+#!/usr/bin/env bash
+# Starts render_server, fires REQUESTS small jobs with CONCURRENCY clients in parallel
+# and prints throughput and latency percentiles.
+#
+# usage: load_test.sh <build dir with render_server and render_client> [REQUESTS] [CONCURRENCY]
+
+set -euo pipefail
+
+BUILD_DIR=${1:?build directory with render_server and render_client}
+REQUESTS=${2:-200}
+CONCURRENCY=${3:-8}
+SCRIPT_DIR=$(cd "$(dirname "$0")" && pwd)
+SCENE=${SCENE:-$SCRIPT_DIR/../tests/box/cube.obj}
+WORK_DIR=$(mktemp -d)
+SOCKET=$WORK_DIR/render.sock
+
+"$BUILD_DIR/render_server" "$SOCKET" &
+SERVER_PID=$!
+trap 'kill $SERVER_PID 2>/dev/null || true; wait $SERVER_PID 2>/dev/null || true; rm -rf "$WORK_DIR"' EXIT
+
+for _ in $(seq 50); do
+    [ -S "$SOCKET" ] && break
+    sleep 0.1
+done
+
+export BUILD_DIR SOCKET SCENE WORK_DIR
+run_one() {
+    local start end
+    start=$(date +%s%N)
+    "$BUILD_DIR/render_client" "$SOCKET" "$SCENE" "$WORK_DIR/out_$1.png" \
+        --width 160 --height 120 --fov 1.0471975512 --from "0 0.7 1.75" --to "0 0.7 0" --depth 3
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000000 ))
+}
+export -f run_one
+
+START=$(date +%s%N)
+seq "$REQUESTS" | xargs -P "$CONCURRENCY" -I{} bash -c 'run_one {}' > "$WORK_DIR/latencies.txt"
+END=$(date +%s%N)
+
+TOTAL_MS=$(( (END - START) / 1000000 ))
+sort -n "$WORK_DIR/latencies.txt" | awk -v total="$TOTAL_MS" -v n="$REQUESTS" '
+    { latency[NR] = $1 }
+    function at(q,    i) { i = int(NR * q) + 1; if (i > NR) i = NR; return latency[i] }
+    END {
+        printf "requests: %d, total: %d ms, throughput: %.1f req/s\n", n, total, n * 1000 / total
+        printf "latency ms: p50 %d, p90 %d, p99 %d, max %d\n", at(0.5), at(0.9), at(0.99), latency[NR]
+    }'
@@ -0,0 +1,312 @@
+#pragma once
+
+#include <options/camera_options.h>
+#include <options/render_options.h>
+
+#include <cerrno>
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Render daemon wire format over a unix stream socket, one job per connection.
+//
+// request:  "key value" lines (the value is the rest of the line) closed by an empty line,
+//           keys: scene, width, height, fov, from, to, depth, mode, heatmap, threads,
+//           tile_size, min_path_weight, rasterize_primary, shadow_cache, shadow_maps, crop,
+//           normalization, output; flags are 0 or 1, shadow_maps is "resolution bias",
+//           crop is "x y width height" in pixels of the frame, output is a relative path
+//           without ".." inside the server's output directory
+// response: "OK <size>\n" followed by <size> bytes of png (0 when written to output),
+//           or "ERROR <message>\n"
+
+struct RenderJob {
+    std::filesystem::path scene;
+    CameraOptions camera = {640, 480};
+    RenderOptions render = {1};
+    // when set the server writes the png there, relative to its output directory,
+    // instead of sending it back
+    std::optional<std::filesystem::path> output = std::nullopt;
+};
+
+namespace protocol_detail {
+
+std::string ToString(const Vector& vector) {
+    std::ostringstream out;
+    out.precision(17);
+    out << vector[0] << ' ' << vector[1] << ' ' << vector[2];
+    return out.str();
+}
+
+Vector ParseVector(const std::string& value) {
+    std::istringstream in(value);
+    Vector vector;
+    if (!(in >> vector[0] >> vector[1] >> vector[2])) {
+        throw std::invalid_argument("Bad vector: " + value);
+    }
+    return vector;
+}
+
+CropWindow ParseCropWindow(const std::string& value) {
+    std::istringstream in(value);
+    CropWindow crop;
+    if (!(in >> crop.x >> crop.y >> crop.width >> crop.height)) {
+        throw std::invalid_argument("Bad crop window: " + value);
+    }
+    return crop;
+}
+
+bool ParseFlag(const std::string& value) {
+    if (value == "0" || value == "1") {
+        return value == "1";
+    }
+    throw std::invalid_argument("Bad flag: " + value);
+}
+
+ShadowMapOptions ParseShadowMapOptions(const std::string& value) {
+    std::istringstream in(value);
+    ShadowMapOptions options;
+    if (!(in >> options.resolution >> options.bias) || options.resolution <= 0) {
+        throw std::invalid_argument("Bad shadow maps: " + value);
+    }
+    return options;
+}
+
+// keeps the server from writing anywhere but below its output directory
+std::filesystem::path ParseOutputPath(const std::string& value) {
+    std::filesystem::path path = value;
+    if (path.empty() || path.has_root_path() || !path.has_filename()) {
+        throw std::invalid_argument("Bad output path: " + value);
+    }
+    for (const std::filesystem::path& part : path) {
+        if (part == "..") {
+            throw std::invalid_argument("Bad output path: " + value);
+        }
+    }
+    return path;
+}
+
+}  // namespace protocol_detail
+
+std::string ToString(RenderMode mode) {
+    switch (mode) {
+        case RenderMode::kDepth:
+            return "depth";
+        case RenderMode::kNormal:
+            return "normal";
+        case RenderMode::kFull:
+            return "full";
+        case RenderMode::kHeatmap:
+            return "heatmap";
+    }
+    return "full";
+}
+
+RenderMode ParseRenderMode(const std::string& value) {
+    if (value == "depth") {
+        return RenderMode::kDepth;
+    } else if (value == "normal") {
+        return RenderMode::kNormal;
+    } else if (value == "full") {
+        return RenderMode::kFull;
+    } else if (value == "heatmap") {
+        return RenderMode::kHeatmap;
+    }
+    throw std::invalid_argument("Unknown render mode: " + value);
+}
+
+std::string ToString(HeatmapMetric metric) {
+    switch (metric) {
+        case HeatmapMetric::kIntersectionTests:
+            return "tests";
+        case HeatmapMetric::kRays:
+            return "rays";
+        case HeatmapMetric::kDepth:
+            return "depth";
+    }
+    return "tests";
+}
+
+HeatmapMetric ParseHeatmapMetric(const std::string& value) {
+    if (value == "tests") {
+        return HeatmapMetric::kIntersectionTests;
+    } else if (value == "rays") {
+        return HeatmapMetric::kRays;
+    } else if (value == "depth") {
+        return HeatmapMetric::kDepth;
+    }
+    throw std::invalid_argument("Unknown heatmap metric: " + value);
+}
+
+std::string SerializeJob(const RenderJob& job) {
+    std::ostringstream out;
+    out.precision(17);
+    out << "scene " << job.scene.string() << '\n';
+    out << "width " << job.camera.screen_width << '\n';
+    out << "height " << job.camera.screen_height << '\n';
+    out << "fov " << job.camera.fov << '\n';
+    out << "from " << protocol_detail::ToString(job.camera.look_from) << '\n';
+    out << "to " << protocol_detail::ToString(job.camera.look_to) << '\n';
+    out << "depth " << job.render.depth << '\n';
+    out << "mode " << ToString(job.render.mode) << '\n';
+    if (job.render.mode == RenderMode::kHeatmap) {
+        out << "heatmap " << ToString(job.render.heatmap) << '\n';
+    }
+    out << "threads " << job.render.threads << '\n';
+    out << "tile_size " << job.render.tile_size << '\n';
+    out << "min_path_weight " << job.render.min_path_weight << '\n';
+    out << "rasterize_primary " << job.render.rasterize_primary << '\n';
+    out << "shadow_cache " << job.render.shadow_cache << '\n';
+    if (job.render.shadow_maps.has_value()) {
+        out << "shadow_maps " << job.render.shadow_maps->resolution << ' '
+            << job.render.shadow_maps->bias << '\n';
+    }
+    if (job.render.crop.has_value()) {
+        const CropWindow& crop = job.render.crop.value();
+        out << "crop " << crop.x << ' ' << crop.y << ' ' << crop.width << ' ' << crop.height
+            << '\n';
+    }
+    if (job.render.normalization.has_value()) {
+        out << "normalization " << job.render.normalization.value() << '\n';
+    }
+    if (job.output.has_value()) {
+        out << "output " << job.output->string() << '\n';
+    }
+    out << '\n';
+    return out.str();
+}
+
+// reads bytes until '\n', returns std::nullopt if the peer closed the connection first
+std::optional<std::string> ReadLine(int fd) {
+    std::string line;
+    char c;
+    while (true) {
+        ssize_t result = ::read(fd, &c, 1);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            return std::nullopt;
+        }
+        if (c == '\n') {
+            return line;
+        }
+        line.push_back(c);
+    }
+}
+
+void WriteAll(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t result = ::write(fd, data.data() + written, data.size() - written);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            throw std::runtime_error("Connection lost while writing");
+        }
+        written += static_cast<size_t>(result);
+    }
+}
+
+std::string ReadExact(int fd, size_t size) {
+    std::string data(size, '\0');
+    size_t done = 0;
+    while (done < size) {
+        ssize_t result = ::read(fd, data.data() + done, size - done);
+        if (result < 0 && errno == EINTR) {
+            continue;
+        }
+        if (result <= 0) {
+            throw std::runtime_error("Connection lost while reading");
+        }
+        done += static_cast<size_t>(result);
+    }
+    return data;
+}
+
+RenderJob ReadJob(int fd) {
+    RenderJob job;
+    bool has_scene = false;
+    while (true) {
+        std::optional<std::string> line = ReadLine(fd);
+        if (!line.has_value()) {
+            throw std::runtime_error("Connection closed before the end of the request");
+        }
+        if (line->empty()) {
+            break;
+        }
+
+        size_t space = line->find(' ');
+        std::string key = line->substr(0, space);
+        std::string value = space == std::string::npos ? "" : line->substr(space + 1);
+
+        if (key == "scene") {
+            job.scene = value;
+            has_scene = true;
+        } else if (key == "width") {
+            job.camera.screen_width = std::stoi(value);
+        } else if (key == "height") {
+            job.camera.screen_height = std::stoi(value);
+        } else if (key == "fov") {
+            job.camera.fov = std::stod(value);
+        } else if (key == "from") {
+            job.camera.look_from = protocol_detail::ParseVector(value);
+        } else if (key == "to") {
+            job.camera.look_to = protocol_detail::ParseVector(value);
+        } else if (key == "depth") {
+            job.render.depth = std::stoi(value);
+        } else if (key == "mode") {
+            job.render.mode = ParseRenderMode(value);
+        } else if (key == "heatmap") {
+            job.render.heatmap = ParseHeatmapMetric(value);
+        } else if (key == "threads") {
+            job.render.threads = std::stoi(value);
+        } else if (key == "tile_size") {
+            job.render.tile_size = std::stoi(value);
+        } else if (key == "min_path_weight") {
+            job.render.min_path_weight = std::stod(value);
+        } else if (key == "rasterize_primary") {
+            job.render.rasterize_primary = protocol_detail::ParseFlag(value);
+        } else if (key == "shadow_cache") {
+            job.render.shadow_cache = protocol_detail::ParseFlag(value);
+        } else if (key == "shadow_maps") {
+            job.render.shadow_maps = protocol_detail::ParseShadowMapOptions(value);
+        } else if (key == "crop") {
+            job.render.crop = protocol_detail::ParseCropWindow(value);
+        } else if (key == "normalization") {
+            job.render.normalization = std::stod(value);
+        } else if (key == "output") {
+            job.output = protocol_detail::ParseOutputPath(value);
+        } else {
+            throw std::invalid_argument("Unknown request key: " + key);
+        }
+    }
+    if (!has_scene) {
+        throw std::invalid_argument("Request has no scene");
+    }
+    if (job.camera.screen_width <= 0 || job.camera.screen_height <= 0) {
+        throw std::invalid_argument("Bad screen size");
+    }
+    if (job.render.tile_size <= 0) {
+        throw std::invalid_argument("Bad tile size");
+    }
+    return job;
+}
+
+sockaddr_un MakeSocketAddress(const std::filesystem::path& socket_path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    std::string path = socket_path.string();
+    if (path.size() >= sizeof(address.sun_path)) {
+        throw std::invalid_argument("Socket path is too long: " + path);
+    }
+    path.copy(address.sun_path, path.size());
+    return address;
+}
@@ -0,0 +1,107 @@
+#include <server/protocol.h>
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Sends one job to render_server and saves the returned png.
+//
+// usage: render_client <socket> <scene.obj> <out.png> [--width W] [--height H] [--fov F]
+//                      [--from "x y z"] [--to "x y z"] [--depth D]
+//                      [--mode depth|normal|full|heatmap] [--heatmap tests|rays|depth]
+//                      [--threads N] [--tile-size N] [--min-path-weight W]
+//                      [--rasterize-primary 0|1] [--shadow-cache 0|1]
+//                      [--shadow-maps "resolution bias"] [--crop "x y w h"]
+//                      [--normalization V] [--server-output]
+// with --server-output the server writes <out.png> itself and nothing is transferred,
+// <out.png> is then a relative path inside the server's --output-dir.
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        std::cerr << "usage: " << argv[0] << " <socket> <scene.obj> <out.png> [options]\n";
+        return 1;
+    }
+
+    RenderJob job;
+    job.scene = std::filesystem::absolute(argv[2]);
+    std::filesystem::path output = argv[3];
+    try {
+        for (int i = 4; i < argc; ++i) {
+            std::string flag = argv[i];
+            if (flag == "--server-output") {
+                job.output = protocol_detail::ParseOutputPath(output.string());
+                continue;
+            }
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("Missing value for " + flag);
+            }
+            std::string value = argv[++i];
+            if (flag == "--width") {
+                job.camera.screen_width = std::stoi(value);
+            } else if (flag == "--height") {
+                job.camera.screen_height = std::stoi(value);
+            } else if (flag == "--fov") {
+                job.camera.fov = std::stod(value);
+            } else if (flag == "--from") {
+                job.camera.look_from = protocol_detail::ParseVector(value);
+            } else if (flag == "--to") {
+                job.camera.look_to = protocol_detail::ParseVector(value);
+            } else if (flag == "--depth") {
+                job.render.depth = std::stoi(value);
+            } else if (flag == "--mode") {
+                job.render.mode = ParseRenderMode(value);
+            } else if (flag == "--heatmap") {
+                job.render.heatmap = ParseHeatmapMetric(value);
+            } else if (flag == "--threads") {
+                job.render.threads = std::stoi(value);
+            } else if (flag == "--tile-size") {
+                job.render.tile_size = std::stoi(value);
+            } else if (flag == "--min-path-weight") {
+                job.render.min_path_weight = std::stod(value);
+            } else if (flag == "--rasterize-primary") {
+                job.render.rasterize_primary = protocol_detail::ParseFlag(value);
+            } else if (flag == "--shadow-cache") {
+                job.render.shadow_cache = protocol_detail::ParseFlag(value);
+            } else if (flag == "--shadow-maps") {
+                job.render.shadow_maps = protocol_detail::ParseShadowMapOptions(value);
+            } else if (flag == "--crop") {
+                job.render.crop = protocol_detail::ParseCropWindow(value);
+            } else if (flag == "--normalization") {
+                job.render.normalization = std::stod(value);
+            } else {
+                throw std::invalid_argument("Unknown flag " + flag);
+            }
+        }
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address = MakeSocketAddress(argv[1]);
+        if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            throw std::runtime_error(std::string("Can't connect to ") + argv[1]);
+        }
+        WriteAll(fd, SerializeJob(job));
+
+        std::optional<std::string> status = ReadLine(fd);
+        if (!status.has_value()) {
+            throw std::runtime_error("Server closed the connection");
+        }
+        if (status->rfind("OK ", 0) != 0) {
+            throw std::runtime_error(*status);
+        }
+        std::string png = ReadExact(fd, std::stoull(status->substr(3)));
+        ::close(fd);
+
+        if (!job.output.has_value()) {
+            std::ofstream file(output, std::ios::binary);
+            file.write(png.data(), static_cast<std::streamsize>(png.size()));
+        }
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,216 @@
+#include <raytracer.h>
+#include <scene_cache.h>
+#include <server/protocol.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <csetjmp>
+#include <csignal>
+#include <cstdlib>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <png.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Long-running render daemon: keeps parsed scenes in an LRU cache and serves jobs
+// from a fixed pool of workers. Each job renders on one thread unless the request
+// asks for more, the parallelism comes from serving jobs concurrently.
+//
+// usage: render_server <socket> [--workers N] [--cache-size N] [--output-dir DIR]
+// jobs may only ask the server to write their png when --output-dir is given, and only
+// below that directory.
+
+namespace {
+
+std::atomic<int> listen_fd = -1;
+
+void HandleStop(int) {
+    int fd = listen_fd.exchange(-1);
+    if (fd >= 0) {
+        ::close(fd);
+    }
+}
+
+// libpng reports errors with longjmp, so nothing in this frame may need a destructor
+bool WritePngRows(png_structp png, png_infop info, const Image& image, png_bytep row) {
+    if (setjmp(png_jmpbuf(png))) {
+        return false;
+    }
+    png_set_IHDR(png, info, image.Width(), image.Height(), 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    for (int y = 0; y < image.Height(); ++y) {
+        for (int x = 0; x < image.Width(); ++x) {
+            RGB pixel = image.GetPixel(y, x);
+            row[3 * x] = static_cast<png_byte>(pixel.r);
+            row[3 * x + 1] = static_cast<png_byte>(pixel.g);
+            row[3 * x + 2] = static_cast<png_byte>(pixel.b);
+        }
+        png_write_row(png, row);
+    }
+    png_write_end(png, nullptr);
+    return true;
+}
+
+std::string EncodePng(const Image& image) {
+    std::string data;
+    std::vector<png_byte> row(3 * static_cast<size_t>(image.Width()));
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png ? png_create_info_struct(png) : nullptr;
+    bool written = false;
+    if (info) {
+        png_set_write_fn(
+            png, &data,
+            [](png_structp png, png_bytep bytes, png_size_t size) {
+                static_cast<std::string*>(png_get_io_ptr(png))
+                    ->append(reinterpret_cast<const char*>(bytes), size);
+            },
+            [](png_structp) {});
+        written = WritePngRows(png, info, image, row.data());
+    }
+    png_destroy_write_struct(&png, &info);
+    if (!written) {
+        throw std::runtime_error("Can't encode png");
+    }
+    return data;
+}
+
+void Serve(int fd, SceneCache* cache, const std::optional<std::filesystem::path>& output_dir) {
+    try {
+        RenderJob job = ReadJob(fd);
+        if (job.output.has_value() && !output_dir.has_value()) {
+            throw std::invalid_argument("Server has no output directory");
+        }
+        if (job.render.threads <= 0) {
+            job.render.threads = 1;
+        }
+        std::shared_ptr<const Scene> scene = cache->Get(job.scene);
+        Image image = RenderScene(*scene, job.camera, job.render);
+        if (job.output.has_value()) {
+            image.Write(output_dir.value() / job.output.value());
+            WriteAll(fd, "OK 0\n");
+        } else {
+            std::string png = EncodePng(image);
+            WriteAll(fd, "OK " + std::to_string(png.size()) + "\n" + png);
+        }
+    } catch (const std::exception& e) {
+        std::string message = e.what();
+        for (char& c : message) {
+            if (c == '\n') {
+                c = ' ';
+            }
+        }
+        try {
+            WriteAll(fd, "ERROR " + message + "\n");
+        } catch (const std::exception&) {
+            // the client is gone, nothing to report to
+        }
+    }
+    ::close(fd);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0]
+                  << " <socket> [--workers N] [--cache-size N] [--output-dir DIR]\n";
+        return 1;
+    }
+    std::filesystem::path socket_path = argv[1];
+    int workers_count = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    size_t cache_size = 16;
+    std::optional<std::filesystem::path> output_dir;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        std::string flag = argv[i];
+        if (flag == "--workers") {
+            workers_count = std::max(1, std::atoi(argv[i + 1]));
+        } else if (flag == "--cache-size") {
+            cache_size = static_cast<size_t>(std::max(1, std::atoi(argv[i + 1])));
+        } else if (flag == "--output-dir") {
+            output_dir = std::filesystem::absolute(argv[i + 1]);
+        } else {
+            std::cerr << "unknown flag " << flag << "\n";
+            return 1;
+        }
+    }
+
+    std::signal(SIGPIPE, SIG_IGN);
+    std::signal(SIGINT, HandleStop);
+    std::signal(SIGTERM, HandleStop);
+
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = MakeSocketAddress(socket_path);
+    std::filesystem::remove(socket_path);
+    if (fd < 0 || ::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        ::listen(fd, 128) != 0) {
+        std::cerr << "can't listen on " << socket_path << "\n";
+        return 1;
+    }
+    listen_fd = fd;
+
+    SceneCache cache(cache_size);
+    std::deque<int> connections;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopping = false;
+
+    std::vector<std::jthread> workers;
+    for (int i = 0; i < workers_count; ++i) {
+        workers.emplace_back([&] {
+            while (true) {
+                int connection;
+                {
+                    std::unique_lock lock(mutex);
+                    cv.wait(lock, [&] { return stopping || !connections.empty(); });
+                    if (connections.empty()) {
+                        return;
+                    }
+                    connection = connections.front();
+                    connections.pop_front();
+                }
+                Serve(connection, &cache, output_dir);
+            }
+        });
+    }
+
+    std::cerr << "render_server: listening on " << socket_path << " with " << workers_count
+              << " workers\n";
+    while (true) {
+        int server_fd = listen_fd.load();
+        if (server_fd < 0) {
+            break;
+        }
+        int connection = ::accept(server_fd, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        std::lock_guard lock(mutex);
+        connections.push_back(connection);
+        cv.notify_one();
+    }
+
+    {
+        std::lock_guard lock(mutex);
+        stopping = true;
+        cv.notify_all();
+    }
+    workers.clear();
+    HandleStop(0);
+    std::filesystem::remove(socket_path);
+    std::cerr << "render_server: scene cache hits " << cache.Hits() << ", misses "
+              << cache.Misses() << "\n";
+    return 0;
+}
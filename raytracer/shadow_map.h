@@ -0,0 +1,290 @@
+#pragma once
+
+#include <options/render_options.h>
+#include <scene.h>
+
+#include <geometry.h>
+#include <hit_record.h>
+#include <light.h>
+#include <ray.h>
+#include <vector.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <span>
+#include <thread>
+#include <vector>
+
+// Approximate visibility of point lights. Every light gets a cube of depth maps holding
+// the distance to the first hit seen through each texel, and a shaded point is lit by
+// the share of the four nearest texels that do not see anything in front of it.
+
+class ShadowMaps {
+public:
+    ShadowMaps(const ShadowMapOptions& options, std::span<const Light> lights)
+        : resolution_(std::max(1, options.resolution)), bias_(options.bias) {
+        for (const Light& light : lights) {
+            cubes_.push_back({light.position, std::vector<float>(6 * Texels())});
+        }
+    }
+
+    int Resolution() const {
+        return resolution_;
+    }
+
+    size_t Texels() const {
+        return static_cast<size_t>(resolution_) * resolution_;
+    }
+
+    // texel of one face, faces are +x, -x, +y, -y, +z, -z
+    Vector GetDirection(int face, int x, int y) const {
+        size_t axis = face / 2;
+        Vector direction;
+        direction[axis] = face % 2 == 0 ? 1 : -1;
+        direction[(axis + 1) % 3] = 2 * (x + 0.5) / resolution_ - 1;
+        direction[(axis + 2) % 3] = 2 * (y + 0.5) / resolution_ - 1;
+        direction.Normalize();
+        return direction;
+    }
+
+    void Set(size_t light, int face, int x, int y, double depth) {
+        cubes_[light].depth[Index(face, x, y)] = static_cast<float>(depth);
+    }
+
+    // depth along the face axis and texel coordinates of a point relative to the light
+    std::array<double, 3> Project(int face, const Vector& offset) const {
+        size_t axis = face / 2;
+        double depth = face % 2 == 0 ? offset[axis] : -offset[axis];
+        return {depth, (offset[(axis + 1) % 3] / depth + 1) * resolution_ / 2 - 0.5,
+                (offset[(axis + 2) % 3] / depth + 1) * resolution_ / 2 - 0.5};
+    }
+
+    double GetDepth(size_t light, int face, int x, int y) const {
+        return cubes_[light].depth[Index(face, x, y)];
+    }
+
+    const Vector& GetPosition(size_t light) const {
+        return cubes_[light].position;
+    }
+
+    // 1 when fully lit, 0 in full shadow, bilinear filtered in between
+    double Visibility(size_t light, const Vector& point, const Vector& normal) const {
+        const Cube& cube = cubes_[light];
+        Vector to_point = point - cube.position;
+        size_t axis = 0;
+        for (size_t i = 1; i < 3; ++i) {
+            if (std::abs(to_point[i]) > std::abs(to_point[axis])) {
+                axis = i;
+            }
+        }
+        const double major = std::abs(to_point[axis]);
+        if (major == 0) {
+            return 1;
+        }
+        const int face = static_cast<int>(2 * axis + (to_point[axis] < 0));
+        const double distance = Length(to_point);
+        // The bias is given in texels, one texel spans about 2 / resolution radians. Depth
+        // changes across a texel as 1 / cos of the incidence angle, so does the bias.
+        const double cosine = std::abs(DotProduct(normal, to_point)) / distance;
+        const double limit =
+            distance - bias_ * distance * 2 / resolution_ / std::max(cosine, kMinCosine);
+
+        auto texel = [&](double coordinate) {
+            return (coordinate / major + 1) * resolution_ / 2 - 0.5;
+        };
+        double u = texel(to_point[(axis + 1) % 3]);
+        double v = texel(to_point[(axis + 2) % 3]);
+        int x0 = static_cast<int>(std::floor(u));
+        int y0 = static_cast<int>(std::floor(v));
+        double fx = u - x0;
+        double fy = v - y0;
+        auto lit = [&](int x, int y) {
+            x = std::clamp(x, 0, resolution_ - 1);
+            y = std::clamp(y, 0, resolution_ - 1);
+            return cube.depth[Index(face, x, y)] >= limit ? 1.0 : 0.0;
+        };
+        std::array<double, 4> samples = {lit(x0, y0), lit(x0 + 1, y0), lit(x0, y0 + 1),
+                                         lit(x0 + 1, y0 + 1)};
+        double count = samples[0] + samples[1] + samples[2] + samples[3];
+        // exact answers away from shadow edges, the weights need not sum to exactly 1
+        if (count == 0 || count == 4) {
+            return count / 4;
+        }
+        return (samples[0] * (1 - fx) + samples[1] * fx) * (1 - fy) +
+               (samples[2] * (1 - fx) + samples[3] * fx) * fy;
+    }
+
+private:
+    // grazing surfaces get at most this many times the bias of a facing one
+    static constexpr double kMinCosine = 0.05;
+
+    struct Cube {
+        Vector position;
+        std::vector<float> depth;
+    };
+
+    size_t Index(int face, int x, int y) const {
+        return static_cast<size_t>(face) * Texels() + static_cast<size_t>(y) * resolution_ + x;
+    }
+
+    int resolution_;
+    double bias_;
+    std::vector<Cube> cubes_;
+};
+
+namespace shadow_map_detail {
+
+// points closer to the plane of the light than this are clipped
+constexpr double kNearPlane = 1e-9;
+
+struct TexelRect {
+    int x0 = 0;
+    int y0 = 0;
+    int x1 = -1;
+    int y1 = -1;
+};
+
+// Conservative texels of a face that may see any of the points, one texel of slack
+// absorbs rounding. A point behind the light plane makes the whole face a candidate.
+TexelRect GetTexelRect(const ShadowMaps& maps, int face, const Vector& light,
+                       std::span<const Vector> points) {
+    const int resolution = maps.Resolution();
+    double min_x = std::numeric_limits<double>::infinity();
+    double min_y = min_x;
+    double max_x = -min_x;
+    double max_y = -min_x;
+    int in_front = 0;
+    for (const Vector& point : points) {
+        auto [depth, x, y] = maps.Project(face, point - light);
+        if (depth <= kNearPlane) {
+            continue;
+        }
+        ++in_front;
+        min_x = std::min(min_x, x);
+        min_y = std::min(min_y, y);
+        max_x = std::max(max_x, x);
+        max_y = std::max(max_y, y);
+    }
+    if (in_front == 0) {
+        return {};
+    }
+    if (in_front < static_cast<int>(points.size())) {
+        return {0, 0, resolution - 1, resolution - 1};
+    }
+    auto clamp = [&](double value) {
+        return static_cast<int>(std::clamp(value, -1.0, static_cast<double>(resolution)));
+    };
+    return {std::max(0, clamp(std::floor(min_x) - 1)), std::max(0, clamp(std::floor(min_y) - 1)),
+            std::min(resolution - 1, clamp(std::ceil(max_x) + 1)),
+            std::min(resolution - 1, clamp(std::ceil(max_y) + 1))};
+}
+
+}  // namespace shadow_map_detail
+
+// Maps of a Scene: every primitive is only tested against the texels its projection
+// covers, the depths are the same the ray cast build finds.
+ShadowMaps RasterizeShadowMaps(const ShadowMapOptions& options, const Scene& scene,
+                               int threads) {
+    using namespace shadow_map_detail;
+    std::span<const Light> lights = scene.GetLights();
+    ShadowMaps maps(options, lights);
+    const int resolution = maps.Resolution();
+    const size_t faces = lights.size() * 6;
+    std::atomic<size_t> next_face = 0;
+    auto worker = [&] {
+        std::vector<Ray> rays;
+        std::vector<HitRecord> hits;
+        for (size_t task = next_face++; task < faces; task = next_face++) {
+            const size_t light = task / 6;
+            const int face = static_cast<int>(task % 6);
+            const Vector& position = maps.GetPosition(light);
+            rays.clear();
+            for (int y = 0; y < resolution; ++y) {
+                for (int x = 0; x < resolution; ++x) {
+                    rays.emplace_back(position, maps.GetDirection(face, x, y));
+                }
+            }
+            hits.assign(rays.size(), HitRecord{});
+            auto scan = [&](std::span<const Vector> points, const auto& primitive) {
+                TexelRect rect = GetTexelRect(maps, face, position, points);
+                for (int y = rect.y0; y <= rect.y1; ++y) {
+                    for (int x = rect.x0; x <= rect.x1; ++x) {
+                        size_t texel = static_cast<size_t>(y) * resolution + x;
+                        UpdateClosestHit(rays[texel], primitive, 0, &hits[texel]);
+                    }
+                }
+            };
+            for (const Object& object : scene.GetObjects()) {
+                const Triangle& triangle = object.polygon;
+                std::array<Vector, 3> corners = {triangle[0], triangle[1], triangle[2]};
+                scan(corners, triangle);
+            }
+            for (const SphereObject& object : scene.GetSphereObjects()) {
+                const Sphere& sphere = object.sphere;
+                std::array<Vector, 8> corners;
+                for (int corner = 0; corner < 8; ++corner) {
+                    Vector offset((corner & 1) ? 1 : -1, (corner & 2) ? 1 : -1,
+                                  (corner & 4) ? 1 : -1);
+                    corners[corner] = sphere.GetCenter() + offset * sphere.GetRadius();
+                }
+                scan(corners, sphere);
+            }
+            for (const PolygonObject& object : scene.GetPolygonObjects()) {
+                const Polygon& polygon = object.polygon;
+                std::array<Vector, Polygon::kMaxVertices> corners;
+                for (size_t i = 0; i < polygon.Size(); ++i) {
+                    corners[i] = polygon[i];
+                }
+                scan(std::span<const Vector>(corners.data(), polygon.Size()), polygon);
+            }
+            for (int y = 0; y < resolution; ++y) {
+                for (int x = 0; x < resolution; ++x) {
+                    maps.Set(light, face, x, y,
+                             hits[static_cast<size_t>(y) * resolution + x].distance);
+                }
+            }
+        }
+    };
+    std::vector<std::jthread> workers;
+    for (int i = 1; i < std::max(1, threads); ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    workers.clear();
+    return maps;
+}
+
+// Any scene type: rows of all faces of all lights are shared between threads. closest_hit is called as
+// closest_hit(ray) and returns a HitRecord, texels that see nothing stay infinitely deep.
+template <class ClosestHit>
+ShadowMaps CastShadowMaps(const ShadowMapOptions& options, std::span<const Light> lights,
+                           int threads, const ClosestHit& closest_hit) {
+    ShadowMaps maps(options, lights);
+    const int resolution = maps.Resolution();
+    const size_t rows = lights.size() * 6 * resolution;
+    std::atomic<size_t> next_row = 0;
+    auto worker = [&] {
+        for (size_t row = next_row++; row < rows; row = next_row++) {
+            const size_t light = row / (6 * resolution);
+            const int face = static_cast<int>(row / resolution % 6);
+            const int y = static_cast<int>(row % resolution);
+            for (int x = 0; x < resolution; ++x) {
+                HitRecord hit =
+                    closest_hit(Ray(maps.GetPosition(light), maps.GetDirection(face, x, y)));
+                maps.Set(light, face, x, y,
+                         hit.IsHit() ? hit.distance : std::numeric_limits<double>::infinity());
+            }
+        }
+    };
+    std::vector<std::jthread> workers;
+    for (int i = 1; i < std::max(1, threads); ++i) {
+        workers.emplace_back(worker);
+    }
+    worker();
+    workers.clear();
+    return maps;
+}
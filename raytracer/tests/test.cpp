@@ -1,16 +1,32 @@
 #include <options/camera_options.h>
 #include <options/render_options.h>
+#include <options/camera_path.h>
 #include <tests/commons.h>
 #include <raytracer.h>
+#include <scene_cache.h>
+#include <dynamic_scene.h>
+#include <hdr_image.h>
+#include <image_diff.h>
+#include <regression/regression.h>
+#include <trace.h>
+#include <farm/tile_farm.h>
+#include <bench/scene_generator.h>
 #include <util.h>
 #include <image.h>
 
+#include <chrono>
 #include <cmath>
+#include <fstream>
+#include <limits>
 #include <string_view>
 #include <optional>
+#include <sstream>
+#include <thread>
+#include <vector>
 #include <numbers>
 
 #include <catch2/catch_test_macros.hpp>
+#include <catch2/matchers/catch_matchers_string.hpp>
 
 void CheckImage(std::string_view obj_filename, std::string_view result_filename,
                 const CameraOptions& camera_options, const RenderOptions& render_options,
@@ -87,3 +103,921 @@ TEST_CASE("Deer", "[no_asan]") {
                               .look_to = {0., 100., 0.}};
     CheckImage("deer/CERF_Free.obj", "deer/result.png", camera_opts, {1}, GetFileDir(__FILE__) / "deer/temp.png");
 }
+
+TEST_CASE("Out-of-core box") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions camera_opts{.screen_width = 320,
+                              .screen_height = 240,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    const auto cache = std::filesystem::temp_directory_path() / "raytracer_box.clusters";
+    std::filesystem::remove(cache);
+    auto expected = Render(kTestsDir / "box/cube.obj", camera_opts, {4});
+    auto image = Render(kTestsDir / "box/cube.obj", camera_opts,
+                        {.depth = 4, .out_of_core_cache = cache});
+    Compare(image, expected);
+    // second render reuses the cluster file
+    Compare(Render(kTestsDir / "box/cube.obj", camera_opts, {.depth = 4, .out_of_core_cache = cache}),
+            expected);
+    std::filesystem::remove(cache);
+}
+
+TEST_CASE("Camera batch") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions first{.screen_width = 160,
+                        .screen_height = 120,
+                        .fov = std::numbers::pi / 3,
+                        .look_from = {0., .7, 1.75},
+                        .look_to = {0., .7, 0.}};
+    CameraOptions last = first;
+    last.look_from = {1., .9, 1.5};
+    auto cameras = SampleCameraPath({{0., first}, {1., last}}, 3);
+    REQUIRE(cameras.size() == 3);
+    CHECK(cameras[1].look_from[0] == .5);
+    CHECK(cameras[2].look_from[1] == .9);
+
+    size_t next_frame = 0;
+    RenderFrames(kTestsDir / "box/cube.obj", cameras, {.depth = 4, .tile_size = 16},
+                 [&](size_t frame, Image&& image) {
+                     REQUIRE(frame == next_frame++);
+                     Compare(image, Render(kTestsDir / "box/cube.obj", cameras[frame], {4}));
+                 });
+    CHECK(next_frame == cameras.size());
+
+    // frames binned by whichever worker reaches them first
+    RenderOptions rasterized{.depth = 4, .threads = 4, .tile_size = 16, .rasterize_primary = true};
+    next_frame = 0;
+    RenderFrames(kTestsDir / "box/cube.obj", cameras, rasterized,
+                 [&](size_t frame, Image&& image) {
+                     REQUIRE(frame == next_frame++);
+                     Compare(image,
+                             Render(kTestsDir / "box/cube.obj", cameras[frame], rasterized));
+                 });
+    CHECK(next_frame == cameras.size());
+}
+
+TEST_CASE("Scene cache") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    SceneCache cache(1);
+    auto box = cache.Get(kTestsDir / "box/cube.obj");
+    CHECK(cache.Get(kTestsDir / "box/../box/cube.obj") == box);
+    CHECK(cache.Hits() == 1);
+
+    auto triangle = cache.Get(kTestsDir / "triangle/scene.obj");
+    CHECK(cache.Size() == 1);
+    // the evicted scene stays usable by whoever still holds it
+    CHECK(box->GetSphereObjects().size() == 2);
+    CHECK(cache.Get(kTestsDir / "box/cube.obj") != triangle);
+    CHECK(cache.Misses() == 3);
+}
+
+TEST_CASE("Scene cache reloads edited materials") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto dir = std::filesystem::temp_directory_path() / "raytracer_scene_cache";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    std::filesystem::copy(kTestsDir / "box/cube.obj", dir);
+    std::filesystem::copy(kTestsDir / "box/CornellBox-Sphere.mtl", dir);
+    const auto mtl_path = dir / "CornellBox-Sphere.mtl";
+
+    SceneCache cache(2);
+    // concurrent requests for one scene share a single parse
+    std::vector<std::shared_ptr<const Scene>> scenes(4);
+    std::vector<std::thread> threads;
+    for (auto& scene : scenes) {
+        threads.emplace_back([&cache, &scene, &dir] { scene = cache.Get(dir / "cube.obj"); });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (const auto& scene : scenes) {
+        CHECK(scene == scenes[0]);
+    }
+    CHECK(cache.Misses() == 1);
+
+    std::stringstream mtl;
+    mtl << std::ifstream(mtl_path).rdbuf();
+    std::string text = mtl.str();
+    text.replace(text.find("Kd 0.7250 0.9100 0.8800"), 23, "Kd 0.1000 0.2000 0.3000");
+    const auto mtl_time = std::filesystem::last_write_time(mtl_path);
+    std::ofstream(mtl_path) << text;
+    std::filesystem::last_write_time(mtl_path, mtl_time + std::chrono::seconds(1));
+
+    auto edited = cache.Get(dir / "cube.obj");
+    CHECK(edited != scenes[0]);
+    CHECK(cache.Misses() == 2);
+    CHECK(edited->GetMaterials().at("floor").diffuse_color[2] == .3);
+    CHECK(cache.Get(dir / "cube.obj") == edited);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Tile farm") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    TileFarmOptions farm_opts{.workers = 3, .tile_size = 24};
+    for (auto mode : {RenderMode::kFull, RenderMode::kDepth}) {
+        RenderOptions render_opts{.depth = 4, .mode = mode};
+        Compare(RenderTileFarm(kTestsDir / "box/cube.obj", camera_opts, render_opts, farm_opts),
+                Render(kTestsDir / "box/cube.obj", camera_opts, render_opts));
+    }
+
+    RenderOptions cropped{.depth = 4,
+                          .crop = CropWindow{30, 10, 70, 50},
+                          .normalization = 1.5};
+    Compare(RenderTileFarm(kTestsDir / "box/cube.obj", camera_opts, cropped, farm_opts),
+            Render(kTestsDir / "box/cube.obj", camera_opts, cropped));
+
+    // options that change the image have to reach the workers
+    RenderOptions pruned{.depth = 9, .min_path_weight = .5};
+    CHECK(DiffImages(RenderTileFarm(kTestsDir / "box/cube.obj", camera_opts, pruned, farm_opts),
+                     Render(kTestsDir / "box/cube.obj", camera_opts, pruned), 1.)
+              .mismatched == 0);
+    RenderOptions approximate{.depth = 4,
+                              .rasterize_primary = true,
+                              .shadow_cache = false,
+                              .shadow_maps = ShadowMapOptions{.resolution = 16, .bias = 1}};
+    CHECK(DiffImages(RenderTileFarm(kTestsDir / "box/cube.obj", camera_opts, approximate,
+                                    farm_opts),
+                     Render(kTestsDir / "box/cube.obj", camera_opts, approximate), 1.)
+              .mismatched == 0);
+
+    // every idle worker duplicates running tiles, results must not change
+    farm_opts.slow_tile_seconds = 0;
+    Compare(RenderTileFarm(kTestsDir / "box/cube.obj", camera_opts, {4}, farm_opts),
+            Render(kTestsDir / "box/cube.obj", camera_opts, {4}));
+
+    farm_opts.worker_command = {"false"};
+    CHECK_THROWS(RenderTileFarm(kTestsDir / "box/cube.obj", camera_opts, {4}, farm_opts));
+
+    // results of a wrong or missing size are retried as protocol errors
+    for (std::string size : {"", "x", "1", "18446744073709551615"}) {
+        farm_opts.worker_command = {
+            "sh", "-c",
+            "while read -r command id rest; do [ \"$command\" = TILE ] && echo \"RESULT $id " +
+                size + "\"; done"};
+        CHECK_THROWS_WITH(RenderTileFarm(kTestsDir / "box/cube.obj", camera_opts, {4}, farm_opts),
+                          Catch::Matchers::ContainsSubstring("protocol error"));
+    }
+
+    // hung workers are killed and their tiles retried until attempts run out
+    farm_opts.worker_command = {"sh", "-c", "cat > /dev/null"};
+    farm_opts.tile_timeout_seconds = .1;
+    CHECK_THROWS(RenderTileFarm(kTestsDir / "box/cube.obj", camera_opts, {4}, farm_opts));
+}
+
+TEST_CASE("Async render") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{.depth = 4, .tile_size = 40};
+
+    std::atomic<size_t> tiles = 0;
+    std::atomic<size_t> last_done = 0;
+    std::atomic<size_t> total = 0;
+    RenderCallbacks callbacks{
+        .on_tile = [&](size_t, const Tile&, const FrameBuffer&) { ++tiles; },
+        .on_progress =
+            [&](size_t done, size_t all) {
+                last_done = std::max(last_done.load(), done);
+                total = all;
+            }};
+    auto job = RenderAsync(kTestsDir / "box/cube.obj", camera_opts, render_opts, callbacks);
+    Compare(job.Get(), Render(kTestsDir / "box/cube.obj", camera_opts, {4}));
+    CHECK(tiles == 12);
+    CHECK(last_done == 12);
+    CHECK(total == 12);
+
+    std::stop_source stop;
+    callbacks.on_tile = [&](size_t, const Tile&, const FrameBuffer&) { stop.request_stop(); };
+    auto cancelled =
+        RenderAsync(kTestsDir / "box/cube.obj", camera_opts, render_opts, callbacks, stop.get_token());
+    CHECK_THROWS_AS(cancelled.Get(), RenderCancelled);
+
+    auto dropped = RenderAsync(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    dropped.Cancel();
+    dropped.Wait();
+    CHECK(dropped.IsReady());
+}
+
+TEST_CASE("Empty frames") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const Scene scene = ReadScene(kTestsDir / "box/cube.obj");
+    CameraOptions camera_opts{.screen_width = 64,
+                              .screen_height = 48,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    CameraOptions empty = camera_opts;
+    empty.screen_width = 0;
+
+    std::vector<Image> images;
+    RenderFrames(scene, {camera_opts, empty, camera_opts}, {.depth = 4, .threads = 2},
+                 [&](size_t, Image&& image) { images.push_back(std::move(image)); });
+    REQUIRE(images.size() == 3);
+    CHECK(images[1].Width() == 0);
+    Compare(images[2], images[0]);
+
+    CHECK(Render(kTestsDir / "box/cube.obj", empty, {4}).Width() == 0);
+    empty.screen_width = -1;
+    CHECK_THROWS_AS(RenderScene(scene, empty, {4}), std::invalid_argument);
+}
+
+TEST_CASE("Path weight pruning") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions camera_opts{.screen_width = 320,
+                              .screen_height = 240,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    const Scene scene = ReadScene(kTestsDir / "box/cube.obj");
+    auto render = [&](double min_path_weight, RenderStats* stats) {
+        std::optional<Image> output;
+        RenderFrames(
+            scene, {camera_opts}, {.depth = 9, .min_path_weight = min_path_weight},
+            [&](size_t, Image&& image) { output = std::move(image); },
+            {.on_finish = [&](const RenderStats& finished) { *stats = finished; }});
+        return std::move(output.value());
+    };
+
+    RenderStats exact;
+    RenderStats pruned;
+    Image reference = render(0., &exact);
+    Image approximate = render(.1, &pruned);
+    CHECK(exact.camera_rays == 320 * 240);
+    // most materials of the box have zero reflection and refraction albedo
+    CHECK(exact.pruned_rays > exact.secondary_rays);
+    CHECK(pruned.secondary_rays < exact.secondary_rays);
+    CHECK(pruned.secondary_rays + pruned.pruned_rays < exact.secondary_rays + exact.pruned_rays);
+    Compare(approximate, reference);
+}
+
+TEST_CASE("Dynamic scene") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions camera_opts{.screen_width = 320,
+                              .screen_height = 240,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    const Scene scene = ReadScene(kTestsDir / "box/cube.obj");
+    const Image reference = RenderScene(scene, camera_opts, {4});
+    DynamicScene dynamic(scene, 1);
+    Compare(RenderScene(dynamic, camera_opts, {4}), reference);
+
+    // one edit touches a path of the hierarchy, not the whole scene
+    uint64_t refits = dynamic.GetRefitCount();
+    dynamic.TransformSphere(1, Translation({0., .3, 0.}));
+    CHECK(dynamic.GetRefitCount() - refits < dynamic.GetNodes().size());
+    CHECK(dynamic.GetSphere(1).sphere.GetCenter()[1] > .5);
+    dynamic.TransformLight(0, Translation({.5, 0., 0.}));
+
+    SphereObject sphere = dynamic.GetSphere(0);
+    dynamic.RemoveSphere(0);
+    CHECK_THROWS(dynamic.GetSphere(0));
+    SceneItemId readded = dynamic.AddSphere(sphere);
+    SceneItemId extra = dynamic.AddObject(scene.GetObjects()[0]);
+    dynamic.TransformObject(extra, Translation({0., 10., 0.}));
+
+    dynamic.TransformSphere(1, Translation({0., -.3, 0.}));
+    dynamic.TransformLight(0, Translation({-.5, 0., 0.}));
+    CHECK(readded == 0);
+    Compare(RenderScene(dynamic, camera_opts, {4}), reference);
+
+    dynamic.RemoveObject(extra);
+    dynamic.Rebuild();
+    Compare(RenderScene(dynamic, camera_opts, {4}), reference);
+}
+
+TEST_CASE("Dynamic scene stays compact") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const Scene scene = ReadScene(kTestsDir / "box/cube.obj");
+    DynamicScene dynamic(scene, 1);
+    // reachable leaves and the summed half area of the reachable boxes
+    auto walk = [&dynamic](size_t* empty_leaves) {
+        std::span<const BvhNode> nodes = dynamic.GetNodes();
+        double area = 0;
+        std::vector<uint32_t> stack{dynamic.GetRoot()};
+        while (!stack.empty()) {
+            const BvhNode& node = nodes[stack.back()];
+            stack.pop_back();
+            if (!node.box.IsEmpty()) {
+                Vector size = node.box.max - node.box.min;
+                area += size[0] * size[1] + size[1] * size[2] + size[2] * size[0];
+            }
+            if (node.IsLeaf()) {
+                *empty_leaves += node.primitives.empty();
+            } else {
+                stack.push_back(node.left);
+                stack.push_back(node.right);
+            }
+        }
+        return area;
+    };
+
+    for (SceneItemId id = 0; id < 4; ++id) {
+        dynamic.RemoveObject(id);
+    }
+    dynamic.RemoveSphere(0);
+    size_t empty_leaves = 0;
+    walk(&empty_leaves);
+    CHECK(empty_leaves == 0);
+
+    // a sphere walking away in small steps is reinserted instead of stretching its old
+    // subtree, the hierarchy stays close to a fresh build
+    for (int i = 0; i < 40; ++i) {
+        dynamic.TransformSphere(1, Translation({.25, 0., 0.}));
+    }
+    double drifted = walk(&empty_leaves);
+    dynamic.Rebuild();
+    double rebuilt = walk(&empty_leaves);
+    CHECK(drifted < 1.2 * rebuilt);
+    CHECK(empty_leaves == 0);
+}
+
+TEST_CASE("Float output") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    FloatImage depth =
+        RenderFloat(kTestsDir / "box/cube.obj", camera_opts, {1, RenderMode::kDepth});
+    REQUIRE(depth.channels == 1);
+    // the back wall of the box is at z = -1, straight ahead of the camera
+    CHECK(std::abs(depth.Get(60, 80, 0) - 2.75) < .1);
+
+    FloatImage radiance = RenderFloat(kTestsDir / "box/cube.obj", camera_opts, {4});
+    REQUIRE(radiance.channels == 3);
+    CHECK(*std::max_element(radiance.values.begin(), radiance.values.end()) > 1.f);
+
+    const auto dir = std::filesystem::temp_directory_path();
+    for (const FloatImage* image : {&depth, &radiance}) {
+        WritePfm(*image, dir / "raytracer_float.pfm", {.threads = 3, .rows_per_chunk = 7});
+        CHECK(ReadPfm(dir / "raytracer_float.pfm").values == image->values);
+        for (auto compression : {ExrCompression::kNone, ExrCompression::kZip}) {
+            WriteExr(*image, dir / "raytracer_float.exr",
+                     {.threads = 3, .compression = compression});
+            CHECK(ReadExr(dir / "raytracer_float.exr").values == image->values);
+        }
+    }
+    std::filesystem::remove(dir / "raytracer_float.pfm");
+    std::filesystem::remove(dir / "raytracer_float.exr");
+}
+
+TEST_CASE("Regression harness") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    for (const GoldenCase& golden : GetGoldenCases(kTestsDir)) {
+        CHECK(std::filesystem::exists(golden.scene));
+        CHECK(std::filesystem::exists(golden.reference));
+    }
+
+    Image expected(kTestsDir / "box/cube.png");
+    Image actual = expected;
+    actual.SetPixel(RGB{255, 255, 255}, 0, 0);
+    actual.SetPixel(RGB{0, 0, 0}, 479, 639);
+    ImageDiff diff = DiffImages(actual, expected, 2., 3);
+    CHECK(diff.pixels == 640 * 480);
+    CHECK(diff.mismatched == 2);
+    CHECK(diff.max_distance > 100);
+    CHECK(DiffImages(expected, expected).Similarity() == 1.);
+    CHECK_THROWS(DiffImages(Image(10, 10), expected));
+
+    const auto path = std::filesystem::temp_directory_path() / "raytracer_baseline.txt";
+    WriteBaseline({{"box", {100., 1e6, 20000, .999}}}, path);
+    Baseline baseline = ReadBaseline(path);
+    std::filesystem::remove(path);
+    REQUIRE(baseline.contains("box"));
+    CHECK(baseline["box"].peak_rss_kb == 20000);
+
+    CHECK(CheckRegression("box", {105., 1e6, 20000, 1.}, baseline).empty());
+    CHECK(CheckRegression("box", {130., 1e6, 20000, 1.}, baseline).size() == 1);
+    CHECK(CheckRegression("box", {130., 1e6, 20000, 1.}, baseline,
+                          {.max_slowdown_percent = 50})
+              .empty());
+    CHECK(CheckRegression("box", {100., 1e6, 20000, .9}, baseline).size() == 1);
+    CHECK(CheckRegression("new", {100., 1e6, 20000, 1.}, baseline).empty());
+}
+
+TEST_CASE("Render trace") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto count = [](const std::string& text, const std::string& what) {
+        size_t found = 0;
+        for (size_t pos = text.find(what); pos != std::string::npos;
+             pos = text.find(what, pos + 1)) {
+            ++found;
+        }
+        return found;
+    };
+    CameraOptions camera_opts{.screen_width = 640, .screen_height = 480,
+                              .fov = std::numbers::pi / 3, .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{.depth = 4, .threads = 3, .tile_size = 64};
+
+    StartTracing();
+    Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    StopTracing();
+    std::string json = ChromeTraceJson();
+    CHECK(count(json, "\"name\":\"tile\"") == 80);
+    CHECK(count(json, "\"name\":\"parse scene\"") == 1);
+    CHECK(count(json, "\"name\":\"load materials\"") == 1);
+    CHECK(count(json, "\"name\":\"prepare frame\"") == 1);
+    CHECK(count(json, "\"name\":\"tonemap\"") == 1);
+    CHECK(count(json, "\"name\":\"render worker\"") == 3);
+    CHECK(json.front() == '{');
+    CHECK(json.find("\"args\":{\"frame\":0,\"x\":64,\"y\":0}") != std::string::npos);
+
+    size_t recorded = GetTraceEventCount();
+    Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    CHECK(GetTraceEventCount() == recorded);
+    StartTracing();
+    CHECK(GetTraceEventCount() == 0);
+
+    // buffers of exited threads are dropped on restart, their number does not grow
+    auto buffer_count = [] {
+        trace_detail::Registry& registry = trace_detail::GetRegistry();
+        std::lock_guard lock(registry.mutex);
+        return registry.threads.size();
+    };
+    Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    size_t buffers = buffer_count();
+    for (int i = 0; i < 3; ++i) {
+        StartTracing();
+        Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+        CHECK(buffer_count() == buffers);
+    }
+    StopTracing();
+}
+
+TEST_CASE("Render memory budget") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto path = kTestsDir / "box/cube.obj";
+    CameraOptions camera_opts{.screen_width = 640, .screen_height = 480,
+                              .fov = std::numbers::pi / 3, .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{.depth = 4, .threads = 2};
+
+    std::vector<CameraOptions> cameras(5, camera_opts);
+    CHECK(GetFramesFootprint(cameras, render_opts) == 3 * FrameBytes(640, 480));
+    RenderFootprint footprint = GetRenderFootprint(ReadScene(path), {camera_opts}, render_opts);
+    CHECK(footprint.frames == FrameBytes(640, 480));
+
+    render_opts.memory_budget = FrameBytes(640, 480) / 2;
+    CHECK_THROWS_AS(Render(path, camera_opts, render_opts), MemoryBudgetExceeded);
+    render_opts.memory_budget = footprint.Total() - 1;
+    CHECK_THROWS_AS(Render(path, camera_opts, render_opts), MemoryBudgetExceeded);
+    render_opts.memory_budget = footprint.Total() + (1 << 20);
+    Compare(Render(path, camera_opts, render_opts), Image(kTestsDir / "box/cube.png"));
+}
+
+TEST_CASE("Rasterized primary visibility") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    auto check = [](const std::filesystem::path& path, const CameraOptions& camera_opts,
+                    RenderOptions render_opts) {
+        Image traced = Render(path, camera_opts, render_opts);
+        render_opts.rasterize_primary = true;
+        Image rasterized = Render(path, camera_opts, render_opts);
+        CHECK(DiffImages(rasterized, traced, 1.).mismatched == 0);
+    };
+
+    CameraOptions box_camera{.screen_width = 640, .screen_height = 480,
+                             .fov = std::numbers::pi / 3, .look_from = {0., .7, 1.75},
+                             .look_to = {0., .7, 0.}};
+    check(kTestsDir / "box/cube.obj", box_camera, {4});
+    check(kTestsDir / "box/cube.obj", box_camera, {1, RenderMode::kNormal});
+
+    CameraOptions inside_camera{.screen_width = 500, .screen_height = 500,
+                                .look_from = {-.5, 1.5, .98}, .look_to = {0., 1., 0.}};
+    check(kTestsDir / "classic_box/CornellBox.obj", inside_camera, {4});
+    check(kTestsDir / "classic_box/CornellBox.obj", inside_camera, {1, RenderMode::kDepth});
+
+    CameraOptions triangle_camera{.screen_width = 640, .screen_height = 480,
+                                  .look_from = {0., 2., 0.}, .look_to = {0., 0., 0.}};
+    check(kTestsDir / "triangle/scene.obj", triangle_camera, {1, RenderMode::kNormal});
+
+    CameraOptions deer_camera{.screen_width = 500, .screen_height = 500,
+                              .look_from = {100., 200., 150.}, .look_to = {0., 100., 0.}};
+    check(kTestsDir / "deer/CERF_Free.obj", deer_camera, {1, RenderMode::kDepth});
+    check(kTestsDir / "deer/CERF_Free.obj", deer_camera, {1});
+}
+
+TEST_CASE("Shadow occluder cache") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    CameraOptions camera_opts{.screen_width = 500, .screen_height = 500,
+                              .look_from = {-.5, 1.5, 1.98}, .look_to = {0., 1., 0.}};
+    auto render = [&](bool shadow_cache, RenderStats* stats) {
+        std::optional<Image> image;
+        RenderOptions render_opts{.depth = 4, .threads = 2, .shadow_cache = shadow_cache};
+        RenderFrames(
+            kTestsDir / "distorted_box/CornellBox.obj", {camera_opts}, render_opts,
+            [&](size_t, Image&& frame) { image = std::move(frame); },
+            {.on_finish = [&](const RenderStats& finished) { *stats = finished; }});
+        return std::move(image.value());
+    };
+
+    RenderStats uncached;
+    RenderStats cached;
+    Image expected = render(false, &uncached);
+    Image actual = render(true, &cached);
+    CHECK(DiffImages(actual, expected, 1.).mismatched == 0);
+    CHECK(cached.shadow_rays == uncached.shadow_rays);
+    CHECK(uncached.shadow_cache_lookups == 0);
+    CHECK(cached.shadow_cache_hits > 0);
+    CHECK(cached.shadow_cache_hits <= cached.shadow_cache_lookups);
+    CHECK(cached.ShadowCacheHitRate() > .5);
+}
+
+TEST_CASE("Specialized render kernels") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const Scene box = ReadScene(kTestsDir / "box/cube.obj");
+    SceneFeatures box_features = GetSceneFeatures(box);
+    CHECK(box_features.spheres);
+    CHECK(box_features.refraction);
+    SceneFeatures cornell_features =
+        GetSceneFeatures(ReadScene(kTestsDir / "classic_box/CornellBox.obj"));
+    CHECK_FALSE(cornell_features.spheres);
+    CHECK_FALSE(cornell_features.normals);
+    CHECK(GetSceneFeatures(ReadScene(kTestsDir / "deer/CERF_Free.obj")).normals);
+
+    RenderOptions full{.depth = 4};
+    CHECK(SelectTileKernel<Scene>(cornell_features, full) !=
+          SelectTileKernel<Scene>(SceneFeatures{}, full));
+    CHECK(SelectTileKernel<Scene>(cornell_features, {.depth = 1, .mode = RenderMode::kDepth}) ==
+          (&TraceTileKernel<KernelConfig{RenderMode::kDepth, false, true, true}, Scene>));
+
+    // every specialization has to trace exactly what the general kernel does
+    CameraOptions camera_opts{.screen_width = 320, .screen_height = 240,
+                              .fov = std::numbers::pi / 3, .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    std::array<Vector, 3> m = GetCameraMatrix(camera_opts);
+    Tile tile{0, 0, 320, 240};
+    for (RenderOptions render_opts :
+         {RenderOptions{.depth = 4}, RenderOptions{.depth = 1},
+          RenderOptions{.depth = 9}, RenderOptions{.depth = 1, .mode = RenderMode::kNormal}}) {
+        FrameBuffer specialized(320, 240);
+        FrameBuffer general(320, 240);
+        SelectTileKernel<Scene>(box_features, render_opts)(box, camera_opts, render_opts, m, tile,
+                                                           &specialized, nullptr, nullptr,
+                                                           nullptr, nullptr);
+        RenderOptions runtime_depth = render_opts;
+        runtime_depth.depth = 0;
+        SelectTileKernel<Scene>(SceneFeatures{}, runtime_depth)(
+            box, camera_opts, render_opts, m, tile, &general, nullptr, nullptr, nullptr,
+            nullptr);
+        CHECK(DiffImages(ToImage(specialized, render_opts.mode),
+                         ToImage(general, render_opts.mode), 1.)
+                  .mismatched == 0);
+    }
+}
+
+TEST_CASE("Scene generator") {
+    const auto dir = std::filesystem::temp_directory_path();
+    GeneratorOptions options{.triangles = 500,
+                             .spheres = 20,
+                             .lights = 3,
+                             .materials = 8,
+                             .distribution = SceneDistribution::kClustered,
+                             .normals = true,
+                             .seed = 7};
+    GenerateScene(dir / "generated_a.obj", options);
+    GenerateScene(dir / "generated_b.obj", options);
+    options.seed = 8;
+    GenerateScene(dir / "generated_c.obj", options);
+
+    Scene scene = ReadScene(dir / "generated_a.obj");
+    CHECK(scene.GetObjects().size() == 500);
+    CHECK(scene.GetSphereObjects().size() == 20);
+    CHECK(scene.GetLights().size() == 3);
+    CHECK(scene.GetMaterials().size() == 8);
+    CHECK(GetSceneFeatures(scene).normals);
+
+    // everything after the mtllib line, which names the file itself
+    auto contents = [&](std::string_view name) {
+        std::ifstream file(dir / name, std::ios::binary);
+        std::string text(std::istreambuf_iterator<char>(file), {});
+        return text.substr(text.find('\n'));
+    };
+    CHECK(contents("generated_a.obj") == contents("generated_b.obj"));
+    CHECK(contents("generated_a.obj") != contents("generated_c.obj"));
+
+    // the hierarchy has to see the generated scene exactly as the brute-force one does
+    CameraOptions camera_opts = GetGeneratedSceneCamera(options, 160, 120);
+    RenderOptions render_opts{.depth = 2};
+    Image image = RenderScene(DynamicScene(scene), camera_opts, render_opts);
+    CHECK(DiffImages(image, RenderScene(scene, camera_opts, render_opts), 1.).mismatched == 0);
+}
+
+TEST_CASE("Level of detail render") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const Scene scene = ReadScene(kTestsDir / "deer/CERF_Free.obj");
+    LodScene lod(scene);
+    REQUIRE(lod.GetMeshes()[0].levels.size() > 1);
+    RenderOptions render_opts{.depth = 1};
+
+    CameraOptions near{.screen_width = 250, .screen_height = 250,
+                       .look_from = {100., 200., 150.}, .look_to = {0., 100., 0.}};
+    lod.SetView(GetLodView(near));
+    CHECK(lod.GetSelectedTriangles() == scene.GetObjects().size());
+    CHECK(DiffImages(RenderScene(lod, near, render_opts), RenderScene(scene, near, render_opts),
+                     1.)
+              .mismatched == 0);
+
+    // far away the deer covers a few pixels and a coarse level looks the same
+    CameraOptions far = near;
+    far.look_from = Vector(1600., 1700., 2400.);
+    LodView view = GetLodView(far);
+    view.full_detail = true;
+    lod.SetView(view);
+    Image full = RenderScene(lod, far, render_opts);
+    CHECK(lod.GetSelectedTriangles() == scene.GetObjects().size());
+    lod.SetView(GetLodView(far));
+    CHECK(lod.GetSelectedTriangles() < scene.GetObjects().size());
+    CHECK(DiffImages(RenderScene(lod, far, render_opts), full).Similarity() > .99);
+}
+
+TEST_CASE("Shadow maps") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const Scene box = ReadScene(kTestsDir / "box/cube.obj");
+    ShadowMapOptions map_opts{.resolution = 32};
+    ShadowMaps rasterized = RasterizeShadowMaps(map_opts, box, 2);
+    ShadowMaps cast = CastShadowMaps(map_opts, box.GetLights(), 2,
+                                     [&box](const Ray& ray) { return GetClosestHit(ray, box); });
+    bool same = true;
+    for (size_t light = 0; light < box.GetLights().size(); ++light) {
+        for (int face = 0; face < 6; ++face) {
+            for (int y = 0; y < 32; ++y) {
+                for (int x = 0; x < 32; ++x) {
+                    same = same && rasterized.GetDepth(light, face, x, y) ==
+                                       cast.GetDepth(light, face, x, y);
+                }
+            }
+        }
+    }
+    CHECK(same);
+
+    // the error against exact shadows stays small on the test scenes
+    CameraOptions camera_opts{.screen_width = 500, .screen_height = 500,
+                              .look_from = {-.5, 1.5, .98}, .look_to = {0., 1., 0.}};
+    const Scene cornell = ReadScene(kTestsDir / "classic_box/CornellBox.obj");
+    RenderOptions render_opts{.depth = 4};
+    Image exact = RenderScene(cornell, camera_opts, render_opts);
+    render_opts.shadow_maps = ShadowMapOptions{};
+    RenderStats stats;
+    std::optional<Image> approximate;
+    RenderFrames(
+        cornell, {camera_opts}, render_opts,
+        [&](size_t, Image&& image) { approximate = std::move(image); },
+        {.on_finish = [&](const RenderStats& finished) { stats = finished; }});
+    CHECK(stats.shadow_rays == 0);
+    CHECK(stats.shadow_map_lookups > 0);
+    CHECK(DiffImages(approximate.value(), exact).Similarity() > .98);
+}
+
+TEST_CASE("Heatmap and ray tree") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const Scene scene = ReadScene(kTestsDir / "mirrors/scene.obj");
+    CameraOptions camera_opts{.screen_width = 160, .screen_height = 120,
+                              .look_from = {2., 1.5, -.1}, .look_to = {1., 1.2, -2.8}};
+    std::array<Vector, 3> m = GetCameraMatrix(camera_opts);
+    Tile tile{0, 0, 160, 120};
+    auto heatmap = [&](HeatmapMetric metric, RenderStats* stats) {
+        FrameBuffer frame(160, 120);
+        RenderOptions render_opts{.depth = 9, .mode = RenderMode::kHeatmap, .heatmap = metric};
+        TraceTile(scene, camera_opts, render_opts, m, tile, &frame, stats);
+        return frame;
+    };
+    auto sum = [](const FrameBuffer& frame) {
+        double total = 0;
+        for (int i = 0; i < frame.Height(); ++i) {
+            for (int j = 0; j < frame.Width(); ++j) {
+                total += frame.Get(i, j)[0];
+            }
+        }
+        return total;
+    };
+
+    RenderStats stats;
+    FrameBuffer tests = heatmap(HeatmapMetric::kIntersectionTests, &stats);
+    CHECK(sum(tests) == stats.intersection_tests);
+    FrameBuffer rays = heatmap(HeatmapMetric::kRays, nullptr);
+    CHECK(sum(rays) == stats.camera_rays + stats.secondary_rays + stats.shadow_rays);
+    FrameBuffer depth = heatmap(HeatmapMetric::kDepth, nullptr);
+    CHECK(stats.max_depth > 2);
+
+    // the ray tree of the most expensive pixel accounts for all of its work
+    int x = 0;
+    int y = 0;
+    for (int i = 0; i < 120; ++i) {
+        for (int j = 0; j < 160; ++j) {
+            if (rays.Get(i, j)[0] > rays.Get(y, x)[0]) {
+                x = j;
+                y = i;
+            }
+        }
+    }
+    RayTree tree = TraceRayTree(scene, camera_opts, {.depth = 9}, x, y);
+    REQUIRE(tree.nodes.size() == rays.Get(y, x)[0]);
+    CHECK(tree.nodes[0].kind == RayKind::kCamera);
+    CHECK(tree.nodes[0].parent == -1);
+    CHECK(tree.nodes[0].material != nullptr);
+    int max_depth = 0;
+    bool consistent = true;
+    for (size_t i = 1; i < tree.nodes.size(); ++i) {
+        const RayTreeNode& node = tree.nodes[i];
+        max_depth = std::max(max_depth, node.depth);
+        consistent = consistent && node.parent >= 0 && node.parent < static_cast<int>(i);
+        if (node.kind == RayKind::kReflection) {
+            const RayTreeNode& parent = tree.nodes[node.parent];
+            consistent = consistent && node.depth == parent.depth + 1 &&
+                         Length(node.origin - parent.hit->GetPosition()) < 1e-3;
+        }
+    }
+    CHECK(consistent);
+    CHECK(max_depth == depth.Get(y, x)[0]);
+    CHECK_FALSE(tree.GetChildren(0).empty());
+    CHECK(ToImage(tests, RenderMode::kHeatmap).GetPixel(y, x) != RGB{0, 0, 255});
+}
+
+TEST_CASE("Polygon primitives") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const auto path = kTestsDir / "distorted_box/CornellBox.obj";
+    const Scene triangles = ReadScene(path);
+    const Scene polygons = ReadScene(path, {.polygons = true});
+    REQUIRE_FALSE(polygons.GetPolygonObjects().empty());
+    CHECK(polygons.GetObjects().size() + polygons.GetPolygonObjects().size() <
+          triangles.GetObjects().size());
+
+    CameraOptions camera_opts{.screen_width = 250, .screen_height = 250,
+                              .look_from = {-.5, 1.5, 1.98}, .look_to = {0., 1., 0.}};
+    auto render = [&](const Scene& scene, RenderOptions render_opts, RenderStats* stats) {
+        std::optional<Image> image;
+        RenderFrames(
+            scene, {camera_opts}, render_opts,
+            [&](size_t, Image&& frame) { image = std::move(frame); },
+            {.on_finish = [&](const RenderStats& finished) { *stats = finished; }});
+        return std::move(image.value());
+    };
+    RenderStats triangle_stats;
+    RenderStats polygon_stats;
+    RenderOptions render_opts{.depth = 4};
+    Image expected = render(triangles, render_opts, &triangle_stats);
+    CHECK(DiffImages(render(polygons, render_opts, &polygon_stats), expected).Similarity() > .999);
+    CHECK(polygon_stats.intersection_tests < triangle_stats.intersection_tests);
+
+    // screen bins and rasterized shadow maps see the polygons too
+    RenderStats unused;
+    render_opts.rasterize_primary = true;
+    render_opts.shadow_maps = ShadowMapOptions{.resolution = 64};
+    Image rasterized = render(polygons, render_opts, &unused);
+    render_opts.rasterize_primary = false;
+    CHECK(DiffImages(rasterized, render(polygons, render_opts, &unused), 1.).mismatched == 0);
+    ShadowMaps cast =
+        CastShadowMaps(*render_opts.shadow_maps, polygons.GetLights(), 2,
+                       [&polygons](const Ray& ray) { return GetClosestHit(ray, polygons); });
+    ShadowMaps rasterized_maps = RasterizeShadowMaps(*render_opts.shadow_maps, polygons, 2);
+    bool same = true;
+    for (int face = 0; face < 6; ++face) {
+        for (int y = 0; y < 64; ++y) {
+            for (int x = 0; x < 64; ++x) {
+                same = same &&
+                       cast.GetDepth(0, face, x, y) == rasterized_maps.GetDepth(0, face, x, y);
+            }
+        }
+    }
+    CHECK(same);
+    // the hierarchy traces them as their triangles
+    CHECK(DiffImages(RenderScene(DynamicScene(polygons), camera_opts, {.depth = 4}), expected)
+              .Similarity() > .999);
+}
+
+TEST_CASE("Crop window") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const Scene scene = ReadScene(kTestsDir / "box/cube.obj");
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    const CropWindow crop{37, 21, 90, 70};
+
+    for (RenderMode mode : {RenderMode::kFull, RenderMode::kDepth, RenderMode::kHeatmap}) {
+        RenderOptions render_opts{.depth = 4, .mode = mode, .tile_size = 32};
+        std::optional<Image> full;
+        double normalization = 0;
+        RenderFrames(scene, {camera_opts}, render_opts,
+                     [&](size_t, Image&& image) { full = std::move(image); },
+                     {.on_frame_buffer = [&](size_t, const FrameBuffer& buffer) {
+                         normalization = GetNormalization(buffer, mode);
+                     }});
+
+        size_t tiles = 0;
+        render_opts.crop = crop;
+        render_opts.normalization = normalization;
+        std::optional<Image> cropped;
+        RenderFrames(scene, {camera_opts}, render_opts,
+                     [&](size_t, Image&& image) { cropped = std::move(image); },
+                     {.on_tile =
+                          [&](size_t, const Tile& tile, const FrameBuffer& buffer) {
+                              ++tiles;
+                              CHECK(buffer.Left() <= tile.x);
+                              CHECK(tile.x + tile.width <= crop.x + crop.width);
+                          }});
+        REQUIRE(cropped->Width() == crop.width);
+        REQUIRE(cropped->Height() == crop.height);
+        // the crop covers columns 1 to 3 and rows 0 to 2 of the 32 pixel tile grid
+        CHECK(tiles == 9);
+        bool same = true;
+        for (int y = 0; y < crop.height; ++y) {
+            for (int x = 0; x < crop.width; ++x) {
+                same = same && cropped->GetPixel(y, x) == full->GetPixel(crop.y + y, crop.x + x);
+            }
+        }
+        CHECK(same);
+    }
+
+    RenderOptions outside{.depth = 4, .crop = CropWindow{100, 0, 61, 10}};
+    CHECK_THROWS_AS(RenderScene(scene, camera_opts, outside), std::invalid_argument);
+    for (double normalization : {0., -1., std::numeric_limits<double>::quiet_NaN(),
+                                 std::numeric_limits<double>::infinity()}) {
+        RenderOptions bad{.depth = 4, .mode = RenderMode::kDepth, .normalization = normalization};
+        CHECK_THROWS_AS(RenderScene(scene, camera_opts, bad), std::invalid_argument);
+    }
+}
+
+TEST_CASE("Pixel buffer output") {
+    static const auto kTestsDir = GetFileDir(__FILE__);
+    const Scene scene = ReadScene(kTestsDir / "box/cube.obj");
+    CameraOptions camera_opts{.screen_width = 160,
+                              .screen_height = 120,
+                              .fov = std::numbers::pi / 3,
+                              .look_from = {0., .7, 1.75},
+                              .look_to = {0., .7, 0.}};
+    RenderOptions render_opts{.depth = 4};
+    const Image expected = RenderScene(scene, camera_opts, render_opts);
+    const int width = camera_opts.screen_width;
+    const int height = camera_opts.screen_height;
+
+    auto matches = [&](const std::vector<unsigned char>& pixels, size_t stride, size_t size,
+                       const Image& image) {
+        bool same = true;
+        for (int y = 0; y < image.Height(); ++y) {
+            for (int x = 0; x < image.Width(); ++x) {
+                const unsigned char* pixel = pixels.data() + y * stride + x * size;
+                same = same && image.GetPixel(y, x) == RGB{pixel[0], pixel[1], pixel[2]} &&
+                       (size == 3 || pixel[3] == 255);
+            }
+        }
+        return same;
+    };
+
+    std::vector<unsigned char> rgb(static_cast<size_t>(width) * height * 3);
+    RenderScene(scene, camera_opts, render_opts,
+                MakePackedBuffer(rgb.data(), width, height, PixelFormat::kRGB8));
+    CHECK(matches(rgb, width * 3, 3, expected));
+
+    // padded rows, the padding is left as it was
+    const size_t stride = width * 4 + 12;
+    std::vector<unsigned char> rgba(stride * height, 7);
+    const PixelBuffer rgba_buffer{rgba.data(), width, height, stride, PixelFormat::kRGBA8};
+    CameraOptions moved = camera_opts;
+    moved.look_from = {0.2, .7, 1.75};
+    const std::vector<PixelBuffer> outputs{
+        MakePackedBuffer(rgb.data(), width, height, PixelFormat::kRGB8), rgba_buffer};
+    RenderFrames(scene, {moved, camera_opts}, render_opts, outputs);
+    CHECK(matches(rgb, width * 3, 3, RenderScene(scene, moved, render_opts)));
+    CHECK(matches(rgba, stride, 4, expected));
+    CHECK(rgba[width * 4] == 7);
+    CHECK(rgba.back() == 7);
+
+    // linear values, the crop only needs a buffer of its own size
+    render_opts.mode = RenderMode::kDepth;
+    render_opts.crop = CropWindow{10, 20, 50, 40};
+    FloatImage depth;
+    std::vector<float> floats(50 * 40 * 3);
+    RenderFrames(scene, {camera_opts}, render_opts,
+                 std::vector{MakePackedBuffer(floats.data(), 50, 40, PixelFormat::kRGB32F)},
+                 {.on_frame_buffer = [&](size_t, const FrameBuffer& buffer) {
+                     depth = ToFloatImage(buffer, RenderMode::kDepth);
+                 }});
+    bool same = true;
+    for (int y = 0; y < 40; ++y) {
+        for (int x = 0; x < 50; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                same = same && floats[(y * 50 + x) * 3 + c] == depth.Get(y, x, 0);
+            }
+        }
+    }
+    CHECK(same);
+
+    CHECK_THROWS_AS(
+        RenderScene(scene, camera_opts, render_opts,
+                    MakePackedBuffer(floats.data(), width, height, PixelFormat::kRGB32F)),
+        std::invalid_argument);
+}
@@ -0,0 +1,215 @@
+#pragma once
+
+#include <options/camera_options.h>
+#include <scene.h>
+
+#include <vector.h>
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <vector>
+
+// Screen-space binning for rasterized primary visibility. A primitive is projected with
+// the same pinhole model as Convert and gets a conservative pixel rectangle; exact
+// coverage and depth are then resolved per pixel with the usual ray kernels, so the
+// visibility buffer holds exactly the hits a camera ray query would find.
+
+// inclusive pixel bounds, empty when x0 > x1 or y0 > y1
+struct ScreenRect {
+    int x0 = 0;
+    int y0 = 0;
+    int x1 = -1;
+    int y1 = -1;
+
+    bool IsEmpty() const {
+        return x0 > x1 || y0 > y1;
+    }
+};
+
+// Every tile lists the triangles, spheres and polygons that may cover one of its pixels,
+// in scene order so ties resolve the same way as in GetClosestHit.
+struct ScreenBins {
+    int tile_size = 0;
+    int tiles_x = 0;
+    std::vector<ScreenRect> triangle_rects;
+    std::vector<ScreenRect> sphere_rects;
+    std::vector<ScreenRect> polygon_rects;
+    std::vector<std::vector<uint32_t>> triangles;
+    std::vector<std::vector<uint32_t>> spheres;
+    std::vector<std::vector<uint32_t>> polygons;
+};
+
+namespace visibility_detail {
+
+// points closer to the eye plane than this are clipped, no camera ray hits them anyway
+constexpr double kNearPlane = 1e-15;
+
+struct Projector {
+    Vector from;
+    std::array<Vector, 3> m;
+    double scale_x;
+    double scale_y;
+    int width;
+    int height;
+
+    // camera space: x right, y up, z towards the viewer, visible points have z < 0
+    Vector ToCamera(const Vector& point) const {
+        Vector d = point - from;
+        return Vector(DotProduct(d, m[0]), DotProduct(d, m[1]), DotProduct(d, m[2]));
+    }
+
+    // inverse of Convert: pixel coordinates of the ray through a camera space point
+    std::array<double, 2> ToPixel(const Vector& camera_point) const {
+        double depth = -camera_point[2];
+        return {(camera_point[0] / depth / scale_x + 1) * width / 2 - 0.5,
+                (1 - camera_point[1] / depth / scale_y) * height / 2 - 0.5};
+    }
+
+    ScreenRect FullScreen() const {
+        return {0, 0, width - 1, height - 1};
+    }
+
+    // one pixel of slack around the projected bounds absorbs rounding
+    ScreenRect Bound(const std::vector<Vector>& camera_points) const {
+        constexpr double kInfinity = std::numeric_limits<double>::infinity();
+        double min_x = kInfinity;
+        double min_y = kInfinity;
+        double max_x = -kInfinity;
+        double max_y = -kInfinity;
+        for (const Vector& point : camera_points) {
+            auto [x, y] = ToPixel(point);
+            min_x = std::min(min_x, x);
+            min_y = std::min(min_y, y);
+            max_x = std::max(max_x, x);
+            max_y = std::max(max_y, y);
+        }
+        auto clamp = [](double value, int limit) {
+            return static_cast<int>(std::clamp(value, -1.0, static_cast<double>(limit)));
+        };
+        return {std::max(0, clamp(std::floor(min_x) - 1, width)),
+                std::max(0, clamp(std::floor(min_y) - 1, height)),
+                std::min(width - 1, clamp(std::ceil(max_x) + 1, width)),
+                std::min(height - 1, clamp(std::ceil(max_y) + 1, height))};
+    }
+};
+
+// part of a convex polygon in front of the near plane, projected
+ScreenRect ProjectConvex(const Projector& projector, std::span<const Vector> corners) {
+    std::array<Vector, Polygon::kMaxVertices> points;
+    const size_t size = corners.size();
+    int in_front = 0;
+    for (size_t i = 0; i < size; ++i) {
+        points[i] = projector.ToCamera(corners[i]);
+        in_front += points[i][2] < -kNearPlane;
+    }
+    if (in_front == 0) {
+        return {};
+    }
+    std::vector<Vector> clipped;
+    for (size_t i = 0; i < size; ++i) {
+        const Vector& current = points[i];
+        const Vector& next = points[(i + 1) % size];
+        bool current_in = current[2] < -kNearPlane;
+        bool next_in = next[2] < -kNearPlane;
+        if (current_in) {
+            clipped.push_back(current);
+        }
+        if (current_in != next_in) {
+            double t = (-kNearPlane - current[2]) / (next[2] - current[2]);
+            Vector crossing = current + (next - current) * t;
+            crossing[2] = -kNearPlane;
+            clipped.push_back(crossing);
+        }
+    }
+    return projector.Bound(clipped);
+}
+
+ScreenRect ProjectTriangle(const Projector& projector, const Triangle& triangle) {
+    std::array<Vector, 3> corners = {triangle[0], triangle[1], triangle[2]};
+    return ProjectConvex(projector, corners);
+}
+
+ScreenRect ProjectPolygon(const Projector& projector, const Polygon& polygon) {
+    std::array<Vector, Polygon::kMaxVertices> corners;
+    for (size_t i = 0; i < polygon.Size(); ++i) {
+        corners[i] = polygon[i];
+    }
+    return ProjectConvex(projector, std::span<const Vector>(corners.data(), polygon.Size()));
+}
+
+// bounding cube of the sphere; one straddling the near plane is treated as full screen
+ScreenRect ProjectSphere(const Projector& projector, const Sphere& sphere) {
+    std::vector<Vector> corners;
+    int in_front = 0;
+    for (int corner = 0; corner < 8; ++corner) {
+        Vector offset((corner & 1) ? 1 : -1, (corner & 2) ? 1 : -1, (corner & 4) ? 1 : -1);
+        corners.push_back(projector.ToCamera(sphere.GetCenter() + offset * sphere.GetRadius()));
+        in_front += corners.back()[2] < -kNearPlane;
+    }
+    if (in_front == 0) {
+        return {};
+    }
+    if (in_front < 8) {
+        return projector.FullScreen();
+    }
+    return projector.Bound(corners);
+}
+
+}  // namespace visibility_detail
+
+ScreenBins BinPrimitives(const Scene& scene, const CameraOptions& camera,
+                         const std::array<Vector, 3>& m, int tile_size) {
+    using namespace visibility_detail;
+
+    double aspect_ratio = static_cast<double>(camera.screen_width) / camera.screen_height;
+    Projector projector{camera.look_from,
+                        m,
+                        aspect_ratio * std::tan(camera.fov / 2),
+                        std::tan(camera.fov / 2),
+                        camera.screen_width,
+                        camera.screen_height};
+
+    ScreenBins bins;
+    bins.tile_size = tile_size;
+    bins.tiles_x = (camera.screen_width + tile_size - 1) / tile_size;
+    const int tiles_y = (camera.screen_height + tile_size - 1) / tile_size;
+    bins.triangles.resize(static_cast<size_t>(bins.tiles_x) * tiles_y);
+    bins.spheres.resize(bins.triangles.size());
+    bins.polygons.resize(bins.triangles.size());
+
+    auto add = [&](const ScreenRect& rect, uint32_t index,
+                   std::vector<std::vector<uint32_t>>* lists) {
+        if (rect.IsEmpty()) {
+            return;
+        }
+        for (int ty = rect.y0 / tile_size; ty <= rect.y1 / tile_size; ++ty) {
+            for (int tx = rect.x0 / tile_size; tx <= rect.x1 / tile_size; ++tx) {
+                (*lists)[ty * bins.tiles_x + tx].push_back(index);
+            }
+        }
+    };
+
+    std::span<const Object> objects = scene.GetObjects();
+    bins.triangle_rects.reserve(objects.size());
+    for (size_t i = 0; i < objects.size(); ++i) {
+        bins.triangle_rects.push_back(ProjectTriangle(projector, objects[i].polygon));
+        add(bins.triangle_rects.back(), static_cast<uint32_t>(i), &bins.triangles);
+    }
+    std::span<const SphereObject> spheres = scene.GetSphereObjects();
+    bins.sphere_rects.reserve(spheres.size());
+    for (size_t i = 0; i < spheres.size(); ++i) {
+        bins.sphere_rects.push_back(ProjectSphere(projector, spheres[i].sphere));
+        add(bins.sphere_rects.back(), static_cast<uint32_t>(i), &bins.spheres);
+    }
+    std::span<const PolygonObject> polygons = scene.GetPolygonObjects();
+    bins.polygon_rects.reserve(polygons.size());
+    for (size_t i = 0; i < polygons.size(); ++i) {
+        bins.polygon_rects.push_back(ProjectPolygon(projector, polygons[i].polygon));
+        add(bins.polygon_rects.back(), static_cast<uint32_t>(i), &bins.polygons);
+    }
+    return bins;
+}